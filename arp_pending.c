@@ -0,0 +1,111 @@
+#include "arp_pending.h"
+#include "pktpool.h"
+#include "stats.h"
+
+struct arp_pending *arp_pending_create()
+{
+	struct arp_pending *pending = calloc(1, sizeof(struct arp_pending));
+	DIE(!pending, "arp_pending - calloc");
+
+	return pending;
+}
+
+void arp_pending_free(struct arp_pending *pending)
+{
+	if (!pending) {
+		return;
+	}
+
+	while (pending->size) {
+		arp_pending_remove(pending, &pending->entries[0]);
+	}
+
+	free(pending);
+}
+
+struct arp_pending_entry *arp_pending_find(struct arp_pending *pending, uint32_t next_hop)
+{
+	for (int i = 0; i < pending->size; ++i) {
+		if (pending->next_hops[i] == next_hop) {
+			return &pending->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+enum arp_pending_status arp_pending_enqueue(struct arp_pending *pending, uint32_t next_hop, int interface,
+	packet *m, uint64_t now)
+{
+	enum arp_pending_status status = ARP_PENDING_QUEUED;
+	struct arp_pending_entry *entry = arp_pending_find(pending, next_hop);
+
+	// First packet towards next_hop -> start resolving it
+	if (!entry) {
+		if (pending->size == ARP_PENDING_MAX_NEIGHBORS) {
+			pending->dropped_neighbors++;
+			return ARP_PENDING_DROPPED;
+		}
+
+		pending->next_hops[pending->size] = next_hop;
+		entry = &pending->entries[pending->size++];
+		entry->next_hop = next_hop;
+		entry->interface = interface;
+		entry->count = 0;
+		entry->requests = 1;
+		entry->next_retry = now + ARP_RETRY_INITIAL_MS;
+		status = ARP_PENDING_RESOLVE;
+	}
+
+	if (entry->count == ARP_PENDING_DEPTH) {
+		pending->dropped_full++;
+		return ARP_PENDING_DROPPED;
+	}
+
+	// Zero-copy: the queue holds its own reference on m
+	pkt_ref(m);
+	entry->packets[entry->count++] = m;
+	return status;
+}
+
+void arp_pending_remove(struct arp_pending *pending, struct arp_pending_entry *entry)
+{
+	int idx = entry - pending->entries;
+
+	for (int i = 0; i < entry->count; ++i) {
+		pkt_free(entry->packets[i]);
+	}
+
+	// Swap with the last entry to keep the arrays dense
+	pending->size--;
+	if (idx != pending->size) {
+		pending->entries[idx] = pending->entries[pending->size];
+		pending->next_hops[idx] = pending->next_hops[pending->size];
+	}
+}
+
+void arp_pending_tick(struct arp_pending *pending, uint64_t now, arp_request_fn request)
+{
+	for (int i = 0; i < pending->size; ++i) {
+		struct arp_pending_entry *entry = &pending->entries[i];
+
+		if (now < entry->next_retry) {
+			continue;
+		}
+
+		// Next hop is unreachable -> drop its backlog
+		if (entry->requests == ARP_MAX_REQUESTS) {
+			pending->dropped_timeout += entry->count;
+			stats->drops[STATS_DROP_ARP_TIMEOUT] += entry->count;
+			arp_pending_remove(pending, entry);
+			// The last entry was moved into i
+			i--;
+			continue;
+		}
+
+		int backoff = ARP_RETRY_INITIAL_MS << entry->requests;
+		entry->next_retry = now + (backoff < ARP_RETRY_MAX_MS ? backoff : ARP_RETRY_MAX_MS);
+		entry->requests++;
+		request(entry->next_hop, entry->interface);
+	}
+}
@@ -0,0 +1,205 @@
+#include "arp_table.h"
+
+static inline uint32_t arp_slots_home(struct arp_slots *slots, uint32_t ip)
+{
+	// Fibonacci hashing on the top bits: neighbors are usually consecutive IPs
+	return (ip * 2654435761u) >> slots->shift;
+}
+
+static struct arp_slots *arp_slots_alloc(uint32_t capacity)
+{
+	struct arp_slots *slots = calloc(1, sizeof(struct arp_slots) + capacity * sizeof(struct arp_entry));
+	DIE(!slots, "arp_table - calloc slots");
+
+	slots->mask = capacity - 1;
+	slots->shift = 32 - __builtin_ctz(capacity);
+	return slots;
+}
+
+/* Slot holding ip, or the empty slot ending its probe sequence */
+static inline struct arp_entry *arp_slots_find(struct arp_slots *slots, uint32_t ip)
+{
+	uint32_t i = arp_slots_home(slots, ip);
+
+	while (slots->entries[i].valid && slots->entries[i].ip != ip) {
+		i = (i + 1) & slots->mask;
+	}
+
+	return &slots->entries[i];
+}
+
+/* Seqlock write section, with table->lock held */
+static inline void arp_write_begin(struct arp_table *table)
+{
+	__atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void arp_write_end(struct arp_table *table)
+{
+	__atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELEASE);
+}
+
+struct arp_table *arp_table_create()
+{
+	struct arp_table *table = calloc(1, sizeof(struct arp_table));
+	DIE(!table, "arp_table - calloc");
+
+	table->slots = arp_slots_alloc(ARP_TABLE_MIN_CAPACITY);
+	pthread_mutex_init(&table->lock, NULL);
+	return table;
+}
+
+void arp_table_free(struct arp_table *table)
+{
+	if (!table) {
+		return;
+	}
+
+	pthread_mutex_destroy(&table->lock);
+	free(table->slots);
+	free(table);
+}
+
+bool arp_table_lookup(struct arp_table *table, uint32_t ip, struct arp_entry *out)
+{
+	uint32_t seq;
+	bool found;
+
+	do {
+		// Wait out a write in progress
+		while ((seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE)) & 1) {
+		}
+
+		struct arp_entry *entry = arp_slots_find(rcu_dereference(table->slots), ip);
+		found = entry->valid;
+		if (found) {
+			*out = *entry;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&table->seq, __ATOMIC_RELAXED) != seq);
+
+	return found;
+}
+
+/* Doubles the slot array; readers keep using the old one until a grace period ends */
+static void arp_table_grow(struct arp_table *table)
+{
+	struct arp_slots *old = table->slots;
+	struct arp_slots *slots = arp_slots_alloc(2 * (old->mask + 1));
+
+	for (uint32_t i = 0; i <= old->mask; ++i) {
+		if (old->entries[i].valid) {
+			*arp_slots_find(slots, old->entries[i].ip) = old->entries[i];
+		}
+	}
+
+	rcu_assign_pointer(table->slots, slots);
+	rcu_defer(free, old);
+}
+
+enum arp_update arp_table_update(struct arp_table *table, uint32_t ip, uint8_t *mac, uint64_t now)
+{
+	enum arp_update result;
+
+	pthread_mutex_lock(&table->lock);
+
+	struct arp_entry *entry = arp_slots_find(table->slots, ip);
+
+	if (entry->valid) {
+		// Known neighbor -> update in place
+		result = memcmp(entry->mac, mac, sizeof(entry->mac)) ? ARP_CHANGED : ARP_REFRESHED;
+
+		arp_write_begin(table);
+		entry->updated = now;
+		memcpy(entry->mac, mac, sizeof(entry->mac));
+		arp_write_end(table);
+
+		if (result == ARP_CHANGED) {
+			__atomic_add_fetch(&table->version, 1, __ATOMIC_RELEASE);
+		}
+	} else if (table->size >= MAX_ARP_TABLE_SIZE) {
+		result = ARP_FULL;
+	} else {
+		// Keep the load factor under 1/2
+		if (2 * (uint32_t) (table->size + 1) > table->slots->mask + 1) {
+			arp_table_grow(table);
+			entry = arp_slots_find(table->slots, ip);
+		}
+
+		arp_write_begin(table);
+		entry->ip = ip;
+		memcpy(entry->mac, mac, sizeof(entry->mac));
+		entry->updated = now;
+		entry->valid = 1;
+		arp_write_end(table);
+
+		table->size++;
+		result = ARP_NEW;
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return result;
+}
+
+/*
+	Backward-shift deletion: move back every following entry of the cluster
+	whose home slot does not lie in (hole, slot], so no lookup ever stops
+	early on the freed slot. Called inside a write section.
+*/
+static void arp_slots_remove(struct arp_slots *slots, uint32_t hole)
+{
+	uint32_t i = hole;
+
+	while (1) {
+		i = (i + 1) & slots->mask;
+		if (!slots->entries[i].valid) {
+			break;
+		}
+
+		uint32_t home = arp_slots_home(slots, slots->entries[i].ip);
+		if (((i - home) & slots->mask) >= ((i - hole) & slots->mask)) {
+			slots->entries[hole] = slots->entries[i];
+			hole = i;
+		}
+	}
+
+	slots->entries[hole].valid = 0;
+}
+
+int arp_table_age(struct arp_table *table, uint64_t now)
+{
+	int removed = 0;
+
+	// Aging can wait: never make a worker block on another one
+	if (pthread_mutex_trylock(&table->lock)) {
+		return 0;
+	}
+
+	struct arp_slots *slots = table->slots;
+
+	for (int i = 0; i < ARP_AGING_BUDGET; ++i) {
+		struct arp_entry *entry = &slots->entries[table->cursor];
+
+		if (entry->valid && now - entry->updated > ARP_ENTRY_TIMEOUT_MS) {
+			arp_write_begin(table);
+			arp_slots_remove(slots, table->cursor);
+			arp_write_end(table);
+
+			table->size--;
+			removed++;
+			// An entry may have been shifted into the cursor: look at it again
+			continue;
+		}
+
+		table->cursor = (table->cursor + 1) & slots->mask;
+	}
+
+	if (removed) {
+		__atomic_add_fetch(&table->version, removed, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return removed;
+}
@@ -0,0 +1,676 @@
+/*
+ * LPM benchmark and differential checker for the FIB engines.
+ *
+ *   gcc -O2 -pthread -Iinclude bench/lpm_bench.c $(ls *.c | grep -v router.c) -o lpm_bench -lm
+ *   ./lpm_bench -n 1000000            synthetic Internet-like table
+ *   ./lpm_bench -r rtable.txt         a route file
+ *
+ * Options:
+ *   -n prefixes   size of the synthetic table (default 500000)
+ *   -r file       benchmark a route file instead
+ *   -l lookups    addresses per stream (default 10000000)
+ *   -z exponent   Zipf exponent of the skewed stream (default 1.0)
+ *   -e engines    comma separated engines (default bsearch,dir24_8,tbm)
+ *   -s seed       seed of the table and the streams
+ *
+ * Every engine is first checked against a reference: one exact-match hash
+ * table per prefix length, searched from /32 down, itself checked against a
+ * linear scan of the table. The addresses checked are the first and last
+ * ones of every prefix, their neighbors, and random ones. Then each engine
+ * runs three address streams:
+ *   random      uniform over the covered prefixes
+ *   zipf        prefixes drawn by popularity rank (Zipf), random host
+ *   sequential  consecutive addresses
+ * one lookup at a time (fib_lookup) and by bursts (fib_lookup_bulk). Cycles,
+ * instructions and cache misses come from perf_event_open; where the
+ * counters are not available, cycles are read from the TSC.
+ *
+ * Exits with 1 if any engine disagrees with the reference.
+ */
+#include "fib.h"
+#include "rtable.h"
+#include <getopt.h>
+#include <math.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Mismatches printed per engine */
+#define MAX_REPORTED 5
+/* Addresses the reference itself is checked on, against a linear scan */
+#define REFERENCE_SELF_CHECKS 2000
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/* xorshift64* */
+static uint64_t rng()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t read_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static inline uint32_t len_mask(int len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+/*
+ * Reference LPM: (prefix, length) -> route, open addressing. Obviously
+ * correct rather than fast: up to 33 probes per lookup.
+ */
+struct reference {
+	struct route_table_entry **slots;
+	uint32_t mask;
+	int size;
+	/* Prefix lengths present, longest first */
+	int lengths[33];
+	int num_lengths;
+	bool has_length[33];
+};
+
+static inline uint32_t reference_slot(struct reference *ref, uint32_t prefix, int len)
+{
+	uint64_t key = (uint64_t) prefix << 6 | len;
+
+	return (key * 0x9e3779b97f4a7c15ull) >> 32 & ref->mask;
+}
+
+static struct route_table_entry **reference_find(struct reference *ref, uint32_t prefix, int len)
+{
+	uint32_t i = reference_slot(ref, prefix, len);
+
+	while (ref->slots[i] && (ref->slots[i]->prefix != prefix || __builtin_popcount(ref->slots[i]->mask) != len)) {
+		i = (i + 1) & ref->mask;
+	}
+
+	return &ref->slots[i];
+}
+
+static void reference_init(struct reference *ref, int capacity)
+{
+	uint32_t slots = 1;
+
+	// Load factor under 1/2
+	while (slots < 2 * (uint32_t) capacity + 2) {
+		slots <<= 1;
+	}
+
+	memset(ref, 0, sizeof(struct reference));
+	ref->slots = calloc(slots, sizeof(struct route_table_entry *));
+	DIE(!ref->slots, "calloc reference");
+	ref->mask = slots - 1;
+}
+
+/* Adds route, replacing a route with the same prefix: the last one wins */
+static bool reference_add(struct reference *ref, struct route_table_entry *route)
+{
+	int len = __builtin_popcount(route->mask);
+	struct route_table_entry **slot = reference_find(ref, route->prefix & route->mask, len);
+	bool added = !*slot;
+
+	*slot = route;
+	ref->size += added;
+	ref->has_length[len] = true;
+	return added;
+}
+
+static void reference_finish(struct reference *ref)
+{
+	ref->num_lengths = 0;
+	for (int len = 32; len >= 0; --len) {
+		if (ref->has_length[len]) {
+			ref->lengths[ref->num_lengths++] = len;
+		}
+	}
+}
+
+static struct route_table_entry *reference_lookup(struct reference *ref, uint32_t addr)
+{
+	for (int i = 0; i < ref->num_lengths; ++i) {
+		int len = ref->lengths[i];
+		struct route_table_entry *route = *reference_find(ref, addr & len_mask(len), len);
+
+		if (route) {
+			return route;
+		}
+	}
+
+	return NULL;
+}
+
+/* The plainest LPM there is, to check the reference with */
+static struct route_table_entry *linear_lookup(struct route_table_entry *rtable, int rtable_size, uint32_t addr)
+{
+	struct route_table_entry *best = NULL;
+
+	for (int i = 0; i < rtable_size; ++i) {
+		if ((addr & rtable[i].mask) == (rtable[i].prefix & rtable[i].mask)
+				&& (!best || rtable[i].mask >= best->mask)) {
+			best = &rtable[i];
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Prefix length shares of a global BGP table (per 100000 prefixes): mostly
+ * /24, then /22, /23, /21 and /20, a few /16s, almost nothing longer
+ */
+static const int length_weights[33] = {
+	[8] = 1, [9] = 1, [10] = 3, [11] = 8, [12] = 25, [13] = 50, [14] = 100,
+	[15] = 170, [16] = 1300, [17] = 800, [18] = 1400, [19] = 2700,
+	[20] = 4200, [21] = 4600, [22] = 10500, [23] = 9000, [24] = 60000,
+	[25] = 20, [26] = 20, [27] = 20, [28] = 15, [29] = 15, [30] = 10,
+	[31] = 5, [32] = 30,
+};
+
+static int random_length()
+{
+	int total = 0;
+
+	for (int len = 0; len <= 32; ++len) {
+		total += length_weights[len];
+	}
+
+	int roll = rng() % total;
+	for (int len = 0; len <= 32; ++len) {
+		roll -= length_weights[len];
+		if (roll < 0) {
+			return len;
+		}
+	}
+
+	return 24;
+}
+
+/*
+ * Synthetic table of size distinct prefixes with the BGP length shares. A
+ * third of them are more-specifics of a shorter prefix already in the table,
+ * as announced by customers or for traffic engineering.
+ */
+static struct route_table_entry *synthetic_table(int size, struct reference *ref)
+{
+	struct route_table_entry *rtable = malloc((size + 1) * sizeof(struct route_table_entry));
+	DIE(!rtable, "malloc rtable");
+
+	reference_init(ref, size);
+
+	int count = 0;
+	while (count < size) {
+		int len = random_length();
+		uint32_t mask = len_mask(len);
+		struct route_table_entry *parent = count ? &rtable[rng() % count] : NULL;
+		uint32_t addr;
+
+		if (parent && rng() % 3 == 0 && __builtin_popcount(parent->mask) < len) {
+			addr = parent->prefix | ((uint32_t) rng() & ~parent->mask);
+		} else {
+			// Unicast space, 1.0.0.0 - 223.255.255.255
+			addr = (1 + rng() % 223) << 24 | ((uint32_t) rng() & 0xffffff);
+		}
+
+		// Distinct prefixes only
+		struct route_table_entry **slot = reference_find(ref, addr & mask, len);
+		if (*slot) {
+			continue;
+		}
+
+		int interface = rng() % 4;
+		rtable[count] = (struct route_table_entry) {
+			.prefix = addr & mask,
+			.next_hop = 10u << 24 | interface << 16 | (2 + rng() % 8),
+			.mask = mask,
+			.interface = interface,
+		};
+		*slot = &rtable[count++];
+	}
+
+	return rtable;
+}
+
+/* Zipf(exponent) over n ranks: cdf[i] = P(rank <= i) */
+static double *zipf_cdf(int n, double exponent)
+{
+	double *cdf = malloc(n * sizeof(double));
+	DIE(!cdf, "malloc cdf");
+	double sum = 0;
+
+	for (int i = 0; i < n; ++i) {
+		sum += 1.0 / pow(i + 1, exponent);
+		cdf[i] = sum;
+	}
+	for (int i = 0; i < n; ++i) {
+		cdf[i] /= sum;
+	}
+
+	return cdf;
+}
+
+static int zipf_rank(const double *cdf, int n)
+{
+	double u = (rng() >> 11) * (1.0 / (1ull << 53));
+	int lo = 0, hi = n - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (cdf[mid] < u) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static inline uint32_t random_host(const struct route_table_entry *route)
+{
+	return route->prefix | ((uint32_t) rng() & ~route->mask);
+}
+
+enum stream {
+	STREAM_RANDOM,
+	STREAM_ZIPF,
+	STREAM_SEQUENTIAL,
+	NUM_STREAMS,
+};
+
+static const char *stream_names[] = { "random", "zipf", "sequential" };
+
+static uint32_t *make_stream(enum stream stream, struct route_table_entry *rtable, int rtable_size, long n, double exponent)
+{
+	uint32_t *addrs = malloc(n * sizeof(uint32_t));
+	DIE(!addrs, "malloc stream");
+
+	switch (stream) {
+	case STREAM_RANDOM:
+		for (long i = 0; i < n; ++i) {
+			addrs[i] = random_host(&rtable[rng() % rtable_size]);
+		}
+		break;
+	case STREAM_ZIPF: {
+		// Popularity ranks given to the prefixes at random
+		int *order = malloc(rtable_size * sizeof(int));
+		DIE(!order, "malloc order");
+		for (int i = 0; i < rtable_size; ++i) {
+			order[i] = i;
+		}
+		for (int i = rtable_size - 1; i > 0; --i) {
+			int j = rng() % (i + 1);
+			int swap = order[i];
+
+			order[i] = order[j];
+			order[j] = swap;
+		}
+
+		double *cdf = zipf_cdf(rtable_size, exponent);
+		for (long i = 0; i < n; ++i) {
+			addrs[i] = random_host(&rtable[order[zipf_rank(cdf, rtable_size)]]);
+		}
+		free(cdf);
+		free(order);
+		break;
+	}
+	default: {
+		uint32_t start = random_host(&rtable[rng() % rtable_size]);
+
+		for (long i = 0; i < n; ++i) {
+			addrs[i] = start + i;
+		}
+		break;
+	}
+	}
+
+	return addrs;
+}
+
+static bool same_route(const struct route_table_entry *a, const struct route_table_entry *b)
+{
+	if (!a || !b) {
+		return a == b;
+	}
+
+	return (a->prefix & a->mask) == (b->prefix & b->mask) && a->mask == b->mask
+		&& a->next_hop == b->next_hop && a->interface == b->interface;
+}
+
+static void print_route(const char *what, const struct route_table_entry *route)
+{
+	if (!route) {
+		printf(" %s none", what);
+		return;
+	}
+
+	struct in_addr prefix = { htonl(route->prefix & route->mask) };
+	printf(" %s %s/%d", what, inet_ntoa(prefix), __builtin_popcount(route->mask));
+}
+
+/* Addresses worth checking: around both ends of every prefix, and random ones */
+static uint32_t *check_addresses(struct route_table_entry *rtable, int rtable_size, long *n)
+{
+	long count = 0, random = 4 * (long) rtable_size + 100000;
+	uint32_t *addrs = malloc((4 * (long) rtable_size + random) * sizeof(uint32_t));
+	DIE(!addrs, "malloc check addresses");
+
+	for (int i = 0; i < rtable_size; ++i) {
+		uint32_t first = rtable[i].prefix & rtable[i].mask;
+		uint32_t last = first | ~rtable[i].mask;
+
+		addrs[count++] = first;
+		addrs[count++] = last;
+		addrs[count++] = first - 1;
+		addrs[count++] = last + 1;
+	}
+	for (long i = 0; i < random; ++i) {
+		addrs[count++] = rng();
+	}
+
+	*n = count;
+	return addrs;
+}
+
+/* Checks the reference itself against a linear scan, on a few addresses */
+static void check_reference(struct reference *ref, struct route_table_entry *rtable, int rtable_size,
+	const uint32_t *addrs, long n)
+{
+	int checks = n < REFERENCE_SELF_CHECKS ? n : REFERENCE_SELF_CHECKS;
+
+	for (int i = 0; i < checks; ++i) {
+		// Spread over the prefix ends and the random addresses
+		uint32_t addr = addrs[(long) i * (n / checks)];
+
+		DIE(!same_route(reference_lookup(ref, addr), linear_lookup(rtable, rtable_size, addr)),
+			"reference disagrees with the linear scan");
+	}
+}
+
+/* Compares every lookup of fib with the reference; returns the mismatches */
+static long check_engine(struct fib *fib, struct reference *ref, const uint32_t *addrs, long n)
+{
+	struct route_table_entry *bulk[MAX_BURST];
+	long mismatches = 0;
+
+	for (long i = 0; i < n; ++i) {
+		struct route_table_entry *want = reference_lookup(ref, addrs[i]);
+		struct route_table_entry *got = fib_lookup(fib, addrs[i]);
+
+		// The burst path must agree too
+		if (i % MAX_BURST == 0) {
+			fib_lookup_bulk(fib, addrs + i, n - i < MAX_BURST ? n - i : MAX_BURST, bulk);
+		}
+		struct route_table_entry *got_bulk = bulk[i % MAX_BURST];
+
+		if (same_route(got, want) && same_route(got_bulk, want)) {
+			continue;
+		}
+
+		if (++mismatches <= MAX_REPORTED) {
+			struct in_addr addr = { htonl(addrs[i]) };
+
+			printf("    %s:", inet_ntoa(addr));
+			print_route("got", got);
+			if (!same_route(got_bulk, got)) {
+				print_route("bulk", got_bulk);
+			}
+			print_route("want", want);
+			printf("\n");
+		}
+	}
+
+	return mismatches;
+}
+
+/* Hardware counters of the calling thread; fd -1 where not available */
+enum counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,
+	NUM_COUNTERS,
+};
+
+struct counters {
+	int fd[NUM_COUNTERS];
+	uint64_t value[NUM_COUNTERS];
+	uint64_t tsc;
+};
+
+static void counters_open(struct counters *c)
+{
+	static const uint64_t configs[NUM_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+	};
+
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		struct perf_event_attr attr = {
+			.type = PERF_TYPE_HARDWARE,
+			.size = sizeof(struct perf_event_attr),
+			.config = configs[i],
+			.disabled = 1,
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+		};
+
+		c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+static void counters_start(struct counters *c)
+{
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		if (c->fd[i] >= 0) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	c->tsc = read_tsc();
+}
+
+static void counters_stop(struct counters *c)
+{
+	c->tsc = read_tsc() - c->tsc;
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		c->value[i] = 0;
+		if (c->fd[i] >= 0) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			DIE(read(c->fd[i], &c->value[i], sizeof(uint64_t)) != sizeof(uint64_t), "read counter");
+		}
+	}
+}
+
+static void print_counter(struct counters *c, enum counter counter, long n)
+{
+	if (c->fd[counter] >= 0) {
+		printf(" %9.2f", (double) c->value[counter] / n);
+	} else if (counter == COUNTER_CYCLES && c->tsc) {
+		printf(" %8.2ft", (double) c->tsc / n);
+	} else {
+		printf(" %9s", "n/a");
+	}
+}
+
+/* Keeps the lookups from being optimized away */
+static volatile uintptr_t sink;
+
+static void bench_stream(struct fib *fib, const char *stream, const uint32_t *addrs, long n, struct counters *c)
+{
+	struct route_table_entry *out[MAX_BURST];
+
+	for (int bulk = 0; bulk < 2; ++bulk) {
+		uintptr_t sum = 0;
+
+		counters_start(c);
+		uint64_t start = now_ns();
+
+		if (bulk) {
+			for (long i = 0; i < n; i += MAX_BURST) {
+				int count = n - i < MAX_BURST ? n - i : MAX_BURST;
+
+				fib_lookup_bulk(fib, addrs + i, count, out);
+				for (int j = 0; j < count; ++j) {
+					sum += (uintptr_t) out[j];
+				}
+			}
+		} else {
+			for (long i = 0; i < n; ++i) {
+				sum += (uintptr_t) fib_lookup(fib, addrs[i]);
+			}
+		}
+
+		uint64_t elapsed = now_ns() - start;
+		counters_stop(c);
+		sink = sum;
+
+		printf("  %-8s %-11s %-6s %9.2f %9.2f", fib_engine_name(fib->engine), stream, bulk ? "bulk" : "single",
+			n / (elapsed / 1e9) / 1e6, (double) elapsed / n);
+		print_counter(c, COUNTER_CYCLES, n);
+		print_counter(c, COUNTER_INSTRUCTIONS, n);
+		print_counter(c, COUNTER_CACHE_MISSES, n);
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int size = 500000;
+	long lookups = 10000000;
+	double exponent = 1.0;
+	const char *rtable_file = NULL;
+	char engines[256] = "bsearch,dir24_8,tbm";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:l:z:e:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			size = atoi(optarg);
+			break;
+		case 'r':
+			rtable_file = optarg;
+			break;
+		case 'l':
+			lookups = atol(optarg);
+			break;
+		case 'z':
+			exponent = atof(optarg);
+			break;
+		case 'e':
+			snprintf(engines, sizeof(engines), "%s", optarg);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n prefixes | -r rtable] [-l lookups] [-z exponent] [-e engines] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+	DIE(size < 1 || lookups < 1, "table size and lookups must be positive");
+
+	struct reference ref;
+	struct route_table_entry *rtable;
+	int rtable_size;
+
+	if (rtable_file) {
+		rtable = rtable_load(rtable_file, 1, &rtable_size);
+		DIE(!rtable_size, "empty route file");
+		reference_init(&ref, rtable_size);
+	} else {
+		rtable = synthetic_table(size, &ref);
+		rtable_size = size;
+	}
+
+	// The engines expect (prefix, mask) order. Routes move with the sort:
+	// index them again, the last duplicate wins as in the engines
+	rtable_sort(rtable, rtable_size);
+	ref.size = 0;
+	memset(ref.slots, 0, (ref.mask + 1) * sizeof(struct route_table_entry *));
+	for (int i = 0; i < rtable_size; ++i) {
+		reference_add(&ref, &rtable[i]);
+	}
+	reference_finish(&ref);
+
+	int histogram[33] = { 0 };
+	for (int i = 0; i < rtable_size; ++i) {
+		histogram[__builtin_popcount(rtable[i].mask)]++;
+	}
+	printf("Table: %d routes, %d distinct prefixes (%s)\n  lengths:", rtable_size, ref.size,
+		rtable_file ? rtable_file : "synthetic");
+	for (int len = 0; len <= 32; ++len) {
+		if (histogram[len]) {
+			printf(" /%d %.2f%%", len, 100.0 * histogram[len] / rtable_size);
+		}
+	}
+	printf("\n");
+
+	long num_checks;
+	uint32_t *checks = check_addresses(rtable, rtable_size, &num_checks);
+	check_reference(&ref, rtable, rtable_size, checks, num_checks);
+
+	uint32_t *streams[NUM_STREAMS];
+	for (int s = 0; s < NUM_STREAMS; ++s) {
+		streams[s] = make_stream(s, rtable, rtable_size, lookups, exponent);
+	}
+
+	struct counters counters;
+	counters_open(&counters);
+
+	bool failed = false;
+	char *saveptr;
+	for (char *name = strtok_r(engines, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		enum fib_engine engine = fib_engine_from_name(name);
+
+		uint64_t start = now_ns();
+		struct fib *fib = fib_create(engine, rtable, rtable_size);
+		uint64_t build = now_ns() - start;
+		size_t memory = fib_memory(fib);
+
+		printf("\n%s: built in %.1f ms, %.1f MB, %.1f bytes/prefix\n", name, build / 1e6,
+			memory / 1e6, (double) memory / rtable_size);
+
+		long mismatches = check_engine(fib, &ref, checks, num_checks);
+		printf("  check: %ld addresses, %ld mismatches -> %s\n", num_checks, mismatches, mismatches ? "FAIL" : "ok");
+		failed |= mismatches > 0;
+
+		printf("  %-8s %-11s %-6s %9s %9s %9s %9s %9s\n", "engine", "stream", "mode", "Mlookup/s", "ns/lookup",
+			"cycles", "instr", "misses");
+		for (int s = 0; s < NUM_STREAMS; ++s) {
+			bench_stream(fib, stream_names[s], streams[s], lookups, &counters);
+		}
+
+		fib_free(fib);
+	}
+
+	if (counters.fd[COUNTER_CYCLES] < 0) {
+		printf("\nperf_event_open unavailable: cycles read from the TSC (t), no instruction or miss counts\n");
+	}
+
+	for (int s = 0; s < NUM_STREAMS; ++s) {
+		free(streams[s]);
+	}
+	free(checks);
+	free(ref.slots);
+	free(rtable);
+	return failed;
+}
@@ -0,0 +1,289 @@
+/*
+ * Forwarding benchmark: generates a route table and the captures of a
+ * traffic mix, to be replayed through the router by the pcap backend
+ * (pcap_io.h), which reports Mpps, ns/packet and latency percentiles.
+ *
+ *   gcc -O2 -Iinclude bench/traffic_gen.c -o traffic_gen
+ *   gcc -O2 -pthread -Iinclude *.c -o router
+ *   ./traffic_gen /tmp/bench mixed 1000000 10000
+ *   ROUTER_IO=pcap ROUTER_PCAP_IN=/tmp/bench ROUTER_PCAP_LOOPS=10 \
+ *           ROUTER_ICMP_RATE=0 ROUTER_ICMP_SRC_RATE=0 \
+ *           ./router /tmp/bench/rtable.txt if0=10.0.0.1 if1=10.1.0.1 \
+ *           if2=10.2.0.1 if3=10.3.0.1
+ *
+ * Every packet comes from the same host, so with the default ICMP rate
+ * limits (1000/s overall, 100/s per source /24) nearly every echo reply and
+ * ICMP error the router sends is suppressed, and the ttl, echo and mixed
+ * runs would measure dropping instead of answering: throughput runs turn
+ * the limits off (0: unlimited), as above. Leave them on to measure the
+ * cost of the limiting itself.
+ *
+ * Mixes (all ICMP echo requests entering on if0, from 10.0.0.2):
+ *   forward   towards the routes behind if1..if3, whose neighbors answered ARP
+ *   arp-miss  towards routes whose next hop never answers ARP
+ *   ttl       TTL 1: answered by time exceeded
+ *   echo      to the router itself
+ *   mixed     70% forward, 10% of each of the others
+ *
+ * Every interface also receives an ARP reply from its neighbor (10.<i>.0.2)
+ * first, so forwarded traffic finds its next hops resolved.
+ */
+#include "pcap_io.h"
+
+#define BENCH_INTERFACES 4
+/* Routes whose next hop (10.<i>.0.3 and up) never answers */
+#define BENCH_UNRESOLVED 16
+/* ICMP echo payload: 60 bytes frames, the Ethernet minimum */
+#define BENCH_PAYLOAD 18
+
+enum bench_kind {
+	BENCH_FORWARD,
+	BENCH_ARP_MISS,
+	BENCH_TTL,
+	BENCH_ECHO,
+};
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dull;
+
+/* xorshift64*: the same captures on every run */
+static uint64_t rng()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+/* Internet checksum of len bytes */
+static uint16_t checksum(const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i + 1 < len; i += 2) {
+		sum += bytes[i] << 8 | bytes[i + 1];
+	}
+	if (len & 1) {
+		sum += bytes[len - 1] << 8;
+	}
+
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return htons(~sum);
+}
+
+static void router_mac(int interface, uint8_t *mac)
+{
+	uint8_t router[ETH_ALEN] = { PCAP_IO_MAC_PREFIX, interface + 1 };
+
+	memcpy(mac, router, ETH_ALEN);
+}
+
+static void neighbor_mac(int interface, uint8_t *mac)
+{
+	uint8_t neighbor[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x01, interface + 1 };
+
+	memcpy(mac, neighbor, ETH_ALEN);
+}
+
+static FILE *pcap_create(const char *dir, const char *name)
+{
+	char path[4096];
+	struct pcap_file_header header = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = MAX_LEN,
+		.linktype = PCAP_LINKTYPE_ETHERNET,
+	};
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *file = fopen(path, "wb");
+	DIE(!file, "fopen");
+	DIE(fwrite(&header, sizeof(header), 1, file) != 1, "fwrite");
+	return file;
+}
+
+static void pcap_append(FILE *file, uint64_t ts_us, const uint8_t *frame, uint32_t len)
+{
+	struct pcap_record_header record = {
+		.ts_sec = ts_us / 1000000,
+		.ts_frac = ts_us % 1000000,
+		.incl_len = len,
+		.orig_len = len,
+	};
+
+	DIE(fwrite(&record, sizeof(record), 1, file) != 1, "fwrite");
+	DIE(fwrite(frame, len, 1, file) != 1, "fwrite");
+}
+
+/* ARP reply from the neighbor of interface to the router */
+static void write_arp_reply(FILE *file, int interface)
+{
+	uint8_t frame[sizeof(struct ether_header) + sizeof(struct arp_header)];
+	struct ether_header *eth_hdr = (struct ether_header *) frame;
+	struct arp_header *arp_hdr = (struct arp_header *) (frame + sizeof(struct ether_header));
+
+	router_mac(interface, eth_hdr->ether_dhost);
+	neighbor_mac(interface, eth_hdr->ether_shost);
+	eth_hdr->ether_type = htons(ETHERTYPE_ARP);
+
+	arp_hdr->htype = htons(ARPHRD_ETHER);
+	arp_hdr->ptype = htons(ETHERTYPE_IP);
+	arp_hdr->hlen = ETH_ALEN;
+	arp_hdr->plen = 4;
+	arp_hdr->op = htons(ARPOP_REPLY);
+	neighbor_mac(interface, arp_hdr->sha);
+	arp_hdr->spa = htonl(10u << 24 | interface << 16 | 2);
+	router_mac(interface, arp_hdr->tha);
+	arp_hdr->tpa = htonl(10u << 24 | interface << 16 | 1);
+
+	pcap_append(file, 0, frame, sizeof(frame));
+}
+
+/* ICMP echo request entering on if0, addresses in host byte order */
+static void write_echo(FILE *file, uint64_t ts_us, uint32_t daddr, uint8_t ttl, uint16_t seq)
+{
+	uint8_t frame[sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr) + BENCH_PAYLOAD];
+	struct ether_header *eth_hdr = (struct ether_header *) frame;
+	struct iphdr *ip_hdr = (struct iphdr *) (frame + sizeof(struct ether_header));
+	struct icmphdr *icmp_hdr = (struct icmphdr *) (frame + sizeof(struct ether_header) + sizeof(struct iphdr));
+
+	memset(frame, 0, sizeof(frame));
+	router_mac(0, eth_hdr->ether_dhost);
+	neighbor_mac(0, eth_hdr->ether_shost);
+	eth_hdr->ether_type = htons(ETHERTYPE_IP);
+
+	ip_hdr->version = 4;
+	ip_hdr->ihl = 5;
+	ip_hdr->tot_len = htons(sizeof(frame) - sizeof(struct ether_header));
+	ip_hdr->id = htons(seq);
+	ip_hdr->ttl = ttl;
+	ip_hdr->protocol = IPPROTO_ICMP;
+	ip_hdr->saddr = htonl(10u << 24 | 2);
+	ip_hdr->daddr = htonl(daddr);
+	ip_hdr->check = checksum(ip_hdr, sizeof(struct iphdr));
+
+	icmp_hdr->type = ICMP_ECHO;
+	icmp_hdr->un.echo.id = htons(0x4242);
+	icmp_hdr->un.echo.sequence = htons(seq);
+	memset(frame + sizeof(frame) - BENCH_PAYLOAD, 0xa5, BENCH_PAYLOAD);
+	icmp_hdr->checksum = checksum(icmp_hdr, sizeof(struct icmphdr) + BENCH_PAYLOAD);
+
+	pcap_append(file, ts_us, frame, sizeof(frame));
+}
+
+static void print_route(FILE *file, uint32_t prefix, uint32_t next_hop, uint32_t mask, int interface)
+{
+	fprintf(file, "%u.%u.%u.%u %u.%u.%u.%u %u.%u.%u.%u %d\n",
+		prefix >> 24, prefix >> 16 & 0xff, prefix >> 8 & 0xff, prefix & 0xff,
+		next_hop >> 24, next_hop >> 16 & 0xff, next_hop >> 8 & 0xff, next_hop & 0xff,
+		mask >> 24, mask >> 16 & 0xff, mask >> 8 & 0xff, mask & 0xff, interface);
+}
+
+static enum bench_kind pick_kind(const char *mix)
+{
+	if (!strcmp(mix, "forward")) {
+		return BENCH_FORWARD;
+	}
+	if (!strcmp(mix, "arp-miss")) {
+		return BENCH_ARP_MISS;
+	}
+	if (!strcmp(mix, "ttl")) {
+		return BENCH_TTL;
+	}
+	if (!strcmp(mix, "echo")) {
+		return BENCH_ECHO;
+	}
+
+	// mixed
+	int roll = rng() % 10;
+	return roll < 7 ? BENCH_FORWARD : roll - 6;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <dir> <forward|arp-miss|ttl|echo|mixed> [frames] [routes]\n", argv[0]);
+		return 1;
+	}
+
+	const char *dir = argv[1];
+	const char *mix = argv[2];
+	long frames = argc > 3 ? atol(argv[3]) : 1000000;
+	int routes = argc > 4 ? atoi(argv[4]) : 10000;
+	char path[4096];
+
+	DIE(strcmp(mix, "forward") && strcmp(mix, "arp-miss") && strcmp(mix, "ttl")
+		&& strcmp(mix, "echo") && strcmp(mix, "mixed"), "unknown mix");
+	DIE(frames < 1 || routes < 1, "frames and routes must be positive");
+
+	// Routes: the neighbors' subnets, random prefixes behind if1..if3, and
+	// the unresolved ones
+	uint32_t *prefixes = malloc(routes * sizeof(uint32_t));
+	uint32_t *masks = malloc(routes * sizeof(uint32_t));
+	DIE(!prefixes || !masks, "malloc");
+
+	snprintf(path, sizeof(path), "%s/rtable.txt", dir);
+	FILE *rtable = fopen(path, "w");
+	DIE(!rtable, "fopen rtable");
+
+	for (int i = 0; i < BENCH_INTERFACES; ++i) {
+		print_route(rtable, 10u << 24 | i << 16, 10u << 24 | i << 16 | 2, 0xffffff00, i);
+	}
+	for (int i = 0; i < routes; ++i) {
+		int len = 16 + rng() % 9;
+		int interface = 1 + rng() % (BENCH_INTERFACES - 1);
+
+		masks[i] = ~0u << (32 - len);
+		// 11.0.0.0 - 199.255.255.255: clear of the other routes
+		prefixes[i] = ((11 + rng() % 189) << 24 | (rng() & 0xffffff)) & masks[i];
+		print_route(rtable, prefixes[i], 10u << 24 | interface << 16 | 2, masks[i], interface);
+	}
+	for (int i = 0; i < BENCH_UNRESOLVED; ++i) {
+		int interface = 1 + i % (BENCH_INTERFACES - 1);
+
+		print_route(rtable, 200u << 24 | i << 16, 10u << 24 | interface << 16 | (3 + i), 0xffff0000, interface);
+	}
+	DIE(fclose(rtable), "fclose rtable");
+
+	// The neighbors answer ARP before any traffic
+	FILE *captures[BENCH_INTERFACES];
+	for (int i = 0; i < BENCH_INTERFACES; ++i) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "if%d.pcap", i);
+		captures[i] = pcap_create(dir, name);
+		write_arp_reply(captures[i], i);
+	}
+
+	for (long n = 0; n < frames; ++n) {
+		uint32_t host = rng();
+		int route = rng() % routes;
+
+		switch (pick_kind(mix)) {
+		case BENCH_FORWARD:
+			write_echo(captures[0], 1 + n, prefixes[route] | (host & ~masks[route]), 64, n);
+			break;
+		case BENCH_ARP_MISS:
+			write_echo(captures[0], 1 + n, 200u << 24 | (host % BENCH_UNRESOLVED) << 16 | (host & 0xffff), 64, n);
+			break;
+		case BENCH_TTL:
+			write_echo(captures[0], 1 + n, prefixes[route] | (host & ~masks[route]), 1, n);
+			break;
+		case BENCH_ECHO:
+			write_echo(captures[0], 1 + n, 10u << 24 | 1, 64, n);
+			break;
+		}
+	}
+
+	for (int i = 0; i < BENCH_INTERFACES; ++i) {
+		DIE(fclose(captures[i]), "fclose capture");
+	}
+	free(prefixes);
+	free(masks);
+
+	printf("%s: %ld frames (%s), %d routes\n", dir, frames, mix, routes + BENCH_INTERFACES + BENCH_UNRESOLVED);
+	return 0;
+}
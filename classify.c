@@ -0,0 +1,25 @@
+#include "classify.h"
+
+bool ipv4_options_valid(const struct iphdr *ip_hdr)
+{
+	const uint8_t *options = (const uint8_t *) ip_hdr + sizeof(struct iphdr);
+	int len = ip_hdr->ihl * 4 - sizeof(struct iphdr);
+
+	for (int i = 0; i < len;) {
+		switch (options[i]) {
+		case IPOPT_END:
+			return true;
+		case IPOPT_NOOP:
+			i++;
+			break;
+		default:
+			// Type, length (counting both), data: within the header
+			if (i + 1 >= len || options[i + 1] < 2 || i + options[i + 1] > len) {
+				return false;
+			}
+			i += options[i + 1];
+		}
+	}
+
+	return true;
+}
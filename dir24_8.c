@@ -0,0 +1,330 @@
+#include "dir24_8.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static uint32_t dir24_8_alloc_group(struct dir24_8 *fib, uint32_t fill)
+{
+	// Grow tbl8 geometrically
+	if (fib->tbl8_groups == fib->tbl8_capacity) {
+		fib->tbl8_capacity = fib->tbl8_capacity ? 2 * fib->tbl8_capacity : 64;
+		fib->tbl8 = realloc(fib->tbl8, (size_t) fib->tbl8_capacity * DIR24_8_TBL8_GROUP_SIZE * sizeof(uint32_t));
+		DIE(!fib->tbl8, "dir24_8 - realloc tbl8");
+	}
+
+	// New group inherits the route of the /24 it replaces
+	uint32_t *group = &fib->tbl8[(size_t) fib->tbl8_groups * DIR24_8_TBL8_GROUP_SIZE];
+	for (int i = 0; i < DIR24_8_TBL8_GROUP_SIZE; ++i) {
+		group[i] = fill;
+	}
+
+	return fib->tbl8_groups++;
+}
+
+static void dir24_8_insert(struct dir24_8 *fib, int idx)
+{
+	struct route_table_entry *route = &fib->rtable[idx];
+	int len = __builtin_popcount(route->mask);
+	uint32_t prefix = route->prefix & route->mask;
+	uint32_t value = idx + 1;
+
+	if (len <= 24) {
+		uint32_t first = prefix >> 8;
+		uint32_t count = 1u << (24 - len);
+
+		for (uint32_t i = first; i < first + count; ++i) {
+			fib->tbl24[i] = value;
+		}
+		return;
+	}
+
+	// Prefix longer than /24 -> expand its /24 into a tbl8 group
+	uint32_t *slot = &fib->tbl24[prefix >> 8];
+	if (!(*slot & DIR24_8_EXT_FLAG)) {
+		*slot = DIR24_8_EXT_FLAG | dir24_8_alloc_group(fib, *slot);
+	}
+
+	uint32_t *group = &fib->tbl8[(size_t) (*slot & ~DIR24_8_EXT_FLAG) * DIR24_8_TBL8_GROUP_SIZE];
+	uint32_t first = prefix & 0xff;
+	uint32_t count = 1u << (32 - len);
+
+	for (uint32_t i = first; i < first + count; ++i) {
+		group[i] = value;
+	}
+}
+
+struct dir24_8 *dir24_8_build(struct route_table_entry *rtable, int rtable_size)
+{
+	struct dir24_8 *fib = calloc(1, sizeof(struct dir24_8));
+	DIE(!fib, "dir24_8 - calloc fib");
+
+	fib->rtable = rtable;
+	fib->rtable_size = rtable_size;
+	fib->tbl24 = calloc(DIR24_8_TBL24_SIZE, sizeof(uint32_t));
+	DIE(!fib->tbl24, "dir24_8 - calloc tbl24");
+
+	/*
+		Insert routes by ascending prefix length (counting sort on the mask),
+		so that longer prefixes overwrite the shorter ones they are nested in.
+		This also means tbl8 groups are only ever created after every /0../24
+		route has been painted into tbl24.
+	*/
+	int start[34] = {0};
+	for (int i = 0; i < rtable_size; ++i) {
+		start[__builtin_popcount(rtable[i].mask) + 1]++;
+	}
+	for (int len = 1; len <= 33; ++len) {
+		start[len] += start[len - 1];
+	}
+
+	int *order = malloc((rtable_size + 1) * sizeof(int));
+	DIE(!order, "dir24_8 - malloc order");
+	for (int i = 0; i < rtable_size; ++i) {
+		order[start[__builtin_popcount(rtable[i].mask)]++] = i;
+	}
+
+	for (int i = 0; i < rtable_size; ++i) {
+		dir24_8_insert(fib, order[i]);
+	}
+
+	free(order);
+	return fib;
+}
+
+void dir24_8_free(struct dir24_8 *fib)
+{
+	if (!fib) {
+		return;
+	}
+
+	free(fib->tbl24);
+	free(fib->tbl8);
+	free(fib->free_routes);
+	free(fib->free_groups);
+	free(fib->retired_routes);
+	free(fib->retired_groups);
+	free(fib);
+}
+
+void dir24_8_reserve(struct dir24_8 *fib, uint32_t rtable_capacity, uint32_t tbl8_capacity)
+{
+	DIE(rtable_capacity < (uint32_t) fib->rtable_size || tbl8_capacity < fib->tbl8_groups,
+		"dir24_8 - reserve below size");
+
+	// Never moved again: lookups may be running on it
+	fib->tbl8 = realloc(fib->tbl8, (size_t) tbl8_capacity * DIR24_8_TBL8_GROUP_SIZE * sizeof(uint32_t));
+	DIE(tbl8_capacity && !fib->tbl8, "dir24_8 - realloc tbl8");
+	fib->tbl8_capacity = tbl8_capacity;
+	fib->rtable_capacity = rtable_capacity;
+
+	fib->free_routes = malloc(((size_t) rtable_capacity + 1) * sizeof(uint32_t));
+	fib->retired_routes = malloc(((size_t) rtable_capacity + 1) * sizeof(uint32_t));
+	fib->free_groups = malloc(((size_t) tbl8_capacity + 1) * sizeof(uint32_t));
+	fib->retired_groups = malloc(((size_t) tbl8_capacity + 1) * sizeof(uint32_t));
+	DIE(!fib->free_routes || !fib->retired_routes || !fib->free_groups || !fib->retired_groups,
+		"dir24_8 - malloc free lists");
+
+	// Stacks: the lowest slot is taken first
+	fib->free_route_count = 0;
+	for (uint32_t i = rtable_capacity; i > (uint32_t) fib->rtable_size; --i) {
+		fib->free_routes[fib->free_route_count++] = i - 1;
+	}
+	fib->free_group_count = 0;
+	for (uint32_t i = tbl8_capacity; i > fib->tbl8_groups; --i) {
+		fib->free_groups[fib->free_group_count++] = i - 1;
+	}
+	fib->retired_route_count = 0;
+	fib->retired_group_count = 0;
+}
+
+/* Length of the prefix an entry (not an extended one) resolves to, -1 for no route */
+static inline int dir24_8_depth(const struct dir24_8 *fib, uint32_t entry)
+{
+	return entry ? __builtin_popcount(fib->rtable[entry - 1].mask) : -1;
+}
+
+static inline uint32_t *dir24_8_group(struct dir24_8 *fib, uint32_t entry)
+{
+	return &fib->tbl8[(size_t) (entry & ~DIR24_8_EXT_FLAG) * DIR24_8_TBL8_GROUP_SIZE];
+}
+
+/* Sets the entries resolving to a prefix no longer than len to value */
+static void dir24_8_paint(struct dir24_8 *fib, uint32_t *entries, uint32_t count, uint32_t value, int len)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		if (dir24_8_depth(fib, entries[i]) <= len) {
+			__atomic_store_n(&entries[i], value, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/* Sets the entries resolving to old to value */
+static void dir24_8_repaint(uint32_t *entries, uint32_t count, uint32_t old, uint32_t value)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		if (entries[i] == old) {
+			__atomic_store_n(&entries[i], value, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+int dir24_8_add(struct dir24_8 *fib, const struct route_table_entry *route, int replaced)
+{
+	int len = __builtin_popcount(route->mask);
+	uint32_t *slot24 = &fib->tbl24[route->prefix >> 8];
+
+	// Check for room first: a change is made whole or not at all
+	if (!fib->free_route_count || (len > 24 && !(*slot24 & DIR24_8_EXT_FLAG) && !fib->free_group_count)) {
+		return -1;
+	}
+
+	uint32_t slot = fib->free_routes[--fib->free_route_count];
+	uint32_t value = slot + 1;
+	fib->rtable[slot] = *route;
+
+	if (len <= 24) {
+		uint32_t first = route->prefix >> 8;
+		uint32_t count = 1u << (24 - len);
+
+		for (uint32_t i = first; i < first + count; ++i) {
+			if (fib->tbl24[i] & DIR24_8_EXT_FLAG) {
+				dir24_8_paint(fib, dir24_8_group(fib, fib->tbl24[i]), DIR24_8_TBL8_GROUP_SIZE, value, len);
+			} else {
+				dir24_8_paint(fib, &fib->tbl24[i], 1, value, len);
+			}
+		}
+	} else {
+		// The group is filled before the /24 points to it
+		if (!(*slot24 & DIR24_8_EXT_FLAG)) {
+			uint32_t group = fib->free_groups[--fib->free_group_count];
+			uint32_t *entries = &fib->tbl8[(size_t) group * DIR24_8_TBL8_GROUP_SIZE];
+
+			for (int i = 0; i < DIR24_8_TBL8_GROUP_SIZE; ++i) {
+				entries[i] = *slot24;
+			}
+			__atomic_store_n(slot24, DIR24_8_EXT_FLAG | group, __ATOMIC_RELEASE);
+		}
+
+		dir24_8_paint(fib, dir24_8_group(fib, *slot24) + (route->prefix & 0xff), 1u << (32 - len), value, len);
+	}
+
+	// Every address of replaced (same prefix) was painted over
+	if (replaced >= 0) {
+		fib->retired_routes[fib->retired_route_count++] = replaced;
+	}
+	return slot;
+}
+
+void dir24_8_delete(struct dir24_8 *fib, uint32_t slot, int parent)
+{
+	const struct route_table_entry *route = &fib->rtable[slot];
+	int len = __builtin_popcount(route->mask);
+	uint32_t value = parent + 1;
+
+	if (len <= 24) {
+		uint32_t first = route->prefix >> 8;
+		uint32_t count = 1u << (24 - len);
+
+		for (uint32_t i = first; i < first + count; ++i) {
+			if (fib->tbl24[i] & DIR24_8_EXT_FLAG) {
+				dir24_8_repaint(dir24_8_group(fib, fib->tbl24[i]), DIR24_8_TBL8_GROUP_SIZE, slot + 1, value);
+			} else {
+				dir24_8_repaint(&fib->tbl24[i], 1, slot + 1, value);
+			}
+		}
+	} else {
+		uint32_t *slot24 = &fib->tbl24[route->prefix >> 8];
+		uint32_t *entries = dir24_8_group(fib, *slot24);
+
+		dir24_8_repaint(entries + (route->prefix & 0xff), 1u << (32 - len), slot + 1, value);
+
+		// Nothing longer than /24 left: the /24 resolves on its own again
+		bool uniform = true;
+		for (int i = 1; i < DIR24_8_TBL8_GROUP_SIZE && uniform; ++i) {
+			uniform = entries[i] == entries[0];
+		}
+		if (uniform) {
+			fib->retired_groups[fib->retired_group_count++] = *slot24 & ~DIR24_8_EXT_FLAG;
+			__atomic_store_n(slot24, entries[0], __ATOMIC_RELEASE);
+		}
+	}
+
+	fib->retired_routes[fib->retired_route_count++] = slot;
+}
+
+void dir24_8_release_retired(struct dir24_8 *fib)
+{
+	for (uint32_t i = 0; i < fib->retired_route_count; ++i) {
+		uint32_t slot = fib->retired_routes[i];
+
+		free(fib->rtable[slot].group);
+		memset(&fib->rtable[slot], 0, sizeof(struct route_table_entry));
+		fib->free_routes[fib->free_route_count++] = slot;
+	}
+	for (uint32_t i = 0; i < fib->retired_group_count; ++i) {
+		fib->free_groups[fib->free_group_count++] = fib->retired_groups[i];
+	}
+
+	fib->retired_route_count = 0;
+	fib->retired_group_count = 0;
+}
+
+size_t dir24_8_memory(struct dir24_8 *fib)
+{
+	return sizeof(struct dir24_8)
+		+ (size_t) DIR24_8_TBL24_SIZE * sizeof(uint32_t)
+		+ (size_t) fib->tbl8_capacity * DIR24_8_TBL8_GROUP_SIZE * sizeof(uint32_t);
+}
+
+static void dir24_8_lookup_burst(struct dir24_8 *fib, const uint32_t *daddrs, int n, struct route_table_entry **out)
+{
+	uint32_t entries[MAX_BURST];
+	int i = 0;
+
+	// Stage 1: issue the tbl24 loads of the whole burst
+	for (int j = 0; j < n; ++j) {
+		__builtin_prefetch(&fib->tbl24[daddrs[j] >> 8]);
+	}
+
+	// Stage 2: read tbl24 and issue the tbl8 loads for the extended entries
+#ifdef __AVX2__
+	for (; i + 8 <= n; i += 8) {
+		__m256i addr = _mm256_loadu_si256((const __m256i *) &daddrs[i]);
+		__m256i entry = _mm256_i32gather_epi32((const int *) fib->tbl24, _mm256_srli_epi32(addr, 8), 4);
+		_mm256_storeu_si256((__m256i *) &entries[i], entry);
+
+		// Sign bit == DIR24_8_EXT_FLAG
+		int ext = _mm256_movemask_ps(_mm256_castsi256_ps(entry));
+		while (ext) {
+			int j = i + __builtin_ctz(ext);
+			__builtin_prefetch(&fib->tbl8[((entries[j] & ~DIR24_8_EXT_FLAG) << 8) | (daddrs[j] & 0xff)]);
+			ext &= ext - 1;
+		}
+	}
+#endif
+	for (; i < n; ++i) {
+		entries[i] = fib->tbl24[daddrs[i] >> 8];
+		if (entries[i] & DIR24_8_EXT_FLAG) {
+			__builtin_prefetch(&fib->tbl8[((entries[i] & ~DIR24_8_EXT_FLAG) << 8) | (daddrs[i] & 0xff)]);
+		}
+	}
+
+	// Stage 3: resolve
+	for (int j = 0; j < n; ++j) {
+		uint32_t entry = entries[j];
+
+		if (entry & DIR24_8_EXT_FLAG) {
+			entry = fib->tbl8[((entry & ~DIR24_8_EXT_FLAG) << 8) | (daddrs[j] & 0xff)];
+		}
+
+		out[j] = entry ? &fib->rtable[entry - 1] : NULL;
+	}
+}
+
+void dir24_8_lookup_bulk(struct dir24_8 *fib, const uint32_t *daddrs, int n, struct route_table_entry **out)
+{
+	for (int i = 0; i < n; i += MAX_BURST) {
+		int burst = n - i < MAX_BURST ? n - i : MAX_BURST;
+		dir24_8_lookup_burst(fib, daddrs + i, burst, out + i);
+	}
+}
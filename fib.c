@@ -0,0 +1,109 @@
+#include "fib.h"
+#include "rtable.h"
+
+static const char *fib_engine_names[] = {
+	[FIB_BSEARCH] = "bsearch",
+	[FIB_DIR24_8] = "dir24_8",
+	[FIB_TREE_BITMAP] = "tbm",
+};
+
+enum fib_engine fib_engine_from_name(const char *name)
+{
+	if (!name) {
+		return FIB_DIR24_8;
+	}
+
+	for (int i = 0; i < (int) (sizeof(fib_engine_names) / sizeof(fib_engine_names[0])); ++i) {
+		if (!strcmp(name, fib_engine_names[i])) {
+			return i;
+		}
+	}
+
+	DIE(1, "unknown FIB engine");
+	return FIB_DIR24_8;
+}
+
+const char *fib_engine_name(enum fib_engine engine)
+{
+	return fib_engine_names[engine];
+}
+
+struct fib *fib_create(enum fib_engine engine, struct route_table_entry *rtable, int rtable_size)
+{
+	struct fib *fib = calloc(1, sizeof(struct fib));
+	DIE(!fib, "fib - calloc");
+
+	fib->engine = engine;
+	fib->rtable = rtable;
+	fib->rtable_size = rtable_size;
+
+	switch (engine) {
+	case FIB_DIR24_8:
+		fib->dir24_8 = dir24_8_build(rtable, rtable_size);
+		break;
+	case FIB_TREE_BITMAP:
+		fib->tbm = tbm_build(rtable, rtable_size);
+		break;
+	default:
+		break;
+	}
+
+	return fib;
+}
+
+void fib_free(struct fib *fib)
+{
+	switch (fib->engine) {
+	case FIB_DIR24_8:
+		// Tables inside a mapped image go away with it
+		if (fib->image) {
+			free(fib->dir24_8);
+		} else {
+			dir24_8_free(fib->dir24_8);
+		}
+		break;
+	case FIB_TREE_BITMAP:
+		tbm_free(fib->tbm);
+		break;
+	default:
+		break;
+	}
+
+	if (fib->owns_rtable) {
+		rtable_free(fib->rtable, fib->rtable_size);
+	}
+	if (fib->image) {
+		munmap(fib->image, fib->image_size);
+	}
+
+	free(fib);
+}
+
+size_t fib_memory(struct fib *fib)
+{
+	switch (fib->engine) {
+	case FIB_DIR24_8:
+		return dir24_8_memory(fib->dir24_8);
+	case FIB_TREE_BITMAP:
+		return tbm_memory(fib->tbm);
+	default:
+		return (size_t) fib->rtable_size * sizeof(struct route_table_entry);
+	}
+}
+
+void fib_lookup_bulk(struct fib *fib, const uint32_t *daddrs, int n, struct route_table_entry **out)
+{
+	switch (fib->engine) {
+	case FIB_DIR24_8:
+		dir24_8_lookup_bulk(fib->dir24_8, daddrs, n, out);
+		break;
+	case FIB_TREE_BITMAP:
+		tbm_lookup_bulk(fib->tbm, daddrs, n, out);
+		break;
+	default:
+		for (int i = 0; i < n; ++i) {
+			out[i] = get_best_route(daddrs[i], fib->rtable, fib->rtable_size);
+		}
+		break;
+	}
+}
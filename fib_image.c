@@ -0,0 +1,172 @@
+#include "fib_image.h"
+
+static inline uint64_t fib_image_align(uint64_t offset)
+{
+	return (offset + FIB_IMAGE_ALIGN - 1) & ~(uint64_t) (FIB_IMAGE_ALIGN - 1);
+}
+
+/* Sections are page-aligned, so the checksummed range is a whole number of words */
+static uint64_t fib_image_checksum(const uint8_t *image, uint64_t image_size)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for (uint64_t offset = FIB_IMAGE_ALIGN; offset < image_size; offset += sizeof(uint64_t)) {
+		uint64_t word;
+
+		memcpy(&word, image + offset, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+void fib_image_write(const char *path, struct route_table_entry *rtable, int rtable_size)
+{
+	struct dir24_8 *dir = dir24_8_build(rtable, rtable_size);
+	struct fib_image_header hdr = {
+		.magic = FIB_IMAGE_MAGIC,
+		.version = FIB_IMAGE_VERSION,
+		.rtable_size = rtable_size,
+		.tbl8_groups = dir->tbl8_groups,
+	};
+
+	size_t rtable_bytes = (size_t) rtable_size * sizeof(struct route_table_entry);
+	size_t tbl24_bytes = (size_t) DIR24_8_TBL24_SIZE * sizeof(uint32_t);
+	size_t tbl8_bytes = (size_t) dir->tbl8_groups * DIR24_8_TBL8_GROUP_SIZE * sizeof(uint32_t);
+
+	hdr.rtable_offset = FIB_IMAGE_ALIGN;
+	hdr.tbl24_offset = fib_image_align(hdr.rtable_offset + rtable_bytes);
+	hdr.tbl8_offset = fib_image_align(hdr.tbl24_offset + tbl24_bytes);
+	hdr.image_size = fib_image_align(hdr.tbl8_offset + tbl8_bytes);
+
+	// Lay the image out in memory (zero padding), then write it in one go
+	uint8_t *image = calloc(1, hdr.image_size);
+	DIE(!image, "fib_image - calloc");
+
+	memcpy(image + hdr.rtable_offset, rtable, rtable_bytes);
+	// Pointers mean nothing in another process
+	struct route_table_entry *image_rtable = (struct route_table_entry *) (image + hdr.rtable_offset);
+	for (int i = 0; i < rtable_size; ++i) {
+		image_rtable[i].group = NULL;
+	}
+	memcpy(image + hdr.tbl24_offset, dir->tbl24, tbl24_bytes);
+	if (tbl8_bytes) {
+		memcpy(image + hdr.tbl8_offset, dir->tbl8, tbl8_bytes);
+	}
+	hdr.checksum = fib_image_checksum(image, hdr.image_size);
+	memcpy(image, &hdr, sizeof(hdr));
+
+	char tmp[PATH_MAX];
+	DIE(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp), "fib_image - path too long");
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	DIE(fd == -1, "fib_image - open");
+
+	for (uint64_t written = 0; written < hdr.image_size;) {
+		ssize_t ret = write(fd, image + written, hdr.image_size - written);
+		DIE(ret == -1, "fib_image - write");
+		written += ret;
+	}
+
+	DIE(fsync(fd) == -1, "fib_image - fsync");
+	close(fd);
+	DIE(rename(tmp, path) == -1, "fib_image - rename");
+
+	free(image);
+	dir24_8_free(dir);
+}
+
+bool fib_image_probe(const char *path)
+{
+	uint32_t magic = 0;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		return false;
+	}
+
+	bool image = read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == FIB_IMAGE_MAGIC;
+	close(fd);
+	return image;
+}
+
+struct fib *fib_image_map(const char *path, enum fib_engine engine)
+{
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	DIE(fd == -1, "fib_image - open");
+	DIE(fstat(fd, &st) == -1, "fib_image - fstat");
+	DIE((size_t) st.st_size < sizeof(struct fib_image_header), "fib_image - truncated");
+
+	uint8_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	DIE(image == MAP_FAILED, "fib_image - mmap");
+	close(fd);
+
+	struct fib_image_header hdr;
+	memcpy(&hdr, image, sizeof(hdr));
+
+	DIE(hdr.magic != FIB_IMAGE_MAGIC, "fib_image - bad magic");
+	DIE(hdr.version != FIB_IMAGE_VERSION, "fib_image - unsupported version");
+	DIE(hdr.image_size != (uint64_t) st.st_size, "fib_image - truncated");
+
+	// Every section must lie inside the image
+	uint64_t rtable_end = hdr.rtable_offset + (uint64_t) hdr.rtable_size * sizeof(struct route_table_entry);
+	uint64_t tbl24_end = hdr.tbl24_offset + (uint64_t) DIR24_8_TBL24_SIZE * sizeof(uint32_t);
+	uint64_t tbl8_end = hdr.tbl8_offset + (uint64_t) hdr.tbl8_groups * DIR24_8_TBL8_GROUP_SIZE * sizeof(uint32_t);
+	DIE(rtable_end > hdr.image_size || tbl24_end > hdr.image_size || tbl8_end > hdr.image_size,
+		"fib_image - bad section offsets");
+
+	DIE(fib_image_checksum(image, hdr.image_size) != hdr.checksum, "fib_image - bad checksum");
+
+	struct route_table_entry *rtable = (struct route_table_entry *) (image + hdr.rtable_offset);
+	struct fib *fib;
+
+	// Compiled offline, where the interfaces were not known
+	for (uint32_t i = 0; i < hdr.rtable_size; ++i) {
+		DIE(rtable_route_error(&rtable[i]), "fib_image - bad route");
+	}
+
+	// Multipath prefixes: the groups are set in a private copy of the
+	// rtable, the tables hold indices and work as well on it
+	bool multipath = false;
+	for (uint32_t i = 1; i < hdr.rtable_size && !multipath; ++i) {
+		multipath = rtable[i].mask == rtable[i - 1].mask
+			&& (rtable[i].prefix & rtable[i].mask) == (rtable[i - 1].prefix & rtable[i - 1].mask);
+	}
+	if (multipath) {
+		struct route_table_entry *copy = malloc(((size_t) hdr.rtable_size + 1) * sizeof(struct route_table_entry));
+		DIE(!copy, "fib_image - malloc rtable");
+
+		memcpy(copy, rtable, (size_t) hdr.rtable_size * sizeof(struct route_table_entry));
+		rtable_group(copy, hdr.rtable_size);
+		rtable = copy;
+	}
+
+	if (engine == FIB_DIR24_8) {
+		// Run on the mapped tables: nothing to build
+		struct dir24_8 *dir = calloc(1, sizeof(struct dir24_8));
+		DIE(!dir, "fib_image - calloc dir24_8");
+
+		dir->tbl24 = (uint32_t *) (image + hdr.tbl24_offset);
+		dir->tbl8 = (uint32_t *) (image + hdr.tbl8_offset);
+		dir->tbl8_groups = hdr.tbl8_groups;
+		dir->tbl8_capacity = hdr.tbl8_groups;
+		dir->rtable = rtable;
+		dir->rtable_size = hdr.rtable_size;
+
+		fib = calloc(1, sizeof(struct fib));
+		DIE(!fib, "fib - calloc");
+		fib->engine = FIB_DIR24_8;
+		fib->rtable = rtable;
+		fib->rtable_size = hdr.rtable_size;
+		fib->dir24_8 = dir;
+	} else {
+		fib = fib_create(engine, rtable, hdr.rtable_size);
+	}
+
+	fib->image = image;
+	fib->image_size = hdr.image_size;
+	fib->owns_rtable = multipath;
+	return fib;
+}
@@ -0,0 +1,721 @@
+#include "fib_update.h"
+
+/* An indexed route, and the rtable slot of its copy when dir24_8 is updated in place */
+struct fib_route {
+	struct route_table_entry route;
+	int slot;
+} __attribute__((packed));
+
+static inline struct fib_route *fib_route(struct route_table_entry *route)
+{
+	return (struct fib_route *) route;
+}
+
+static inline uint64_t route_key(uint32_t prefix, uint32_t mask)
+{
+	return (uint64_t) prefix << 32 | mask;
+}
+
+static inline uint32_t route_slot(struct fib_updater *up, uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> up->shift;
+}
+
+/* Slot holding (prefix, mask), or the empty slot ending its probe sequence */
+static struct route_table_entry **route_find(struct fib_updater *up, uint32_t prefix, uint32_t mask)
+{
+	uint64_t key = route_key(prefix, mask);
+	uint32_t i = route_slot(up, key);
+
+	while (up->slots[i] && route_key(up->slots[i]->prefix, up->slots[i]->mask) != key) {
+		i = (i + 1) & up->mask;
+	}
+
+	return &up->slots[i];
+}
+
+static void route_index_init(struct fib_updater *up, uint32_t capacity)
+{
+	up->slots = calloc(capacity, sizeof(struct route_table_entry *));
+	DIE(!up->slots, "fib_update - calloc slots");
+	up->mask = capacity - 1;
+	up->shift = 64 - __builtin_ctz(capacity);
+	up->size = 0;
+}
+
+static void route_index_add(struct fib_updater *up, struct route_table_entry *route)
+{
+	// Keep the load factor under 1/2
+	if (2 * (uint32_t) (up->size + 1) > up->mask + 1) {
+		struct route_table_entry **old = up->slots;
+		uint32_t capacity = up->mask + 1;
+
+		route_index_init(up, 2 * capacity);
+		for (uint32_t i = 0; i < capacity; ++i) {
+			if (old[i]) {
+				*route_find(up, old[i]->prefix, old[i]->mask) = old[i];
+				up->size++;
+			}
+		}
+		free(old);
+	}
+
+	*route_find(up, route->prefix, route->mask) = route;
+	up->size++;
+}
+
+/* Backward-shift deletion, as in the ARP table */
+static void route_index_remove(struct fib_updater *up, struct route_table_entry **slot)
+{
+	uint32_t hole = slot - up->slots;
+	uint32_t i = hole;
+
+	while (1) {
+		i = (i + 1) & up->mask;
+		if (!up->slots[i]) {
+			break;
+		}
+
+		uint32_t home = route_slot(up, route_key(up->slots[i]->prefix, up->slots[i]->mask));
+		if (((i - home) & up->mask) >= ((i - hole) & up->mask)) {
+			up->slots[hole] = up->slots[i];
+			hole = i;
+		}
+	}
+
+	up->slots[hole] = NULL;
+	up->size--;
+}
+
+/* An indexed route owns its next-hop group */
+static void route_free(void *ptr)
+{
+	struct route_table_entry *route = ptr;
+
+	free(route->group);
+	free(route);
+}
+
+/* Route the FIB may still point to: freed once the next version is published */
+static void route_retire(struct fib_updater *up, struct route_table_entry *route)
+{
+	if (up->retired_count == up->retired_capacity) {
+		up->retired_capacity = up->retired_capacity ? 2 * up->retired_capacity : 64;
+		up->retired = realloc(up->retired, up->retired_capacity * sizeof(struct route_table_entry *));
+		DIE(!up->retired, "fib_update - realloc retired");
+	}
+
+	up->retired[up->retired_count++] = route;
+}
+
+/* Retires every route of the index, which starts over empty */
+static void route_index_clear(struct fib_updater *up)
+{
+	for (uint32_t i = 0; i <= up->mask; ++i) {
+		if (up->slots[i]) {
+			route_retire(up, up->slots[i]);
+		}
+	}
+
+	free(up->slots);
+	route_index_init(up, FIB_UPDATE_MIN_CAPACITY);
+}
+
+static void route_index_load(struct fib_updater *up, struct route_table_entry *rtable, int rtable_size)
+{
+	for (int i = 0; i < rtable_size; ++i) {
+		uint32_t prefix = rtable[i].prefix & rtable[i].mask;
+		struct route_table_entry **slot = route_find(up, prefix, rtable[i].mask);
+
+		// Duplicate prefix: its group already holds every next hop
+		if (*slot) {
+			continue;
+		}
+
+		struct route_table_entry *route = malloc(sizeof(struct fib_route));
+		DIE(!route, "fib_update - malloc route");
+
+		// Same buckets as in the FIB loaded: no flow moves when it is replaced
+		*route = rtable[i];
+		route->prefix = prefix;
+		if (route->group) {
+			route->group = nexthop_group_copy(route->group);
+		}
+		route_index_add(up, route);
+	}
+}
+
+/* A whole FIB version goes once no worker can be reading it */
+static void fib_retire(void *fib)
+{
+	fib_free(fib);
+}
+
+/*
+ * An older version patched into the newer one: its tables belong to the
+ * newer one (tree bitmap: all but its own root)
+ */
+static void fib_retire_version(void *ptr)
+{
+	struct fib *fib = ptr;
+
+	if (fib->engine == FIB_TREE_BITMAP) {
+		free(fib->tbm);
+	}
+	free(fib);
+}
+
+/*
+	Swaps fib in. Only then is what it replaced unreachable: the grace
+	periods of the old version, its replaced arrays and routes start here.
+*/
+static void fib_publish(struct fib_updater *up, struct fib *fib, rcu_free_fn retire)
+{
+	struct fib *old = *up->fib;
+
+	fib->version = old->version + 1;
+	rcu_assign_pointer(*up->fib, fib);
+	rcu_defer(retire, old);
+
+	// dir24_8 slots and groups, tree bitmap blocks are reused, not freed:
+	// wait until no worker can still be looking at them (workers block
+	// offline, so this is short)
+	bool retired = fib->engine == FIB_DIR24_8 ? dir24_8_has_retired(fib->dir24_8)
+		: fib->engine == FIB_TREE_BITMAP && tbm_has_retired(fib->tbm);
+	if (retired) {
+		rcu_thread_offline();
+		rcu_synchronize();
+		rcu_thread_online();
+
+		if (fib->engine == FIB_DIR24_8) {
+			dir24_8_release_retired(fib->dir24_8);
+		} else {
+			tbm_release_retired(fib->tbm);
+		}
+	}
+
+	for (int i = 0; i < up->retired_count; ++i) {
+		rcu_defer(route_free, up->retired[i]);
+	}
+	up->retired_count = 0;
+}
+
+/* Builds a new FIB from the whole route index, off the fast path */
+static void fib_rebuild(struct fib_updater *up)
+{
+	struct fib *fib;
+
+	if (up->engine == FIB_TREE_BITMAP) {
+		// The trie points to the indexed routes, so they can be updated later
+		fib = fib_create(FIB_TREE_BITMAP, NULL, 0);
+		for (uint32_t i = 0; i <= up->mask; ++i) {
+			if (up->slots[i]) {
+				tbm_insert(fib->tbm, up->slots[i]->prefix, __builtin_popcount(up->slots[i]->mask), up->slots[i]);
+			}
+		}
+		fib->rtable_size = up->size;
+	} else {
+		// dir24_8 is then updated in place: room for as many routes again
+		int capacity = up->engine == FIB_DIR24_8 ? 2 * up->size + FIB_UPDATE_MIN_CAPACITY : up->size + 1;
+		struct route_table_entry *rtable = calloc(capacity, sizeof(struct route_table_entry));
+		DIE(!rtable, "fib_update - calloc rtable");
+		int size = 0;
+
+		// The new FIB gets its own copy of the groups, freed along with it
+		for (uint32_t i = 0; i <= up->mask; ++i) {
+			if (up->slots[i]) {
+				fib_route(up->slots[i])->slot = size;
+				rtable[size] = *up->slots[i];
+				if (rtable[size].group) {
+					rtable[size].group = nexthop_group_copy(rtable[size].group);
+				}
+				size++;
+			}
+		}
+
+		if (up->engine == FIB_DIR24_8) {
+			// Slots are found through the routes, the order does not matter
+			fib = fib_create(FIB_DIR24_8, rtable, size);
+			dir24_8_reserve(fib->dir24_8, capacity, 2 * fib->dir24_8->tbl8_groups + FIB_UPDATE_MIN_TBL8_GROUPS);
+			fib->rtable_size = capacity;
+		} else {
+			rtable_sort(rtable, size);
+			fib = fib_create(up->engine, rtable, size);
+		}
+		fib->owns_rtable = true;
+	}
+
+	fib_publish(up, fib, fib_retire);
+	up->dirty = false;
+	up->rebuilds++;
+}
+
+/*
+ * Version the current batch is applied to: a clone of the published trie,
+ * or for dir24_8 a new header over the same tables, so the workers see a
+ * new FIB (and drop their cached routes) once the batch is done
+ */
+static struct fib *fib_next(struct fib_updater *up)
+{
+	if (!up->next) {
+		up->next = malloc(sizeof(struct fib));
+		DIE(!up->next, "fib_update - malloc fib");
+
+		*up->next = **up->fib;
+		if (up->engine == FIB_TREE_BITMAP) {
+			up->next->tbm = tbm_clone((*up->fib)->tbm);
+		}
+	}
+
+	return up->next;
+}
+
+/* The published FIB misses a change: a shadow FIB is rebuilt */
+static void fib_changed(struct fib_updater *up, uint64_t now)
+{
+	if (!up->dirty) {
+		up->first_change = now;
+	}
+
+	up->dirty = true;
+	up->last_change = now;
+	up->updates++;
+}
+
+/* Whether changes go straight into the published dir24_8 (not waiting for a rebuild) */
+static bool fib_in_place(struct fib_updater *up)
+{
+	return up->engine == FIB_DIR24_8 && !up->dirty;
+}
+
+/* Slot of the longest route containing (prefix, mask), -1 if none */
+static int route_parent_slot(struct fib_updater *up, uint32_t prefix, uint32_t mask)
+{
+	for (int len = __builtin_popcount(mask) - 1; len >= 0; --len) {
+		uint32_t parent_mask = len ? ~0u << (32 - len) : 0;
+		struct route_table_entry **slot = route_find(up, prefix & parent_mask, parent_mask);
+
+		if (*slot) {
+			return fib_route(*slot)->slot;
+		}
+	}
+
+	return -1;
+}
+
+/* Puts route in slot (or a new slot, if empty); the route it replaces is retired */
+static void route_install(struct fib_updater *up, struct route_table_entry **slot, struct route_table_entry *route,
+	uint64_t now)
+{
+	int replaced = *slot ? fib_route(*slot)->slot : -1;
+	fib_route(route)->slot = -1;
+
+	// The published FIB keeps using the old route until the next swap
+	if (*slot) {
+		route_retire(up, *slot);
+		*slot = route;
+	} else {
+		route_index_add(up, route);
+	}
+
+	if (up->engine == FIB_TREE_BITMAP) {
+		tbm_insert(fib_next(up)->tbm, route->prefix, __builtin_popcount(route->mask), route);
+		up->next->rtable_size = up->size;
+		up->updates++;
+		return;
+	}
+
+	if (fib_in_place(up)) {
+		// The FIB owns the groups of its slots
+		struct route_table_entry copy = *route;
+		if (copy.group) {
+			copy.group = nexthop_group_copy(copy.group);
+		}
+
+		fib_route(route)->slot = dir24_8_add(fib_next(up)->dir24_8, &copy, replaced);
+		if (fib_route(route)->slot >= 0) {
+			up->updates++;
+			return;
+		}
+
+		// Out of slots or tbl8 groups: the rebuild makes room
+		free(copy.group);
+	}
+
+	fib_changed(up, now);
+}
+
+/* Next hops of route: its group, or single holding its only one */
+static const struct nexthop_group *route_nexthops(const struct route_table_entry *route, struct nexthop_group *single)
+{
+	if (route->group) {
+		return route->group;
+	}
+
+	single->count = 1;
+	single->members[0] = (struct nexthop) { route->next_hop, route->interface };
+	memset(single->buckets, 0, sizeof(single->buckets));
+	return single;
+}
+
+/* Copy of route going to the next hops of group, which it takes over (NULL: its own next hop) */
+static struct route_table_entry *route_copy(const struct route_table_entry *route, struct nexthop_group *group)
+{
+	struct route_table_entry *copy = malloc(sizeof(struct fib_route));
+	DIE(!copy, "fib_update - malloc route");
+
+	*copy = *route;
+	copy->group = group;
+	if (group) {
+		copy->next_hop = group->members[0].next_hop;
+		copy->interface = group->members[0].interface;
+	}
+	return copy;
+}
+
+/* route comes from rtable_parse_route: already checked */
+static const char *route_set(struct fib_updater *up, struct route_table_entry *route, bool replace, uint64_t now)
+{
+	route->group = NULL;
+	struct route_table_entry **slot = route_find(up, route->prefix, route->mask);
+
+	if (replace && !*slot) {
+		return "no such route";
+	}
+
+	// Another next hop for a known prefix: one more equal-cost path, which
+	// takes its share of the flows from the others
+	if (!replace && *slot) {
+		struct nexthop_group single;
+		const struct nexthop_group *group = route_nexthops(*slot, &single);
+		struct nexthop member = { route->next_hop, route->interface };
+
+		if (nexthop_group_find(group, member) >= 0) {
+			return "route exists";
+		}
+
+		struct nexthop_group *grown = nexthop_group_add(group, member);
+		if (!grown) {
+			return "too many next hops";
+		}
+
+		route_install(up, slot, route_copy(*slot, grown), now);
+		return NULL;
+	}
+
+	// New prefix, or replace: a single next hop
+	route_install(up, slot, route_copy(route, NULL), now);
+	return NULL;
+}
+
+static const char *route_del(struct fib_updater *up, uint32_t prefix, uint32_t mask, struct nexthop *member,
+	uint64_t now)
+{
+	if (!rtable_mask_valid(mask)) {
+		return "bad mask";
+	}
+
+	prefix &= mask;
+	struct route_table_entry **slot = route_find(up, prefix, mask);
+
+	if (!*slot) {
+		return "no such route";
+	}
+
+	// One next hop of the prefix: only the flows that went through it move
+	if (member) {
+		struct nexthop_group single;
+		const struct nexthop_group *group = route_nexthops(*slot, &single);
+		int index = nexthop_group_find(group, *member);
+
+		if (index < 0) {
+			return "no such next hop";
+		}
+
+		if (group->count == 2) {
+			struct route_table_entry *copy = route_copy(*slot, NULL);
+
+			copy->next_hop = group->members[!index].next_hop;
+			copy->interface = group->members[!index].interface;
+			route_install(up, slot, copy, now);
+			return NULL;
+		}
+		if (group->count > 2) {
+			route_install(up, slot, route_copy(*slot, nexthop_group_remove(group, index)), now);
+			return NULL;
+		}
+		// The last one: the whole route goes
+	}
+
+	int deleted = fib_route(*slot)->slot;
+
+	route_retire(up, *slot);
+	route_index_remove(up, slot);
+
+	if (up->engine == FIB_TREE_BITMAP) {
+		tbm_delete(fib_next(up)->tbm, prefix, __builtin_popcount(mask));
+		up->next->rtable_size = up->size;
+		up->updates++;
+	} else if (fib_in_place(up)) {
+		// Its addresses go back to the route it was carved out of
+		dir24_8_delete(fib_next(up)->dir24_8, deleted, route_parent_slot(up, prefix, mask));
+		up->updates++;
+	} else {
+		fib_changed(up, now);
+	}
+	return NULL;
+}
+
+static const char *route_reload(struct fib_updater *up, const char *file_name)
+{
+	int rtable_size;
+	struct route_table_entry *rtable = rtable_try_load(file_name, 1, &rtable_size);
+
+	if (!rtable) {
+		return "cannot load file";
+	}
+	// Routes repeating a prefix become its equal-cost paths
+	rtable_sort(rtable, rtable_size);
+	rtable_group(rtable, rtable_size);
+
+	// Lines before this one in the batch go out first
+	if (up->next) {
+		fib_publish(up, up->next, fib_retire_version);
+		up->next = NULL;
+	}
+
+	route_index_clear(up);
+	route_index_load(up, rtable, rtable_size);
+	rtable_free(rtable, rtable_size);
+
+	fib_rebuild(up);
+	up->updates++;
+	return NULL;
+}
+
+/* Parses a dotted quad token, moving *p past it */
+static bool parse_addr(char **p, uint32_t *addr)
+{
+	char *token = strtok_r(NULL, " \t\r", p);
+	struct in_addr in;
+
+	if (!token || inet_pton(AF_INET, token, &in) != 1) {
+		return false;
+	}
+
+	*addr = ntohl(in.s_addr);
+	return true;
+}
+
+/* Runs one command line (without its newline); NULL on success */
+static const char *fib_update_command(struct fib_updater *up, char *line, uint64_t now)
+{
+	char *saveptr;
+	char *cmd = strtok_r(line, " \t\r", &saveptr);
+
+	if (!cmd) {
+		return "empty command";
+	}
+
+	if (!strcmp(cmd, "add") || !strcmp(cmd, "replace")) {
+		struct route_table_entry route;
+		const char *args = saveptr;
+		const char *error;
+
+		if (!rtable_parse_route(&args, args + strlen(args), &route, &error)) {
+			return error ? error : "malformed route";
+		}
+		return route_set(up, &route, !strcmp(cmd, "replace"), now);
+	}
+
+	if (!strcmp(cmd, "del")) {
+		uint32_t prefix, mask;
+		struct nexthop member;
+
+		if (!parse_addr(&saveptr, &prefix) || !parse_addr(&saveptr, &mask)) {
+			return "malformed route";
+		}
+
+		// Optional next hop and interface: only that path of the prefix
+		if (!saveptr[strspn(saveptr, " \t\r")]) {
+			return route_del(up, prefix, mask, NULL, now);
+		}
+
+		char *interface;
+		if (!parse_addr(&saveptr, &member.next_hop) || !(interface = strtok_r(NULL, " \t\r", &saveptr))
+			|| sscanf(interface, "%d", &member.interface) != 1) {
+			return "malformed route";
+		}
+		return route_del(up, prefix, mask, &member, now);
+	}
+
+	if (!strcmp(cmd, "reload")) {
+		char *file_name = strtok_r(NULL, " \t\r", &saveptr);
+
+		if (!file_name) {
+			return "missing file";
+		}
+		return route_reload(up, file_name);
+	}
+
+	return "unknown command";
+}
+
+/* A client that went away must not kill the router (SIGPIPE) */
+static void fib_update_reply(int fd, const char *reply, int len)
+{
+	DIE(send(fd, reply, len, MSG_NOSIGNAL) == -1 && errno != EPIPE && errno != ECONNRESET, "fib_update - send");
+}
+
+/* Runs the complete lines received from client, answers them in one write */
+static bool fib_update_serve(struct fib_updater *up, int idx, uint64_t now)
+{
+	struct fib_update_client *client = &up->clients[idx];
+	int fd = up->fds[idx].fd;
+	char reply[FIB_UPDATE_LINE_SIZE];
+	int reply_len = 0;
+
+	int ret = read(fd, client->buf + client->len, sizeof(client->buf) - client->len);
+	if (ret <= 0) {
+		return false;
+	}
+	client->len += ret;
+
+	char *line = client->buf;
+	char *newline;
+	while ((newline = memchr(line, '\n', client->buf + client->len - line))) {
+		*newline = '\0';
+
+		const char *error = fib_update_command(up, line, now);
+		int len = error ? snprintf(reply + reply_len, sizeof(reply) - reply_len, "error %s\n", error)
+			: snprintf(reply + reply_len, sizeof(reply) - reply_len, "ok\n");
+
+		reply_len += len;
+		// Reply buffer full: send what we have
+		if (reply_len > (int) sizeof(reply) - 64) {
+			fib_update_reply(fd, reply, reply_len);
+			reply_len = 0;
+		}
+
+		line = newline + 1;
+	}
+
+	// Keep the partial line for the next read
+	client->len -= line - client->buf;
+	memmove(client->buf, line, client->len);
+	if (client->len == sizeof(client->buf)) {
+		return false;
+	}
+
+	if (reply_len) {
+		fib_update_reply(fd, reply, reply_len);
+	}
+	return true;
+}
+
+static void fib_update_accept(struct fib_updater *up)
+{
+	int fd = accept(up->listen_fd, NULL, NULL);
+	if (fd == -1) {
+		return;
+	}
+
+	if (up->nfds == 1 + FIB_UPDATE_MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+
+	up->fds[up->nfds] = (struct pollfd) { .fd = fd, .events = POLLIN };
+	up->clients[up->nfds].len = 0;
+	up->nfds++;
+}
+
+static void fib_update_close(struct fib_updater *up, int idx)
+{
+	close(up->fds[idx].fd);
+
+	up->nfds--;
+	up->fds[idx] = up->fds[up->nfds];
+	memcpy(&up->clients[idx], &up->clients[up->nfds], sizeof(struct fib_update_client));
+}
+
+static void *fib_update_loop(void *arg)
+{
+	struct fib_updater *up = arg;
+
+	rcu_register_thread();
+
+	// Index the routes of the initial FIB, then rebuild it from them: the
+	// trie points to the indexed routes, dir24_8 gets room to change in place
+	route_index_load(up, (*up->fib)->rtable, (*up->fib)->rtable_size);
+	if (up->engine != FIB_BSEARCH) {
+		fib_rebuild(up);
+	}
+
+	while (1) {
+		// Wake up in time for a pending rebuild
+		int timeout = 100;
+		if (up->dirty) {
+			timeout = FIB_REBUILD_DELAY_MS;
+		}
+
+		rcu_thread_offline();
+		int res = poll(up->fds, up->nfds, timeout);
+		rcu_thread_online();
+		DIE(res == -1 && errno != EINTR, "fib_update - poll");
+
+		uint64_t now = now_ms();
+
+		for (int i = up->nfds - 1; i > 0 && res > 0; --i) {
+			if (up->fds[i].revents && !fib_update_serve(up, i, now)) {
+				fib_update_close(up, i);
+			}
+		}
+		if (res > 0 && up->fds[0].revents) {
+			fib_update_accept(up);
+		}
+
+		// Patched in place: the whole batch goes out in one swap
+		if (up->next) {
+			fib_publish(up, up->next, fib_retire_version);
+			up->next = NULL;
+		}
+
+		// Shadow rebuild: wait for a pause, but not forever
+		if (up->dirty && (now - up->last_change >= FIB_REBUILD_DELAY_MS
+				|| now - up->first_change >= FIB_REBUILD_MAX_DELAY_MS)) {
+			fib_rebuild(up);
+		}
+
+		// Free what the workers no longer use
+		rcu_quiescent();
+	}
+
+	return NULL;
+}
+
+struct fib_updater *fib_updater_start(struct fib **fib, enum fib_engine engine, const char *socket_path)
+{
+	struct fib_updater *up = calloc(1, sizeof(struct fib_updater));
+	DIE(!up, "fib_update - calloc");
+
+	up->fib = fib;
+	up->engine = engine;
+	route_index_init(up, FIB_UPDATE_MIN_CAPACITY);
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	DIE(strlen(socket_path) >= sizeof(addr.sun_path), "fib_update - socket path too long");
+	strcpy(addr.sun_path, socket_path);
+
+	up->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	DIE(up->listen_fd == -1, "fib_update - socket");
+	unlink(socket_path);
+	DIE(bind(up->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1, "fib_update - bind");
+	DIE(listen(up->listen_fd, FIB_UPDATE_MAX_CLIENTS) == -1, "fib_update - listen");
+
+	up->fds[0] = (struct pollfd) { .fd = up->listen_fd, .events = POLLIN };
+	up->nfds = 1;
+
+	DIE(pthread_create(&up->thread, NULL, fib_update_loop, up), "fib_update - pthread_create");
+	return up;
+}
@@ -0,0 +1,132 @@
+#include "icmp_limit.h"
+#include "stats.h"
+
+/* Tokens per ms and capacity of one worker's share of config */
+static void icmp_limit_share(struct icmp_limit_config config, int share, uint32_t *refill, uint32_t *capacity)
+{
+	DIE(config.burst > ICMP_LIMIT_MAX_BURST, "icmp_limit - burst out of range");
+
+	if (!config.rate) {
+		*refill = 0;
+		*capacity = 0;
+		return;
+	}
+
+	// rate / s = rate * ICMP_LIMIT_TOKEN / 1000 per ms; never round down to unlimited
+	uint64_t refill_ms = (uint64_t) config.rate * (ICMP_LIMIT_TOKEN / 1000) / share;
+	*refill = refill_ms ? (refill_ms < UINT32_MAX ? refill_ms : UINT32_MAX) : 1;
+
+	// A share of the burst still lets one message through
+	uint64_t burst = (uint64_t) config.burst * ICMP_LIMIT_TOKEN / share;
+	*capacity = burst > ICMP_LIMIT_TOKEN ? burst : ICMP_LIMIT_TOKEN;
+}
+
+struct icmp_limit *icmp_limit_create(struct icmp_limit_config global, struct icmp_limit_config source,
+	int source_prefix_len, int share)
+{
+	struct icmp_limit *limit = calloc(1, sizeof(struct icmp_limit));
+	DIE(!limit, "icmp_limit - calloc");
+
+	DIE(source_prefix_len < 0 || source_prefix_len > 32, "icmp_limit - source prefix length out of range");
+	DIE(share < 1, "icmp_limit - share");
+
+	limit->mask = (1u << ICMP_LIMIT_SETS_LOG2) - 1;
+	limit->sets = aligned_alloc(64, (limit->mask + 1) * sizeof(struct icmp_limit_set));
+	DIE(!limit->sets, "icmp_limit - aligned_alloc");
+	memset(limit->sets, 0, (limit->mask + 1) * sizeof(struct icmp_limit_set));
+
+	limit->source_mask = source_prefix_len ? ~0u << (32 - source_prefix_len) : 0;
+	icmp_limit_share(global, share, &limit->refill, &limit->capacity);
+	icmp_limit_share(source, share, &limit->source_refill, &limit->source_capacity);
+
+	// Buckets start full
+	limit->global.tokens = limit->capacity;
+	return limit;
+}
+
+void icmp_limit_free(struct icmp_limit *limit)
+{
+	if (!limit) {
+		return;
+	}
+
+	free(limit->sets);
+	free(limit);
+}
+
+/* Adds the tokens earned since the last refill, up to capacity */
+static void icmp_limit_refill(struct icmp_limit_bucket *bucket, uint32_t refill, uint32_t capacity, uint32_t now)
+{
+	uint64_t tokens = bucket->tokens + (uint64_t) (uint32_t) (now - bucket->last) * refill;
+
+	bucket->tokens = tokens < capacity ? tokens : capacity;
+	bucket->last = now;
+}
+
+/* Bucket of source; a new source evicts the least recently refilled one */
+static struct icmp_limit_bucket *icmp_limit_find(struct icmp_limit *limit, uint32_t source, uint32_t now)
+{
+	// Fibonacci hashing, on the bits that are left of the prefix
+	struct icmp_limit_set *set = &limit->sets[(source * 2654435761u) >> 16 & limit->mask];
+	struct icmp_limit_bucket *victim = &set->ways[0];
+
+	for (int i = 0; i < ICMP_LIMIT_WAYS; ++i) {
+		struct icmp_limit_bucket *bucket = &set->ways[i];
+
+		if (bucket->valid && bucket->source == source) {
+			return bucket;
+		}
+		if (!bucket->valid || (victim->valid && now - bucket->last > now - victim->last)) {
+			victim = bucket;
+		}
+	}
+
+	victim->source = source;
+	victim->tokens = limit->source_capacity;
+	victim->last = now;
+	victim->valid = 1;
+	return victim;
+}
+
+/* Takes a token from the global bucket and the one of source, or from neither */
+static bool icmp_limit_take(struct icmp_limit *limit, uint32_t source_key, uint64_t now)
+{
+	struct icmp_limit_bucket *source = NULL;
+
+	if (limit->refill) {
+		icmp_limit_refill(&limit->global, limit->refill, limit->capacity, now);
+	}
+	if (limit->source_refill) {
+		source = icmp_limit_find(limit, source_key, now);
+		icmp_limit_refill(source, limit->source_refill, limit->source_capacity, now);
+	}
+
+	// Take from both buckets or from neither
+	if ((limit->refill && limit->global.tokens < ICMP_LIMIT_TOKEN)
+		|| (source && source->tokens < ICMP_LIMIT_TOKEN)) {
+		stats->events[STATS_ICMP_SUPPRESSED]++;
+		return false;
+	}
+
+	if (limit->refill) {
+		limit->global.tokens -= ICMP_LIMIT_TOKEN;
+	}
+	if (source) {
+		source->tokens -= ICMP_LIMIT_TOKEN;
+	}
+	return true;
+}
+
+bool icmp_limit_allow(struct icmp_limit *limit, uint32_t saddr, uint64_t now)
+{
+	return icmp_limit_take(limit, saddr & limit->source_mask, now);
+}
+
+bool icmp_limit_allow6(struct icmp_limit *limit, const struct in6_addr *saddr, uint64_t now)
+{
+	uint32_t words[2];
+
+	// The /64 folded to 32 bits: may share a bucket with another source
+	memcpy(words, saddr->s6_addr, sizeof(words));
+	return icmp_limit_take(limit, words[0] ^ words[1] * 2654435761u, now);
+}
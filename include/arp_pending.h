@@ -0,0 +1,98 @@
+#pragma once
+#include "skel.h"
+
+/* Unresolved next hops that can have packets waiting at the same time */
+#define ARP_PENDING_MAX_NEIGHBORS 64
+/* Packets held per unresolved next hop */
+#define ARP_PENDING_DEPTH 32
+/* ARP request retry backoff: doubles from INITIAL up to MAX */
+#define ARP_RETRY_INITIAL_MS 100
+#define ARP_RETRY_MAX_MS 1600
+/* Requests sent before giving up on a next hop and dropping its backlog */
+#define ARP_MAX_REQUESTS 5
+
+/* Packets waiting for the MAC of one next hop */
+struct arp_pending_entry {
+	uint32_t next_hop;
+	int interface;
+	int count;
+	int requests;
+	uint64_t next_retry;
+	packet *packets[ARP_PENDING_DEPTH];
+};
+
+struct arp_pending {
+	/* Dense array of the next hops being resolved, scanned on lookup */
+	uint32_t next_hops[ARP_PENDING_MAX_NEIGHBORS];
+	struct arp_pending_entry entries[ARP_PENDING_MAX_NEIGHBORS];
+	int size;
+
+	uint64_t dropped_full;		/* Per-next-hop queue was full */
+	uint64_t dropped_neighbors;	/* Too many unresolved next hops */
+	uint64_t dropped_timeout;	/* Next hop never answered */
+};
+
+/* Result of arp_pending_enqueue */
+enum arp_pending_status {
+	ARP_PENDING_DROPPED,
+	ARP_PENDING_QUEUED,		/* Request already outstanding */
+	ARP_PENDING_RESOLVE,		/* First packet: caller must send a request */
+};
+
+/* Sends an ARP request for next_hop out of interface */
+typedef void (*arp_request_fn)(uint32_t next_hop, int interface);
+
+/**
+ * @brief Creates an empty set of pending queues
+ *
+ * @return struct arp_pending*
+ */
+struct arp_pending *arp_pending_create();
+
+/**
+ * @brief Frees pending and releases every packet still queued
+ *
+ * @param pending
+ */
+void arp_pending_free(struct arp_pending *pending);
+
+/**
+ * @brief Queues m until next_hop is resolved. Unless the packet is dropped,
+ * the queue takes its own reference on m.
+ *
+ * @param pending
+ * @param next_hop IP of next hop (host byte order)
+ * @param interface egress interface towards next_hop
+ * @param m packet to forward, from a pkt_pool
+ * @param now now_ms()
+ * @return enum arp_pending_status
+ */
+enum arp_pending_status arp_pending_enqueue(struct arp_pending *pending, uint32_t next_hop, int interface,
+	packet *m, uint64_t now);
+
+/**
+ * @brief Returns the queue of packets waiting for next_hop, or NULL
+ *
+ * @param pending
+ * @param next_hop IP of next hop (host byte order)
+ * @return struct arp_pending_entry*
+ */
+struct arp_pending_entry *arp_pending_find(struct arp_pending *pending, uint32_t next_hop);
+
+/**
+ * @brief Removes entry and releases the packets it still holds
+ *
+ * @param pending
+ * @param entry
+ */
+void arp_pending_remove(struct arp_pending *pending, struct arp_pending_entry *entry);
+
+/**
+ * @brief Retransmits the ARP requests whose backoff expired, and drops the
+ * backlog of next hops that did not answer ARP_MAX_REQUESTS requests
+ *
+ * @param pending
+ * @param now now_ms()
+ * @param request called for every request to retransmit
+ */
+void arp_pending_tick(struct arp_pending *pending, uint64_t now, arp_request_fn request);
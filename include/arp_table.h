@@ -0,0 +1,93 @@
+#pragma once
+#include "skel.h"
+#include "rcu.h"
+
+/* Initial number of slots, must be a power of 2 */
+#define ARP_TABLE_MIN_CAPACITY 1024
+/* Entries not refreshed for this long are removed by arp_table_age */
+#define ARP_ENTRY_TIMEOUT_MS (300 * 1000)
+/* Slots examined by one arp_table_age call */
+#define ARP_AGING_BUDGET 16
+
+/* Result of arp_table_update */
+enum arp_update {
+	ARP_FULL = -1,		/* MAX_ARP_TABLE_SIZE entries, new IP dropped */
+	ARP_NEW,		/* IP was not in the table */
+	ARP_REFRESHED,		/* Same IP:MAC, timestamp updated */
+	ARP_CHANGED,		/* IP moved to a new MAC */
+};
+
+/* Slot array, replaced as a whole (RCU) when the table grows */
+struct arp_slots {
+	uint32_t mask;
+	int shift;
+	struct arp_entry entries[];
+};
+
+/*
+ * Open-addressing (linear probing) neighbor table keyed by IPv4 address.
+ * Kept at most half full; removals shift the following entries back instead
+ * of leaving tombstones, so probe sequences stay short.
+ *
+ * Shared by every worker. Writers are serialized by lock and modify the
+ * entries inside a seqlock write section; readers take no lock, they copy
+ * the entry out and retry if a write overlapped.
+ */
+struct arp_table {
+	struct arp_slots *slots;
+	uint32_t seq;
+	/* Bumped whenever a MAC changes or an entry is removed */
+	uint32_t version;
+	pthread_mutex_t lock;
+	int size;
+	/* Next slot examined by the aging sweep */
+	uint32_t cursor;
+};
+
+/**
+ * @brief Creates an empty ARP table
+ *
+ * @return struct arp_table*
+ */
+struct arp_table *arp_table_create();
+
+/**
+ * @brief Frees table
+ *
+ * @param table
+ */
+void arp_table_free(struct arp_table *table);
+
+/**
+ * @brief Looks ip up and copies its entry to out. Lock-free, expected O(1)
+ * whatever the number of neighbors.
+ *
+ * @param table
+ * @param ip IP of neighbor (host byte order)
+ * @param out filled with the entry of ip, if any
+ * @return bool whether ip is resolved
+ */
+bool arp_table_lookup(struct arp_table *table, uint32_t ip, struct arp_entry *out);
+
+/**
+ * @brief Inserts ip:mac, or updates in place the entry already holding ip
+ *
+ * @param table
+ * @param ip IP of neighbor (host byte order)
+ * @param mac MAC of neighbor
+ * @param now now_ms()
+ * @return enum arp_update what happened to the entry
+ */
+enum arp_update arp_table_update(struct arp_table *table, uint32_t ip, uint8_t *mac, uint64_t now);
+
+/**
+ * @brief Aging sweep: examines the next ARP_AGING_BUDGET slots and removes
+ * the entries older than ARP_ENTRY_TIMEOUT_MS. Meant to be called once per
+ * burst, so the whole table is swept incrementally. Skipped if another
+ * thread is writing the table.
+ *
+ * @param table
+ * @param now now_ms()
+ * @return int number of entries removed
+ */
+int arp_table_age(struct arp_table *table, uint64_t now);
@@ -0,0 +1,124 @@
+#pragma once
+#include "skel.h"
+
+enum pkt_class {
+	PKT_MALFORMED,		/* truncated or inconsistent headers */
+	PKT_UNSUPPORTED,	/* neither ARP nor IP */
+	PKT_ARP,
+	PKT_IPV4,
+	PKT_IPV6,
+};
+
+/*
+ * Everything the later stages need to know about a frame, found in one pass
+ * over its headers. Offsets are from the start of the frame.
+ */
+struct pkt_desc {
+	uint8_t class;		/* enum pkt_class */
+	uint8_t l4_proto;	/* IPv4 protocol, IPv6 first next header */
+	uint16_t l3_offset;	/* ARP or IP header */
+	uint16_t l4_offset;	/* Past the IPv4 options, the fixed IPv6 header */
+	uint16_t l3_len;	/* IP total length, IPv6 header included */
+	bool fragment;		/* Not the whole datagram: no L4 header to rely on */
+};
+
+/**
+ * @brief Checks the options of an IPv4 header longer than 20 bytes: every
+ * option fits in the header and has a sane length
+ *
+ * @param ip_hdr header of ip_hdr->ihl words, all within the frame
+ * @return bool
+ */
+bool ipv4_options_valid(const struct iphdr *ip_hdr);
+
+static inline enum pkt_class pkt_classify_arp(const packet *m, struct pkt_desc *desc)
+{
+	const struct arp_header *arp_hdr = (const struct arp_header *) (m->payload + desc->l3_offset);
+
+	// Ethernet / IPv4 ARP only
+	if ((size_t) m->len < desc->l3_offset + sizeof(struct arp_header)
+		|| arp_hdr->htype != htons(ARPHRD_ETHER) || arp_hdr->ptype != htons(ETHERTYPE_IP)
+		|| arp_hdr->hlen != ETH_ALEN || arp_hdr->plen != 4) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	return desc->class = PKT_ARP;
+}
+
+static inline enum pkt_class pkt_classify_ipv4(const packet *m, struct pkt_desc *desc)
+{
+	const struct iphdr *ip_hdr = (const struct iphdr *) (m->payload + desc->l3_offset);
+
+	if ((size_t) m->len < desc->l3_offset + sizeof(struct iphdr)
+		|| ip_hdr->version != 4 || ip_hdr->ihl < 5) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	// The datagram holds its own header and fits in the frame (which may
+	// carry Ethernet padding past it)
+	uint16_t header_len = ip_hdr->ihl * 4;
+	uint16_t total_len = ntohs(ip_hdr->tot_len);
+	if (total_len < header_len || desc->l3_offset + total_len > m->len) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	if (header_len > sizeof(struct iphdr) && !ipv4_options_valid(ip_hdr)) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	desc->l4_proto = ip_hdr->protocol;
+	desc->l4_offset = desc->l3_offset + header_len;
+	desc->l3_len = total_len;
+	desc->fragment = ip_hdr->frag_off & htons(IP_MF | IP_OFFMASK);
+	return desc->class = PKT_IPV4;
+}
+
+/* Extension headers are not walked: forwarding does not need them */
+static inline enum pkt_class pkt_classify_ipv6(const packet *m, struct pkt_desc *desc)
+{
+	const struct ip6_hdr *ip6_hdr = (const struct ip6_hdr *) (m->payload + desc->l3_offset);
+
+	if ((size_t) m->len < desc->l3_offset + sizeof(struct ip6_hdr) || ip6_hdr->ip6_vfc >> 4 != 6) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	uint32_t total_len = sizeof(struct ip6_hdr) + ntohs(ip6_hdr->ip6_plen);
+	if (desc->l3_offset + total_len > (uint32_t) m->len) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	desc->l4_proto = ip6_hdr->ip6_nxt;
+	desc->l4_offset = desc->l3_offset + sizeof(struct ip6_hdr);
+	desc->l3_len = total_len;
+	desc->fragment = ip6_hdr->ip6_nxt == IPPROTO_FRAGMENT;
+	return desc->class = PKT_IPV6;
+}
+
+/**
+ * @brief Validates the Ethernet, ARP and IPv4 / IPv6 headers of m and fills
+ * desc, reading each header once
+ *
+ * @param m received frame
+ * @param desc filled in; offsets are only valid for PKT_ARP and PKT_IPV4/6
+ * @return enum pkt_class desc->class
+ */
+static inline enum pkt_class pkt_classify(const packet *m, struct pkt_desc *desc)
+{
+	const struct ether_header *eth_hdr = (const struct ether_header *) m->payload;
+
+	desc->l3_offset = sizeof(struct ether_header);
+	if ((size_t) m->len < sizeof(struct ether_header)) {
+		return desc->class = PKT_MALFORMED;
+	}
+
+	if (eth_hdr->ether_type == htons(ETHERTYPE_IP)) {
+		return pkt_classify_ipv4(m, desc);
+	}
+	if (eth_hdr->ether_type == htons(ETHERTYPE_ARP)) {
+		return pkt_classify_arp(m, desc);
+	}
+	if (eth_hdr->ether_type == htons(ETHERTYPE_IPV6)) {
+		return pkt_classify_ipv6(m, desc);
+	}
+	return desc->class = PKT_UNSUPPORTED;
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include "skel.h"
+
+/* Number of tbl24 entries: one per /24 */
+#define DIR24_8_TBL24_SIZE (1 << 24)
+/* Number of entries in a tbl8 group: one per address in a /24 */
+#define DIR24_8_TBL8_GROUP_SIZE 256
+/* Set in a tbl24 entry when the low bits index a tbl8 group instead of a route */
+#define DIR24_8_EXT_FLAG 0x80000000u
+
+/*
+ * DIR-24-8 FIB. Every entry holds (route index + 1) into rtable, 0 meaning
+ * "no route". A tbl24 entry with DIR24_8_EXT_FLAG set points to a group of
+ * 256 tbl8 entries that resolve prefixes longer than /24.
+ *
+ * Once reserved (dir24_8_reserve), the FIB can be changed while lookups run:
+ * every entry is a single 32-bit store, made after the route slot or tbl8
+ * group it points to is filled. Slots and groups freed by a change are only
+ * reused after dir24_8_release_retired, once no lookup can still see them.
+ */
+struct dir24_8 {
+	uint32_t *tbl24;
+	uint32_t *tbl8;
+	uint32_t tbl8_groups;
+	uint32_t tbl8_capacity;
+	struct route_table_entry *rtable;
+	int rtable_size;
+
+	/* In-place updates: rtable slots and tbl8 groups free for new routes */
+	uint32_t rtable_capacity;
+	uint32_t *free_routes;
+	uint32_t free_route_count;
+	uint32_t *free_groups;
+	uint32_t free_group_count;
+	/* Freed by changes since the last dir24_8_release_retired */
+	uint32_t *retired_routes;
+	uint32_t retired_route_count;
+	uint32_t *retired_groups;
+	uint32_t retired_group_count;
+};
+
+/**
+ * @brief Builds a DIR-24-8 FIB from the output of read_rtable. The FIB keeps
+ * pointers into rtable, so rtable must not be moved or sorted afterwards.
+ *
+ * @param rtable array of route_table_entries (host byte order)
+ * @param rtable_size number of entries in rtable
+ * @return struct dir24_8* the new FIB
+ */
+struct dir24_8 *dir24_8_build(struct route_table_entry *rtable, int rtable_size);
+
+/**
+ * @brief Frees a FIB created by dir24_8_build. Does not free rtable.
+ *
+ * @param fib
+ */
+void dir24_8_free(struct dir24_8 *fib);
+
+/**
+ * @brief Makes fib updatable in place, with room for rtable_capacity routes
+ * and tbl8_capacity tbl8 groups. Must be called before fib is published.
+ *
+ * @param fib
+ * @param rtable_capacity entries of fib->rtable, the ones past rtable_size
+ * zeroed (they become free slots)
+ * @param tbl8_capacity at least fib->tbl8_groups
+ */
+void dir24_8_reserve(struct dir24_8 *fib, uint32_t rtable_capacity, uint32_t tbl8_capacity);
+
+/**
+ * @brief Adds route to a reserved fib in place, in a free slot of rtable.
+ * Its addresses that resolved to a shorter prefix (or to replaced) now
+ * resolve to it.
+ *
+ * @param fib
+ * @param route route to copy (prefix masked); fib owns its group from now on
+ * @param replaced slot of the route of the same prefix it replaces, retired;
+ * -1 if none
+ * @return int slot of route, -1 if fib has no free slot (or tbl8 group) left:
+ * then nothing changed
+ */
+int dir24_8_add(struct dir24_8 *fib, const struct route_table_entry *route, int replaced);
+
+/**
+ * @brief Removes the route in slot from a reserved fib in place: its
+ * addresses resolve to parent. The slot (and a tbl8 group left with a single
+ * route) is retired.
+ *
+ * @param fib
+ * @param slot
+ * @param parent slot of the longest route containing it, -1 if none
+ */
+void dir24_8_delete(struct dir24_8 *fib, uint32_t slot, int parent);
+
+/**
+ * @brief Whether changes retired slots or groups since the last release
+ *
+ * @param fib
+ * @return bool
+ */
+static inline bool dir24_8_has_retired(const struct dir24_8 *fib)
+{
+	return fib->retired_route_count || fib->retired_group_count;
+}
+
+/**
+ * @brief Frees the retired slots (and their groups) and tbl8 groups for
+ * reuse. Only once no lookup started before they were retired still runs.
+ *
+ * @param fib
+ */
+void dir24_8_release_retired(struct dir24_8 *fib);
+
+/**
+ * @brief Returns the number of bytes used by the lookup tables of fib
+ *
+ * @param fib
+ * @return size_t
+ */
+size_t dir24_8_memory(struct dir24_8 *fib);
+
+/**
+ * @brief Same contract as get_best_route: returns a pointer (eg. &rtable[i])
+ * to the longest matching route for dest_ip, or NULL if there is none.
+ * Costs one memory access, two for prefixes longer than /24.
+ *
+ * @param fib
+ * @param dest_ip IP of destination (host byte order)
+ * @return struct route_table_entry* best route towards destination
+ */
+static inline struct route_table_entry *dir24_8_lookup(struct dir24_8 *fib, uint32_t dest_ip)
+{
+	uint32_t entry = fib->tbl24[dest_ip >> 8];
+
+	if (entry & DIR24_8_EXT_FLAG) {
+		entry = fib->tbl8[((entry & ~DIR24_8_EXT_FLAG) << 8) | (dest_ip & 0xff)];
+	}
+
+	return entry ? &fib->rtable[entry - 1] : NULL;
+}
+
+/**
+ * @brief Looks up n destinations at once. The tbl24 (and tbl8) loads of the
+ * whole burst are prefetched before any of them is used, so their memory
+ * latencies overlap instead of adding up.
+ *
+ * @param fib
+ * @param daddrs IPs of destination (host byte order)
+ * @param n number of destinations
+ * @param out out[i] = best route towards daddrs[i], or NULL
+ */
+void dir24_8_lookup_bulk(struct dir24_8 *fib, const uint32_t *daddrs, int n, struct route_table_entry **out);
@@ -0,0 +1,101 @@
+#pragma once
+#include "skel.h"
+#include "dir24_8.h"
+#include "tree_bitmap.h"
+#include <sys/mman.h>
+
+/* Lookup engines a router instance can run with */
+enum fib_engine {
+	FIB_BSEARCH,
+	FIB_DIR24_8,
+	FIB_TREE_BITMAP,
+};
+
+struct fib {
+	enum fib_engine engine;
+	struct route_table_entry *rtable;
+	int rtable_size;
+	union {
+		struct dir24_8 *dir24_8;
+		struct tree_bitmap *tbm;
+	};
+	/* rtable is freed along with the FIB */
+	bool owns_rtable;
+	/* FIB image mapped by fib_image_map, NULL if built in memory */
+	void *image;
+	size_t image_size;
+	/* Bumped by every swap: the next version may reuse a freed one's address */
+	uint64_t version;
+};
+
+/**
+ * @brief Parses an engine name: "bsearch", "dir24_8" or "tbm"
+ *
+ * @param name engine name, may be NULL
+ * @return enum fib_engine the named engine, FIB_DIR24_8 if name is NULL
+ */
+enum fib_engine fib_engine_from_name(const char *name);
+
+/**
+ * @brief Returns the name of engine, as accepted by fib_engine_from_name
+ *
+ * @param engine
+ * @return const char*
+ */
+const char *fib_engine_name(enum fib_engine engine);
+
+/**
+ * @brief Builds the lookup structure of the given engine over rtable
+ *
+ * @param engine
+ * @param rtable sorted array of route_table_entries (host byte order)
+ * @param rtable_size number of entries in rtable
+ * @return struct fib*
+ */
+struct fib *fib_create(enum fib_engine engine, struct route_table_entry *rtable, int rtable_size);
+
+/**
+ * @brief Frees fib and its lookup structure. Does not free rtable (nor its
+ * next-hop groups), unless owns_rtable is set; a mapped FIB image is unmapped.
+ *
+ * @param fib
+ */
+void fib_free(struct fib *fib);
+
+/**
+ * @brief Returns the number of bytes used by the lookup structure of fib
+ *
+ * @param fib
+ * @return size_t
+ */
+size_t fib_memory(struct fib *fib);
+
+/**
+ * @brief Returns a pointer to the best matching route for dest_ip, or NULL
+ *
+ * @param fib
+ * @param dest_ip IP of destination (host byte order)
+ * @return struct route_table_entry*
+ */
+static inline struct route_table_entry *fib_lookup(struct fib *fib, uint32_t dest_ip)
+{
+	switch (fib->engine) {
+	case FIB_DIR24_8:
+		return dir24_8_lookup(fib->dir24_8, dest_ip);
+	case FIB_TREE_BITMAP:
+		return tbm_lookup(fib->tbm, dest_ip);
+	default:
+		return get_best_route(dest_ip, fib->rtable, fib->rtable_size);
+	}
+}
+
+/**
+ * @brief Burst version of fib_lookup: out[i] = best route towards daddrs[i].
+ * Lookups of the burst are interleaved so their memory accesses overlap.
+ *
+ * @param fib
+ * @param daddrs IPs of destination (host byte order)
+ * @param n number of destinations, any value (processed MAX_BURST at a time)
+ * @param out array of at least n routes
+ */
+void fib_lookup_bulk(struct fib *fib, const uint32_t *daddrs, int n, struct route_table_entry **out);
@@ -0,0 +1,66 @@
+#pragma once
+#include "skel.h"
+#include "fib.h"
+#include "rtable.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+
+/* "RFIB", also tells apart images written on a host of the other byte order */
+#define FIB_IMAGE_MAGIC 0x42494652u
+/* Bumped on any change of the layout below */
+#define FIB_IMAGE_VERSION 2
+/* Every section starts on its own page */
+#define FIB_IMAGE_ALIGN 4096
+
+/*
+ * Header of a compiled FIB image. The sections (sorted rtable, DIR-24-8
+ * tbl24 and tbl8) are located by offsets from the start of the file, and
+ * the tables hold route indices rather than pointers: the image can be
+ * mapped anywhere and used in place. Next-hop groups are not stored: the
+ * routes of a multipath prefix are, and they are grouped again when mapped.
+ */
+struct fib_image_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t image_size;
+	/* FNV-1a over the 64-bit words of [FIB_IMAGE_ALIGN, image_size) */
+	uint64_t checksum;
+	uint32_t rtable_size;
+	uint32_t tbl8_groups;
+	uint64_t rtable_offset;
+	uint64_t tbl24_offset;
+	uint64_t tbl8_offset;
+};
+
+/**
+ * @brief Compiles rtable into a FIB image at path. The image is written to
+ * a temporary file renamed over path, so a running router never maps a
+ * half-written one.
+ *
+ * @param path
+ * @param rtable sorted array of route_table_entries (host byte order)
+ * @param rtable_size number of entries in rtable
+ */
+void fib_image_write(const char *path, struct route_table_entry *rtable, int rtable_size);
+
+/**
+ * @brief Whether the file at path starts like a FIB image
+ *
+ * @param path
+ * @return bool
+ */
+bool fib_image_probe(const char *path);
+
+/**
+ * @brief Maps the FIB image at path read-only and shared, so every router
+ * using it shares the same page-cache pages. Dies on a corrupt image or one
+ * of another version. A DIR-24-8 FIB runs straight on the mapped tables;
+ * the other engines are built over the mapped rtable.
+ *
+ * @param path
+ * @param engine
+ * @return struct fib* to free with fib_free, which unmaps the image
+ */
+struct fib *fib_image_map(const char *path, enum fib_engine engine);
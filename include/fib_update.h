@@ -0,0 +1,91 @@
+#pragma once
+#include "skel.h"
+#include "fib.h"
+#include "rcu.h"
+#include "rtable.h"
+#include <sys/un.h>
+#include <poll.h>
+
+/* Control connections served at once */
+#define FIB_UPDATE_MAX_CLIENTS 16
+/* Longest command line */
+#define FIB_UPDATE_LINE_SIZE 4096
+/* Rebuilding engines: the shadow FIB is built once updates pause this long... */
+#define FIB_REBUILD_DELAY_MS 10
+/* ...or at the latest this long after the first change it carries */
+#define FIB_REBUILD_MAX_DELAY_MS 200
+/* Initial slots of the route index, must be a power of 2 */
+#define FIB_UPDATE_MIN_CAPACITY 1024
+/* tbl8 groups a rebuilt dir24_8 gets for in-place updates, beyond twice its own */
+#define FIB_UPDATE_MIN_TBL8_GROUPS 256
+
+/* One connection to the control socket */
+struct fib_update_client {
+	char buf[FIB_UPDATE_LINE_SIZE];
+	int len;
+};
+
+/*
+ * Applies route updates received on a Unix stream socket while the workers
+ * keep forwarding. One command per line, answered by "ok" or "error <why>":
+ *
+ *   add <prefix> <next_hop> <mask> <interface>	new route, or another
+ *							equal-cost path of a known one
+ *   replace <prefix> <next_hop> <mask> <interface>	change an existing route
+ *							(to a single path)
+ *   del <prefix> <mask> [<next_hop> <interface>]	remove a route, or one
+ *							of its paths
+ *   reload <file>					replace every route
+ *
+ * The lines read in one go are applied as one batch, published with a
+ * single pointer swap. Tree bitmap: to a clone of the trie (path copying).
+ * dir24_8: straight into its tables, one atomic entry store at a time, so
+ * a lookup sees either the old route or the new one; the swap only gives
+ * the workers a new FIB header, to drop their cached routes.
+ * bsearch cannot be patched, nor dir24_8 out of free slots or tbl8 groups:
+ * changes are then coalesced and a shadow FIB is built and swapped in, as
+ * for reload. Either way, what the new version replaced is freed (or, for
+ * dir24_8 slots and groups, reused) once no worker can still be using it.
+ */
+struct fib_updater {
+	/* Where the FIB in use is published, read by the workers */
+	struct fib **fib;
+	enum fib_engine engine;
+
+	/* Every route, keyed by (prefix, mask): open addressing, linear probing */
+	struct route_table_entry **slots;
+	uint32_t mask;
+	int shift;
+	int size;
+
+	/* Version being updated in place by the current batch, NULL if none */
+	struct fib *next;
+	/* Routes changed that only a rebuild of the published FIB can take in */
+	bool dirty;
+	uint64_t first_change;
+	uint64_t last_change;
+	/* Routes replaced or deleted since the last swap */
+	struct route_table_entry **retired;
+	int retired_count;
+	int retired_capacity;
+
+	int listen_fd;
+	struct pollfd fds[1 + FIB_UPDATE_MAX_CLIENTS];
+	struct fib_update_client clients[1 + FIB_UPDATE_MAX_CLIENTS];
+	int nfds;
+	pthread_t thread;
+
+	uint64_t updates;
+	uint64_t rebuilds;
+};
+
+/**
+ * @brief Starts the control thread, listening on socket_path
+ *
+ * @param fib where the FIB in use is published; *fib must own its rtable
+ * (owns_rtable) or be a mapped image
+ * @param engine engine of *fib, kept by every FIB the updater builds
+ * @param socket_path path of the Unix socket, replaced if it exists
+ * @return struct fib_updater*
+ */
+struct fib_updater *fib_updater_start(struct fib **fib, enum fib_engine engine, const char *socket_path);
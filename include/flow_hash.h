@@ -0,0 +1,52 @@
+#pragma once
+#include "skel.h"
+#include "classify.h"
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+/* Any value: only has to be the same for every packet of a flow */
+#define FLOW_HASH_SEED 0x9e3779b9u
+
+/* Mixes one 32-bit word into hash */
+static inline uint32_t flow_hash_word(uint32_t hash, uint32_t word)
+{
+#ifdef __SSE4_2__
+	// CRC32C instruction: one per word, 3 cycles
+	return _mm_crc32_u32(hash, word);
+#else
+	hash = (hash ^ word) * 0x9e3779b1u;
+	return hash ^ hash >> 15;
+#endif
+}
+
+/**
+ * @brief Hash of the flow of an IPv4 packet: addresses, protocol and, for
+ * TCP, UDP, UDP-Lite and SCTP, ports. Fragments (even the first one) hash
+ * without ports, so every fragment of a datagram takes the same path.
+ *
+ * @param m
+ * @param desc pkt_classify result, PKT_IPV4
+ * @return uint32_t
+ */
+static inline uint32_t flow_hash_ipv4(const packet *m, const struct pkt_desc *desc)
+{
+	const struct iphdr *ip_hdr = (const struct iphdr *) (m->payload + desc->l3_offset);
+	uint32_t hash = flow_hash_word(FLOW_HASH_SEED, ip_hdr->saddr);
+
+	hash = flow_hash_word(hash, ip_hdr->daddr);
+	hash = flow_hash_word(hash, desc->l4_proto);
+
+	// Both ports are the first word of the L4 header
+	bool ports = desc->l4_proto == IPPROTO_TCP || desc->l4_proto == IPPROTO_UDP
+		|| desc->l4_proto == IPPROTO_UDPLITE || desc->l4_proto == IPPROTO_SCTP;
+	if (ports && !desc->fragment && desc->l4_offset + sizeof(uint32_t) <= (uint32_t) desc->l3_offset + desc->l3_len) {
+		uint32_t word;
+
+		memcpy(&word, m->payload + desc->l4_offset, sizeof(word));
+		hash = flow_hash_word(hash, word);
+	}
+
+	// Buckets are picked with the low bits: fold the high ones in
+	return hash ^ hash >> 16;
+}
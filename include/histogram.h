@@ -0,0 +1,74 @@
+#pragma once
+#include "skel.h"
+
+/*
+ * Log-linear histograms of 64-bit values: one range per power of 2, split
+ * in 2^sub_bits buckets, so every bucket is at most 1 / 2^sub_bits of its
+ * values wide. Values under 2^sub_bits get a bucket each. A histogram is an
+ * array of (64 << sub_bits) counters, filled without any branch on the
+ * value's range.
+ */
+#define HISTOGRAM_BUCKETS(sub_bits) (64 << (sub_bits))
+
+/**
+ * @brief Returns the bucket value falls in
+ *
+ * @param value
+ * @param sub_bits
+ * @return int
+ */
+static inline int histogram_bucket(uint64_t value, int sub_bits)
+{
+	if (value < (1u << sub_bits)) {
+		return value;
+	}
+
+	int shift = 63 - __builtin_clzll(value) - sub_bits;
+	return ((shift + 1) << sub_bits) | ((value >> shift) & ((1u << sub_bits) - 1));
+}
+
+/**
+ * @brief Returns the lowest value falling in bucket
+ *
+ * @param bucket
+ * @param sub_bits
+ * @return uint64_t
+ */
+static inline uint64_t histogram_value(int bucket, int sub_bits)
+{
+	int shift = (bucket >> sub_bits) - 1;
+	uint64_t sub = bucket & ((1u << sub_bits) - 1);
+
+	if (shift < 0) {
+		return sub;
+	}
+	return ((1ull << sub_bits) | sub) << shift;
+}
+
+/**
+ * @brief Returns the value under which fraction of the recorded values fall
+ * (lower bound of its bucket), 0 for an empty histogram
+ *
+ * @param hist HISTOGRAM_BUCKETS(sub_bits) counters
+ * @param sub_bits
+ * @param fraction 0..1, eg. 0.99 for the 99th percentile
+ * @return uint64_t
+ */
+static inline uint64_t histogram_percentile(const uint64_t *hist, int sub_bits, double fraction)
+{
+	uint64_t total = 0, seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS(sub_bits); ++i) {
+		total += hist[i];
+	}
+
+	uint64_t rank = (uint64_t) (fraction * total);
+	for (int i = 0; i < HISTOGRAM_BUCKETS(sub_bits); ++i) {
+		seen += hist[i];
+		if (hist[i] && seen > rank) {
+			return histogram_value(i, sub_bits);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "skel.h"
+
+/* Per-source buckets: 256 sets * 64 bytes = 16KB, 1024 sources */
+#define ICMP_LIMIT_SETS_LOG2 8
+#define ICMP_LIMIT_WAYS 4
+/* Buckets count millionths of a message: slow rates still refill every ms */
+#define ICMP_LIMIT_TOKEN 1000000u
+/* Largest burst, so a full bucket fits in 32 bits */
+#define ICMP_LIMIT_MAX_BURST 4000
+
+struct icmp_limit_config {
+	uint32_t rate;		/* Messages per second, 0: unlimited */
+	uint32_t burst;		/* Messages allowed back to back after a quiet period */
+};
+
+/* Token bucket, refilled lazily when it is checked */
+struct icmp_limit_bucket {
+	uint32_t source;	/* Source prefix (host byte order) */
+	uint32_t tokens;
+	uint32_t last;		/* now_ms() of the last refill, low 32 bits */
+	uint32_t valid;
+};
+
+struct icmp_limit_set {
+	struct icmp_limit_bucket ways[ICMP_LIMIT_WAYS];
+} __attribute__((aligned(64)));
+
+/*
+ * ICMP messages (errors and echo replies) a worker may build: a global
+ * bucket, then one bucket per source prefix, kept in a set-associative
+ * table where the least recently refilled source is evicted. Each worker
+ * has its own, the configured rates are split between them.
+ */
+struct icmp_limit {
+	struct icmp_limit_set *sets;
+	uint32_t mask;
+	uint32_t source_mask;
+	/* Tokens gained per ms (0: unlimited) and bucket capacity */
+	uint32_t refill;
+	uint32_t capacity;
+	uint32_t source_refill;
+	uint32_t source_capacity;
+	struct icmp_limit_bucket global;
+};
+
+/**
+ * @brief Creates the limiter of one of share workers
+ *
+ * @param global limit on every message
+ * @param source limit on the messages sent to one source prefix
+ * @param source_prefix_len sources sharing this many leading bits share a bucket
+ * @param share number of workers the rates are split between
+ * @return struct icmp_limit*
+ */
+struct icmp_limit *icmp_limit_create(struct icmp_limit_config global, struct icmp_limit_config source,
+	int source_prefix_len, int share);
+
+/**
+ * @brief Frees limit
+ *
+ * @param limit
+ */
+void icmp_limit_free(struct icmp_limit *limit);
+
+/**
+ * @brief Takes a token for a message to saddr, if both its source bucket
+ * and the global one have one. Refused messages are counted
+ * (STATS_ICMP_SUPPRESSED) and must not be built.
+ *
+ * @param limit
+ * @param saddr source of the packet answered (host byte order)
+ * @param now now_ms()
+ * @return bool whether the message may be sent
+ */
+bool icmp_limit_allow(struct icmp_limit *limit, uint32_t saddr, uint64_t now);
+
+/**
+ * @brief icmp_limit_allow for an IPv6 source: one bucket per /64, whatever
+ * the configured source prefix length
+ *
+ * @param limit
+ * @param saddr source of the packet answered
+ * @param now now_ms()
+ * @return bool whether the message may be sent
+ */
+bool icmp_limit_allow6(struct icmp_limit *limit, const struct in6_addr *saddr, uint64_t now);
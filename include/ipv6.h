@@ -0,0 +1,93 @@
+#pragma once
+#include "skel.h"
+#include "classify.h"
+
+/* Hop limit of the messages the router originates; NDP requires 255 */
+#define IPV6_HOP_LIMIT 64
+#define NDP_HOP_LIMIT 255
+/* ICMPv6 errors quote the invoking packet, and fit in the minimum MTU */
+#define IPV6_MIN_MTU 1280
+
+/**
+ * @brief Link-local address of mac, by modified EUI-64 (RFC 4291)
+ *
+ * @param mac
+ * @param addr
+ */
+void ipv6_link_local(const uint8_t *mac, struct in6_addr *addr);
+
+/**
+ * @brief Whether addr is one of the addresses of info
+ *
+ * @param info
+ * @param addr
+ * @return bool
+ */
+static inline bool ipv6_is_mine(const struct interface_info *info, const struct in6_addr *addr)
+{
+	return IN6_ARE_ADDR_EQUAL(addr, &info->ip6_ll)
+		|| (!IN6_IS_ADDR_UNSPECIFIED(&info->ip6) && IN6_ARE_ADDR_EQUAL(addr, &info->ip6));
+}
+
+/**
+ * @brief ICMPv6 checksum of len bytes at data, pseudo-header of ip6_hdr
+ * included. 0 for a message carrying a valid checksum.
+ *
+ * @param ip6_hdr
+ * @param data ICMPv6 message
+ * @param len
+ * @return uint16_t
+ */
+uint16_t icmp6_checksum(const struct ip6_hdr *ip6_hdr, const void *data, uint32_t len);
+
+/**
+ * @brief icmp_echo_reply for IPv6: turns the echo request m into its reply
+ * in its own buffer, checksum patched incrementally
+ *
+ * @param m echo request addressed to the router, received on m->interface
+ * @param desc
+ */
+void icmp6_echo_reply(packet *m, const struct pkt_desc *desc);
+
+/**
+ * @brief Sends the ICMPv6 error type / code about m back to its source,
+ * quoting as much of m as fits in IPV6_MIN_MTU
+ *
+ * @param m invoking packet, received on m->interface
+ * @param desc
+ * @param type
+ * @param code
+ */
+void send_icmp6_error(packet *m, const struct pkt_desc *desc, uint8_t type, uint8_t code);
+
+/**
+ * @brief Multicasts a Neighbor Solicitation for target out of interface
+ *
+ * @param target
+ * @param interface
+ */
+void ndp_send_solicit(const struct in6_addr *target, int interface);
+
+/**
+ * @brief Sends a Neighbor Advertisement for target, one of the router's
+ * addresses on interface
+ *
+ * @param target
+ * @param daddr
+ * @param dha MAC of daddr
+ * @param interface
+ * @param solicited answer to a solicitation from daddr
+ */
+void ndp_send_advert(const struct in6_addr *target, const struct in6_addr *daddr, const uint8_t *dha,
+	int interface, bool solicited);
+
+/**
+ * @brief Looks for a link-layer address option in NDP options
+ *
+ * @param options
+ * @param len
+ * @param type ND_OPT_SOURCE_LINKADDR or ND_OPT_TARGET_LINKADDR
+ * @param mac set to the address, if found
+ * @return bool false if absent, or the options are malformed
+ */
+bool ndp_find_lladdr(const uint8_t *options, int len, uint8_t type, uint8_t *mac);
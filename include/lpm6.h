@@ -0,0 +1,74 @@
+#pragma once
+#include "skel.h"
+
+/* Bits of the address indexing the root, then every level below it */
+#define LPM6_ROOT_BITS 16
+#define LPM6_STRIDE 8
+#define LPM6_NODE_SIZE (1 << LPM6_STRIDE)
+/* Slot flag: the rest is a node number, not a route */
+#define LPM6_CHILD 0x80000000u
+
+/*
+ * Multibit trie on 128-bit addresses: a 2^16-slot root indexed by the first
+ * two bytes of the address, then one 256-slot node per further byte. Level
+ * boundaries fall on /16, /24, ..., /48, /56, /64, so the prefix lengths
+ * that make up most IPv6 tables each fill a single slot; the others are
+ * expanded over the slots they cover. A slot holds a route (index + 1, 0
+ * for none) or LPM6_CHILD | node; shorter routes are pushed down into the
+ * nodes created under them, so a lookup reads one slot per level and stops
+ * at the first one that is not a child: a /48 in 5 reads, a /64 in 7.
+ *
+ * Built once from the whole table, read-only afterwards.
+ */
+struct lpm6 {
+	uint32_t *root;
+	uint32_t *nodes;
+	uint32_t node_count;
+	uint32_t node_capacity;
+	/* Sorted by prefix length */
+	struct route6_table_entry *routes;
+	int size;
+};
+
+/**
+ * @brief Builds the trie of routes
+ *
+ * @param routes array of size routes, taken over (freed); the trie keeps
+ * them sorted by prefix length. Later routes win over duplicates.
+ * @param size
+ * @return struct lpm6*
+ */
+struct lpm6 *lpm6_create(struct route6_table_entry *routes, int size);
+
+/**
+ * @brief Frees lpm and its routes
+ *
+ * @param lpm
+ */
+void lpm6_free(struct lpm6 *lpm);
+
+/**
+ * @brief Bytes used by the trie (root and nodes)
+ *
+ * @param lpm
+ * @return size_t
+ */
+size_t lpm6_memory(const struct lpm6 *lpm);
+
+/**
+ * @brief Longest prefix match
+ *
+ * @param lpm
+ * @param addr destination
+ * @return struct route6_table_entry* best route towards addr, NULL if none
+ */
+static inline struct route6_table_entry *lpm6_lookup(const struct lpm6 *lpm, const struct in6_addr *addr)
+{
+	uint32_t slot = lpm->root[addr->s6_addr[0] << 8 | addr->s6_addr[1]];
+
+	for (int i = 2; slot & LPM6_CHILD; ++i) {
+		slot = lpm->nodes[(size_t) (slot & ~LPM6_CHILD) << LPM6_STRIDE | addr->s6_addr[i]];
+	}
+
+	return slot ? &lpm->routes[slot - 1] : NULL;
+}
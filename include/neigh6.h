@@ -0,0 +1,76 @@
+#pragma once
+#include "skel.h"
+#include <pthread.h>
+
+/* Largest number of IPv6 neighbors ever seen */
+#define NEIGH6_MAX 65536
+/*
+ * Keys live in 240.0.0.0/4 (reserved, never an IPv4 neighbor), so they
+ * share the ARP table and pending queues with the IPv4 neighbors. Nothing
+ * IPv4 may reach them: IPv4 packets towards that range are dropped, and
+ * routes through it rejected (rtable_route_error).
+ */
+#define NEIGH6_KEY_BASE 0xf0000000u
+
+/*
+ * Numbers the IPv6 neighbors: each address gets a 32-bit key the first time
+ * it is seen, and keeps it. Entries are never removed (the neighbor itself
+ * ages out of the ARP table), so readers take no lock: a key is published
+ * in the hash only once its address is written. Writers are serialized by
+ * lock.
+ */
+struct neigh6_table {
+	struct in6_addr addrs[NEIGH6_MAX];
+	/* Open addressing (linear probing): key - NEIGH6_KEY_BASE + 1, 0 if empty */
+	uint32_t slots[2 * NEIGH6_MAX];
+	uint32_t count;
+	pthread_mutex_t lock;
+};
+
+/**
+ * @brief Creates an empty table
+ *
+ * @return struct neigh6_table*
+ */
+struct neigh6_table *neigh6_create();
+
+/**
+ * @brief Returns the key of addr, numbering it if it is new
+ *
+ * @param table
+ * @param addr
+ * @return uint32_t key, 0 if the table is full
+ */
+uint32_t neigh6_key(struct neigh6_table *table, const struct in6_addr *addr);
+
+/**
+ * @brief Returns the key of addr, if it has one
+ *
+ * @param table
+ * @param addr
+ * @return uint32_t key, 0 if addr was never numbered
+ */
+uint32_t neigh6_lookup(struct neigh6_table *table, const struct in6_addr *addr);
+
+/**
+ * @brief Whether ip (host byte order) is the key of an IPv6 neighbor
+ *
+ * @param ip
+ * @return bool
+ */
+static inline bool neigh6_is_key(uint32_t ip)
+{
+	return (ip & 0xf0000000u) == NEIGH6_KEY_BASE;
+}
+
+/**
+ * @brief Returns the address numbered key
+ *
+ * @param table
+ * @param key from neigh6_key
+ * @return const struct in6_addr*
+ */
+static inline const struct in6_addr *neigh6_addr(const struct neigh6_table *table, uint32_t key)
+{
+	return &table->addrs[key - NEIGH6_KEY_BASE];
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "skel.h"
+
+/* Largest number of equal-cost next hops of a prefix */
+#define NEXTHOP_GROUP_MAX 16
+/* Hash buckets of a group: 256 keeps every member within 1/256 of its share */
+#define NEXTHOP_BUCKETS 256
+/* Bucket of no member (while a group is rebalanced) */
+#define NEXTHOP_NONE 0xff
+
+struct nexthop {
+	uint32_t next_hop;	/* Host byte order, 0 on directly connected routes */
+	int interface;
+};
+
+/*
+ * Equal-cost next hops of a prefix. A flow hashes into one of the buckets,
+ * and each bucket names the member it goes to. A member that joins takes
+ * buckets from the others, one that leaves hands its own over: only the
+ * flows of the moved buckets change path (resilient hashing), the rest keep
+ * theirs. Groups are never changed once routes point to them: updates build
+ * a new one.
+ */
+struct nexthop_group {
+	uint8_t buckets[NEXTHOP_BUCKETS];
+	int count;
+	struct nexthop members[NEXTHOP_GROUP_MAX];
+};
+
+/**
+ * @brief Creates a group of count members, the buckets spread evenly
+ *
+ * @param members
+ * @param count 1..NEXTHOP_GROUP_MAX
+ * @return struct nexthop_group*
+ */
+struct nexthop_group *nexthop_group_create(const struct nexthop *members, int count);
+
+/**
+ * @brief Returns a copy of group, buckets included
+ *
+ * @param group
+ * @return struct nexthop_group*
+ */
+struct nexthop_group *nexthop_group_copy(const struct nexthop_group *group);
+
+/**
+ * @brief Returns a copy of group with member added. The new member takes
+ * its share of the buckets from the others; the other buckets stay as is.
+ *
+ * @param group
+ * @param member
+ * @return struct nexthop_group* NULL if group already has NEXTHOP_GROUP_MAX members
+ */
+struct nexthop_group *nexthop_group_add(const struct nexthop_group *group, struct nexthop member);
+
+/**
+ * @brief Returns a copy of group without its index-th member, whose buckets
+ * go to the others; the other buckets stay as is.
+ *
+ * @param group at least 2 members
+ * @param index
+ * @return struct nexthop_group*
+ */
+struct nexthop_group *nexthop_group_remove(const struct nexthop_group *group, int index);
+
+/**
+ * @brief Finds member in group
+ *
+ * @param group
+ * @param member
+ * @return int index of member, -1 if it is not in group
+ */
+int nexthop_group_find(const struct nexthop_group *group, struct nexthop member);
+
+/**
+ * @brief Member a flow goes to
+ *
+ * @param group
+ * @param hash flow hash (flow_hash_ipv4)
+ * @return const struct nexthop*
+ */
+static inline const struct nexthop *nexthop_select(const struct nexthop_group *group, uint32_t hash)
+{
+	return &group->members[group->buckets[hash & (NEXTHOP_BUCKETS - 1)]];
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include "skel.h"
+#include "histogram.h"
+#include <pthread.h>
+
+/* Classic pcap file format: microsecond and nanosecond timestamps */
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+/* Largest number of threads replaying at once */
+#define PCAP_IO_MAX_THREADS 64
+/* Latency histogram precision: buckets ~6% wide */
+#define PCAP_IO_HIST_SUB_BITS 4
+#define PCAP_IO_HIST_BUCKETS HISTOGRAM_BUCKETS(PCAP_IO_HIST_SUB_BITS)
+
+/*
+ * Replayed interfaces have no kernel counterpart: interface i gets the MAC
+ * 02:00:00:00:00:<i + 1>, a 1500 bytes MTU and the IP given on the command
+ * line ("name=a.b.c.d")
+ */
+#define PCAP_IO_MAC_PREFIX 0x02, 0x00, 0x00, 0x00, 0x00
+#define PCAP_IO_MTU 1500
+
+/* pcap global header */
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+/* pcap record header, followed by incl_len bytes of frame */
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* us, or ns with PCAP_MAGIC_NS */
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* One frame of the loaded captures */
+struct pcap_frame {
+	uint64_t offset;	/* in pcap_io->data */
+	uint64_t ts_ns;
+	uint16_t len;
+	uint16_t interface;
+};
+
+/* Replay state of one thread: only ever touched by that thread until the report */
+struct pcap_io_thread {
+	/* Indexes (in pcap_io->frames) of the frames this thread replays */
+	uint32_t *frames;
+	uint32_t count;
+	uint32_t next;
+	int loop;
+
+	/* Frames of the burst being processed, and when it was handed out */
+	int burst;
+	uint64_t burst_start;
+	uint64_t start;
+	uint64_t end;
+
+	uint64_t rx;
+	uint64_t tx[MAX_INTERFACES];
+	uint64_t tx_bytes[MAX_INTERFACES];
+	/* Per packet: ns from the burst being handed out to its TX flush */
+	uint64_t latency[PCAP_IO_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+/*
+ * Offline I/O backend: the frames of every interface come from a pcap file
+ * loaded in memory up front, and what the router sends is counted, and
+ * recorded to pcap files if asked to. Nothing touches the kernel, so the
+ * forwarding path can be run and measured anywhere, without privileges.
+ *
+ * The captures <in_dir>/<name>.pcap of the interfaces are merged by
+ * timestamp and replayed loops times. Each thread replays its own share,
+ * split by flow like PACKET_FANOUT_HASH would.
+ */
+struct pcap_io {
+	char *in_dir;
+	char *out_dir;
+	int loops;
+	int threads;
+
+	uint8_t *data;
+	size_t data_size;
+	struct pcap_frame *frames;
+	uint32_t frame_count;
+	uint64_t rx[MAX_INTERFACES];
+
+	/* <out_dir>/<name>.out.pcap, NULL when not recording */
+	FILE *out[MAX_INTERFACES];
+
+	struct pcap_io_thread *thread_state[PCAP_IO_MAX_THREADS];
+	int registered;
+};
+
+/* Backend in use, NULL when the interfaces are real ones */
+extern struct pcap_io *pcap_io;
+
+/**
+ * @brief Selects the pcap backend. Must be called before init.
+ *
+ * @param in_dir directory holding <name>.pcap, the traffic received on
+ * each interface; a missing file means no traffic
+ * @param out_dir where <name>.out.pcap records what is sent on each
+ * interface, NULL to only count it
+ * @param loops number of times the captures are replayed
+ * @param threads number of threads that will replay (workers)
+ * @return struct pcap_io*
+ */
+struct pcap_io *pcap_io_open(const char *in_dir, const char *out_dir, int loops, int threads);
+
+/**
+ * @brief Called by init in place of the socket setup: loads the captures of
+ * the interfaces given as "name=a.b.c.d" or "name=a.b.c.d,ipv6_address"
+ * and describes them (link-local IPv6 addresses come from the MACs)
+ *
+ * @param io
+ * @param argc number of interfaces
+ * @param argv interfaces
+ * @return struct interface_info* the metadata table of the interfaces
+ */
+struct interface_info *pcap_io_attach(struct pcap_io *io, int argc, char *argv[]);
+
+/**
+ * @brief Registers the calling thread, which takes the next share of the
+ * frames. Called by io_thread_init.
+ *
+ * @param io
+ */
+void pcap_io_thread_init(struct pcap_io *io);
+
+/**
+ * @brief Hands out the next frames of the calling thread's share, copied
+ * into pkt_pool buffers owned by the caller. Calling it again means the
+ * previous burst was processed and flushed: its latency is recorded then.
+ *
+ * @param io
+ * @param m filled with the frames
+ * @param max
+ * @return int number of frames, -1 once the share was replayed loops times
+ */
+int pcap_io_rx(struct pcap_io *io, packet **m, int max);
+
+/**
+ * @brief Counts (and records) count frames sent on interface
+ *
+ * @param io
+ * @param interface
+ * @param m frames; the caller keeps its references
+ * @param count
+ */
+void pcap_io_tx(struct pcap_io *io, int interface, packet **m, int count);
+
+/**
+ * @brief Prints throughput, latency percentiles and per interface counters
+ * of the replay, and closes the recordings. Every thread must be done.
+ *
+ * @param io
+ */
+void pcap_io_report(struct pcap_io *io);
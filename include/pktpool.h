@@ -0,0 +1,98 @@
+#pragma once
+#include "skel.h"
+
+/*
+ * Buffers in the default pool: covers every packet the router can hold
+ * (ARP backlogs) plus the ones in flight
+ */
+#define PKT_POOL_SIZE 4096
+
+/* A pool buffer: the packet first, so a packet * is also a pkt_buf * */
+struct pkt_buf {
+	packet pkt;
+	struct pkt_pool *pool;
+	uint32_t refcnt;
+	uint32_t next_free;
+} __attribute__((aligned(64)));
+
+/*
+ * Fixed-size pool of cache-aligned packet buffers. Free buffers are kept on
+ * a LIFO stack, so the most recently freed (cache-hot) one is reused first.
+ * Not thread-safe: one pool per thread.
+ */
+struct pkt_pool {
+	struct pkt_buf *bufs;
+	uint32_t size;
+	uint32_t free_head;
+	uint32_t available;
+	uint64_t alloc_failures;
+};
+
+/* Default pool of the calling thread, created by io_thread_init */
+extern __thread struct pkt_pool *pkt_pool;
+
+/**
+ * @brief Creates a pool of size buffers
+ *
+ * @param size
+ * @return struct pkt_pool*
+ */
+struct pkt_pool *pkt_pool_create(uint32_t size);
+
+/**
+ * @brief Frees pool. Every buffer must have been released.
+ *
+ * @param pool
+ */
+void pkt_pool_free(struct pkt_pool *pool);
+
+/**
+ * @brief Takes a buffer from pool, with one reference owned by the caller
+ *
+ * @param pool
+ * @return packet* the buffer, or NULL if pool is exhausted
+ */
+static inline packet *pkt_alloc(struct pkt_pool *pool)
+{
+	if (!pool->available) {
+		pool->alloc_failures++;
+		return NULL;
+	}
+
+	struct pkt_buf *buf = &pool->bufs[pool->free_head];
+	pool->free_head = buf->next_free;
+	pool->available--;
+
+	buf->refcnt = 1;
+	buf->pkt.len = 0;
+	return &buf->pkt;
+}
+
+/**
+ * @brief Takes one more reference on m, for a second owner (eg. a queue)
+ *
+ * @param m packet from a pool
+ */
+static inline void pkt_ref(packet *m)
+{
+	((struct pkt_buf *) m)->refcnt++;
+}
+
+/**
+ * @brief Drops one reference on m; the last one returns m to its pool
+ *
+ * @param m packet from a pool
+ */
+static inline void pkt_free(packet *m)
+{
+	struct pkt_buf *buf = (struct pkt_buf *) m;
+
+	if (--buf->refcnt) {
+		return;
+	}
+
+	struct pkt_pool *pool = buf->pool;
+	buf->next_free = pool->free_head;
+	pool->free_head = buf - pool->bufs;
+	pool->available++;
+}
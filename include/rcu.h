@@ -0,0 +1,66 @@
+#pragma once
+#include "skel.h"
+#include <pthread.h>
+
+/* Largest number of threads that can read RCU-protected data: 64 workers and the control thread */
+#define RCU_MAX_THREADS 65
+
+/*
+ * Quiescent-state based RCU. Readers take no lock and issue no atomic RMW:
+ * they only promise not to hold RCU-protected pointers across a call to
+ * rcu_quiescent (once per burst) or while offline (blocked in epoll_wait).
+ * Writers publish a new version with rcu_assign_pointer and hand the old
+ * one to rcu_defer, which frees it once every online reader went through a
+ * quiescent state.
+ */
+struct rcu_thread {
+	/* Last global epoch seen by the thread, 0 while offline */
+	uint64_t epoch;
+} __attribute__((aligned(64)));
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Frees an object retired by rcu_defer */
+typedef void (*rcu_free_fn)(void *);
+
+/**
+ * @brief Registers the calling thread as an RCU reader, online
+ *
+ */
+void rcu_register_thread();
+
+/**
+ * @brief Announces that the calling thread holds no RCU-protected pointer,
+ * and frees the objects it retired whose grace period is over
+ *
+ */
+void rcu_quiescent();
+
+/**
+ * @brief The calling thread stops reading (eg. before blocking); it no
+ * longer delays grace periods until rcu_thread_online
+ *
+ */
+void rcu_thread_offline();
+
+/**
+ * @brief The calling thread may read RCU-protected data again
+ *
+ */
+void rcu_thread_online();
+
+/**
+ * @brief Frees ptr with fn once no reader can still hold it. Never blocks.
+ *
+ * @param fn
+ * @param ptr
+ */
+void rcu_defer(rcu_free_fn fn, void *ptr);
+
+/**
+ * @brief Waits until every reader went through a quiescent state. Must not
+ * be called by an online reader.
+ *
+ */
+void rcu_synchronize();
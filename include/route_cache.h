@@ -0,0 +1,120 @@
+#pragma once
+#include "skel.h"
+
+#define ROUTE_CACHE_WAYS 2
+/* Default number of sets: 1024 sets * 64 bytes = 64KB, fits in L2 */
+#define ROUTE_CACHE_SETS_LOG2 10
+
+/*
+ * Everything the forwarding path needs for a destination: 32 bytes, so a
+ * whole 2-way set is one cache line.
+ */
+struct route_cache_entry {
+	uint32_t dest_ip;
+	uint32_t generation;
+	struct route_table_entry *route;
+	struct ether_header eth_hdr;	/* Rewritten Ethernet header */
+	uint8_t interface;		/* Egress interface */
+	uint8_t used;			/* Most recently used way of its set */
+} __attribute__((packed));
+
+struct route_cache_set {
+	struct route_cache_entry ways[ROUTE_CACHE_WAYS];
+} __attribute__((aligned(64)));
+
+struct route_cache {
+	struct route_cache_set *sets;
+	uint32_t mask;
+	/* Entries filled under an older generation are invalid */
+	uint32_t generation;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/**
+ * @brief Creates an empty 2-way set-associative route cache
+ *
+ * @param sets_log2 log2 of the number of sets
+ * @return struct route_cache*
+ */
+struct route_cache *route_cache_create(int sets_log2);
+
+/**
+ * @brief Frees cache
+ *
+ * @param cache
+ */
+void route_cache_free(struct route_cache *cache);
+
+/**
+ * @brief Drops every entry of cache in O(1). Must be called whenever the
+ * rtable or the ARP table changes.
+ *
+ * @param cache
+ */
+void route_cache_invalidate(struct route_cache *cache);
+
+/**
+ * @brief Remembers the route and Ethernet header used to reach dest_ip
+ *
+ * @param cache
+ * @param dest_ip IP of destination (host byte order)
+ * @param route best route towards dest_ip
+ * @param eth_hdr rewritten Ethernet header for packets towards dest_ip
+ */
+void route_cache_insert(struct route_cache *cache, uint32_t dest_ip, struct route_table_entry *route,
+	struct ether_header *eth_hdr);
+
+static inline struct route_cache_set *route_cache_set(struct route_cache *cache, uint32_t dest_ip)
+{
+	// Fibonacci hashing: spreads consecutive addresses over all sets
+	return &cache->sets[(dest_ip * 2654435761u) >> 16 & cache->mask];
+}
+
+/**
+ * @brief Whether dest_ip has an entry, without counting the probe nor
+ * changing which entry is evicted next
+ *
+ * @param cache
+ * @param dest_ip IP of destination (host byte order)
+ * @return bool
+ */
+static inline bool route_cache_contains(struct route_cache *cache, uint32_t dest_ip)
+{
+	struct route_cache_set *set = route_cache_set(cache, dest_ip);
+
+	for (int i = 0; i < ROUTE_CACHE_WAYS; ++i) {
+		if (set->ways[i].dest_ip == dest_ip && set->ways[i].generation == cache->generation) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Returns the cached entry for dest_ip, or NULL on a miss. Updates
+ * the hit/miss counters of cache.
+ *
+ * @param cache
+ * @param dest_ip IP of destination (host byte order)
+ * @return struct route_cache_entry*
+ */
+static inline struct route_cache_entry *route_cache_lookup(struct route_cache *cache, uint32_t dest_ip)
+{
+	struct route_cache_set *set = route_cache_set(cache, dest_ip);
+
+	for (int i = 0; i < ROUTE_CACHE_WAYS; ++i) {
+		struct route_cache_entry *entry = &set->ways[i];
+
+		if (entry->dest_ip == dest_ip && entry->generation == cache->generation) {
+			entry->used = 1;
+			set->ways[i ^ 1].used = 0;
+			cache->hits++;
+			return entry;
+		}
+	}
+
+	cache->misses++;
+	return NULL;
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include "skel.h"
+#include "nexthop.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+
+/* Largest number of threads rtable_load parses with */
+#define RTABLE_MAX_LOAD_THREADS 64
+/* Initial capacity of each chunk's route array, doubled as needed */
+#define RTABLE_INITIAL_CAPACITY 4096
+
+/**
+ * @brief Loads a route file ("prefix next_hop mask interface" per line, in
+ * dotted quads) into a new array, in host byte order. The file is mmap-ed
+ * and parsed in place; with threads > 1 it is split into that many chunks
+ * parsed in parallel. Storage grows with the file: there is no route limit.
+ *
+ * @param file_name
+ * @param threads number of parsing threads, 1..RTABLE_MAX_LOAD_THREADS
+ * @param size set to the number of routes
+ * @return struct route_table_entry* array to free, in file order
+ */
+struct route_table_entry *rtable_load(const char *file_name, int threads, int *size);
+
+/**
+ * @brief rtable_load that fails instead of dying
+ *
+ * @param file_name
+ * @param threads number of parsing threads, 1..RTABLE_MAX_LOAD_THREADS
+ * @param size set to the number of routes
+ * @return struct route_table_entry* array to free, or NULL if the file
+ * cannot be opened or holds a malformed line
+ */
+struct route_table_entry *rtable_try_load(const char *file_name, int threads, int *size);
+
+/**
+ * @brief Whether mask is contiguous: ones, then zeros
+ *
+ * @param mask (host byte order)
+ * @return bool
+ */
+static inline bool rtable_mask_valid(uint32_t mask)
+{
+	// Contiguous: ~mask + 1 is a power of 2 (or 0 for /0 wraparound)
+	return !(~mask & (~mask + 1));
+}
+
+/**
+ * @brief Checks what the engines rely on: a contiguous mask, a next hop out
+ * of 240.0.0.0/4 (the IPv6 neighbor keys, see neigh6.h) and, once the
+ * interfaces are set up (num_interfaces > 0), an existing interface. Offline
+ * tools, which have no interfaces, leave the latter to fib_image_map.
+ *
+ * @param route (host byte order)
+ * @return const char* what is wrong with route, NULL if nothing
+ */
+const char *rtable_route_error(const struct route_table_entry *route);
+
+/**
+ * @brief Parses one "prefix next_hop mask interface" line. Host bits of the
+ * prefix are cleared, and the route must pass rtable_route_error.
+ *
+ * @param line start of the line, moved past its newline on success
+ * @param end end of the buffer holding the line
+ * @param route set to the parsed route (host byte order)
+ * @param error set to what rtable_route_error found, NULL if the line does
+ * not even parse (or on success)
+ * @return bool false if the line is malformed
+ */
+bool rtable_parse_route(const char **line, const char *end, struct route_table_entry *route, const char **error);
+
+/**
+ * @brief Loads an IPv6 route file: "prefix next_hop prefix_len interface"
+ * per line, addresses in any inet_pton form, next_hop :: for directly
+ * connected routes. Host bits of the prefixes are cleared. Must be called
+ * once the interfaces are set up: routes must use an existing one.
+ *
+ * @param file_name
+ * @param size set to the number of routes
+ * @return struct route6_table_entry* array to free, in file order
+ */
+struct route6_table_entry *rtable6_load(const char *file_name, int *size);
+
+/**
+ * @brief Sorts rtable by ascending (prefix, mask), the order get_best_route
+ * expects. LSD radix sort on 16-bit digits: linear in rtable_size, digits
+ * every route shares are skipped.
+ *
+ * @param rtable
+ * @param rtable_size
+ */
+void rtable_sort(struct route_table_entry *rtable, int rtable_size);
+
+/**
+ * @brief Gives the routes sharing a (prefix, mask) in a sorted rtable one
+ * next-hop group, holding their distinct next hops in file order (up to
+ * NEXTHOP_GROUP_MAX, the others are left out)
+ *
+ * @param rtable sorted by rtable_sort, no group set
+ * @param rtable_size
+ * @return int number of groups created
+ */
+int rtable_group(struct route_table_entry *rtable, int rtable_size);
+
+/**
+ * @brief Frees rtable and the groups of its routes
+ *
+ * @param rtable
+ * @param rtable_size
+ */
+void rtable_free(struct route_table_entry *rtable, int rtable_size);
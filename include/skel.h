@@ -1,4 +1,8 @@
 #pragma once
+/* recvmmsg / sendmmsg */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <unistd.h>
@@ -16,15 +20,24 @@
 #include <unistd.h>
 /* According to POSIX.1-2001, POSIX.1-2008 */
 #include <sys/select.h>
+/* epoll_wait */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 /* ethheader */
 #include <net/ethernet.h>
 /* ether_header */
 #include <arpa/inet.h>
 /* icmphdr */
 #include <netinet/ip_icmp.h>
+/* ip6_hdr, icmp6_hdr, nd_neighbor_solicit */
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
 /* arphdr */
 #include <net/if_arp.h>
 #include <asm/byteorder.h>
+/* clock_gettime */
+#include <time.h>
+#include <errno.h>
 
 
 /* 
@@ -32,11 +45,17 @@
  * interface, eg 1500 bytes 
  */
 #define MAX_LEN 1600
-#define ROUTER_NUM_INTERFACES 3
+/* Largest number of interfaces init accepts */
+#define MAX_INTERFACES 64
 
 #define DELIM " "
 #define MAX_RTABLE_SIZE 100000
 #define MAX_ARP_TABLE_SIZE 100000
+/* Largest number of packets / lookups handled together as one burst */
+#define MAX_BURST 64
+/* Frames an interface may have waiting to be sent, per thread and class (power of 2) */
+#define TX_QUEUE_DEPTH 256
+#define TX_CONTROL_DEPTH 64
 #define BROADCAST_ADDR "ff:ff:ff:ff:ff:ff"
 
 #define DIE(condition, message) \
@@ -54,6 +73,13 @@ typedef struct {
 	int interface;
 } packet;
 
+/* Egress traffic classes of an interface, in the order they are sent */
+enum tx_class {
+	TX_CLASS_CONTROL,	/* ARP, NDP and ICMP messages the router built */
+	TX_CLASS_DATA,		/* forwarded frames */
+	TX_CLASS_MAX,
+};
+
 /* Ethernet ARP packet from RFC 826 */
 struct arp_header {
 	uint16_t htype;   /* Format of hardware address */
@@ -70,6 +96,8 @@ struct arp_header {
 struct arp_entry {
 	uint32_t ip;
 	uint8_t mac[6];
+	uint8_t valid;
+	uint64_t updated;	/* now_ms() of the last update */
 };
 
 struct route_table_entry
@@ -78,28 +106,146 @@ struct route_table_entry
 	uint32_t next_hop;
 	uint32_t mask;
 	int interface;
+	/* Equal-cost next hops of the prefix, next_hop among them; NULL if only one */
+	struct nexthop_group *group;
 } __attribute__((packed));
 
-extern int interfaces[ROUTER_NUM_INTERFACES];
+struct route6_table_entry
+{
+	struct in6_addr prefix;
+	struct in6_addr next_hop;	/* :: on directly connected routes */
+	int interface;
+	uint8_t prefix_len;
+};
+
+/* Socket of each interface in the calling thread, indexed by interface number (order of init argv) */
+extern __thread int interfaces[MAX_INTERFACES];
+/* Name of each interface, as given to init */
+extern char interface_names[MAX_INTERFACES][IFNAMSIZ];
+/* Number of interfaces set up by init */
+extern int num_interfaces;
+
+/* What the router needs to know about one of its interfaces */
+struct interface_info {
+	uint32_t ip;		/* network byte order */
+	struct in6_addr ip6;	/* global IPv6 address, :: if none */
+	struct in6_addr ip6_ll;	/* link-local IPv6 address */
+	uint8_t mac[ETH_ALEN];
+	int mtu;
+	int ifindex;
+};
+
+/*
+ * Metadata of every interface, filled by init and replaced as a whole (RCU)
+ * when netlink reports an address or link change
+ */
+extern struct interface_info *interface_info;
 
 /**
- * @brief 
+ * @brief Returns the cached metadata of interface: no syscall. Valid until
+ * the calling thread's next quiescent state.
+ *
+ * @param interface
+ * @return struct interface_info*
+ */
+static inline struct interface_info *get_interface_info(int interface)
+{
+	return &__atomic_load_n(&interface_info, __ATOMIC_ACQUIRE)[interface];
+}
+
+/**
+ * @brief Sends m right away, without blocking: a full socket drops it
  * 
  * @param interface interface to send packet on
  * @param m packet
- * @return int 
+ * @return int bytes sent, -1 if m was dropped
  */
 int send_packet(int interface, packet *m);
 /**
  * @brief Get the packet object
  * 
  * @param m 
- * @return int 
+ * @return int 0, or -1 once a pcap replay is over
  */
 int get_packet(packet *m);
 
 /**
- * @brief Get the interface ip object
+ * @brief Burst receive: waits (epoll) until at least one interface is
+ * readable, then serves the readable interfaces round-robin, reading at most
+ * the RX quota of frames from each per turn (one recvmmsg per turn). Frames are
+ * received into pkt_pool buffers, each owned by the caller (pkt_free).
+ * TX frames held by tx_enqueue are flushed while waiting.
+ *
+ * @param m array of at least max packets, filled with the received frames
+ * @param max largest number of frames to return, capped by the burst size
+ * @return int number of frames received; 0 only if woken by io_wakeup,
+ * -1 once a pcap replay (pcap_io.h) is over
+ */
+int get_packets(packet **m, int max);
+
+/**
+ * @brief Queues a forwarded frame m on the data queue of interface, taking a
+ * reference on it. A full queue drops m (STATS_DROP_TX_QUEUE); a batch of
+ * burst size frames is sent right away, unless the socket is full.
+ *
+ * @param interface interface to send packet on
+ * @param m packet from a pkt_pool
+ */
+void tx_enqueue(int interface, packet *m);
+
+/**
+ * @brief tx_enqueue for a frame the router built (ARP, NDP, ICMP): its
+ * queue is sent before the data queue of the interface
+ *
+ * @param interface interface to send packet on
+ * @param m packet from a pkt_pool
+ */
+void tx_enqueue_control(int interface, packet *m);
+
+/**
+ * @brief Sends the TX queue of interface with non-blocking sendmmsg, as far
+ * as the socket takes it: what is left waits until epoll reports it writable
+ *
+ * @param interface
+ */
+void tx_flush(int interface);
+
+/**
+ * @brief Sends the TX queues of every interface, as far as their sockets
+ * take them
+ *
+ */
+void tx_flush_all();
+
+/**
+ * @brief Called at the end of each burst: serves the TX queues by deficit
+ * round robin, up to a byte budget per call; with a flush timeout only the
+ * queues whose oldest frame waited that long (or holding control frames or a
+ * full batch)
+ *
+ */
+void tx_burst_end();
+
+/**
+ * @brief Switches every interface to the PACKET_MMAP backend: TPACKET_V3
+ * RX and TX rings replace recvmmsg / sendmmsg. Applies to the sockets of the
+ * calling thread, must be called after init (or io_thread_init).
+ *
+ */
+void use_tpacket_rings();
+
+/**
+ * @brief Configures burst I/O
+ *
+ * @param burst largest number of frames per recvmmsg / sendmmsg, 1..MAX_BURST
+ * @param flush_us how long TX frames may be held to fill a batch, in us;
+ * 0 flushes at the end of every burst
+ * @param quota largest number of frames read from one interface per turn
+ */
+void burst_io_config(int burst, int flush_us, int quota);
+
+/**
+ * @brief Get the interface ip object, from the cached metadata
  * 
  * @param interface 
  * @return char* 
@@ -107,7 +253,7 @@ int get_packet(packet *m);
 char *get_interface_ip(int interface);
 
 /**
- * @brief Get the interface mac object
+ * @brief Get the interface mac object, from the cached metadata
  * 
  * @param interface 
  * @param mac 
@@ -122,6 +268,37 @@ void get_interface_mac(int interface, uint8_t *mac);
  */
 void init(int argc, char *argv[]);
 
+/**
+ * @brief Opens the calling thread's own socket on every interface, along
+ * with its epoll instance and packet pool. init does it for the main thread.
+ *
+ */
+void io_thread_init();
+
+/**
+ * @brief Adds the calling thread's sockets to one PACKET_FANOUT_HASH group
+ * per interface: the kernel then spreads the frames of each interface over
+ * the threads that joined, keeping every flow on the same thread. Must come
+ * after use_tpacket_rings.
+ *
+ */
+void io_join_fanout();
+
+/**
+ * @brief Returns the wakeup eventfd of the calling thread, for io_wakeup
+ *
+ * @return int
+ */
+int io_wakeup_fd();
+
+/**
+ * @brief Makes the thread owning fd return from get_packets, even without
+ * frames to read
+ *
+ * @param fd io_wakeup_fd() of the thread
+ */
+void io_wakeup(int fd);
+
 /**
  * @brief 
  * 
@@ -157,6 +334,16 @@ void send_icmp(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int
  */
 void send_icmp_error(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int8_t type, u_int8_t code, int interface);
 
+/**
+ * @brief Turns the ICMP echo request m into its reply, in its own buffer:
+ * MACs and IPs swapped, fresh TTL, type changed and both checksums patched
+ * incrementally. Identifier, sequence and data are echoed back unchanged.
+ *
+ * @param m echo request, received on m->interface
+ * @return bool false if m is too short to hold an echo request
+ */
+bool icmp_echo_reply(packet *m);
+
 
 /**
  * @brief 
@@ -188,6 +375,14 @@ struct icmphdr * parse_icmp(void *buffer);
  */
 struct arp_header* parse_arp(void *buffer);
 
+/**
+ * @brief Converts two hex digits to a byte
+ *
+ * @param hex
+ * @return int the byte, -1 if hex does not start with two hex digits
+ */
+int hex2byte(const char *hex);
+
 /**
  * hwaddr_aton - Convert ASCII string to MAC address (colon-delimited format)
  * @txt: MAC address as a string (e.g., "00:11:22:33:44:55")
@@ -206,9 +401,89 @@ int hwaddr_aton(const char *txt, uint8_t *addr);
 uint16_t ip_checksum(void* vdata,size_t length);
 
 /**
- * @brief Parses routing table
+ * @brief Checksum of an IPv4 header, summed 32 bits at a time. The result is
+ * 0 for a header carrying a valid checksum.
+ *
+ * @param ip_hdr
+ * @param ihl header length, in 32-bit words (ip_hdr->ihl)
+ * @return uint16_t
+ */
+static inline uint16_t ip_fast_csum(const void *ip_hdr, unsigned int ihl)
+{
+	const uint8_t *data = ip_hdr;
+	uint64_t sum = 0;
+
+	for (unsigned int i = 0; i < ihl; ++i) {
+		uint32_t word;
+
+		memcpy(&word, data + 4 * i, sizeof(word));
+		sum += word;
+	}
+
+	// Fold the carries back in
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/**
+ * @brief Incremental checksum update (RFC 1624, eqn. 3):
+ * HC' = ~(~HC + ~m + m'), for one 16-bit word of the checksummed data
+ * going from old to new. Works in either byte order, as long as check,
+ * old and new all use the same one.
+ *
+ * @param check current checksum
+ * @param old previous value of the word
+ * @param new new value of the word
+ * @return uint16_t the updated checksum
+ */
+static inline uint16_t csum_update16(uint16_t check, uint16_t old, uint16_t new)
+{
+	uint32_t sum = (uint16_t) ~check + (uint16_t) ~old + new;
+
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/**
+ * @brief csum_update16 for a 32-bit field (eg. an address)
+ *
+ * @param check current checksum
+ * @param old previous value of the field
+ * @param new new value of the field
+ * @return uint16_t the updated checksum
+ */
+static inline uint16_t csum_update32(uint16_t check, uint32_t old, uint32_t new)
+{
+	check = csum_update16(check, old >> 16, new >> 16);
+	return csum_update16(check, old & 0xffff, new & 0xffff);
+}
+
+/**
+ * @brief Decrements the TTL of ip_hdr and patches its checksum accordingly,
+ * without summing the header again
+ *
+ * @param ip_hdr
+ */
+static inline void ip_decrease_ttl(struct iphdr *ip_hdr)
+{
+	uint16_t old, new;
+
+	// TTL is the high byte of the 16-bit word it shares with the protocol
+	memcpy(&old, &ip_hdr->ttl, sizeof(old));
+	ip_hdr->ttl--;
+	memcpy(&new, &ip_hdr->ttl, sizeof(new));
+
+	ip_hdr->check = csum_update16(ip_hdr->check, old, new);
+}
+
+/**
+ * @brief Parses routing table (see rtable_load)
  * 
- * @param rtable array of route_table_entries
+ * @param rtable array of MAX_RTABLE_SIZE route_table_entries
  * @param file_name of file with route_table_entries
  * 	
  * @return size of routing table
@@ -220,7 +495,7 @@ int read_rtable(struct route_table_entry *rtable, char *file_name);
  * 
  * @param a first element - to be compared
  * @param b second element - to compare with
- * @return int 1 if swap is needed, else 0
+ * @return int <0, 0 or >0 as a sorts before, with or after b
  */
 int route_entry_cmp(const void *a, const void *b);
 
@@ -229,7 +504,9 @@ int route_entry_cmp(const void *a, const void *b);
  * for the given dest_ip. Or NULL if there is no matching route.
  * 
  * Search method: binary search: find the "biggest" route smaller or equal
- * to the target route
+ * to the target route. If it does not cover dest_ip, search again below it,
+ * for the routes no longer than the bits it shares with dest_ip (at most 32
+ * times, usually once or twice). rtable must be sorted by rtable_sort.
  * 
  * @param dest_ip IP of destination
  * @return struct route_table_entry* best route towards destination 
@@ -237,20 +514,9 @@ int route_entry_cmp(const void *a, const void *b);
 struct route_table_entry *get_best_route(uint32_t dest_ip, struct route_table_entry *rtable, int rtable_size);
 
 /**
- * @brief  Returns a pointer (eg. &arp_table[i]) to the best matching ARP entry.
- * for the given dest_ip or NULL if there is no matching entry.
- * 
- * @param dest_ip IP of target
- * @return struct arp_entry* - matching entry in ARP table
- */
-struct arp_entry *get_arp_entry(uint32_t dest_ip, struct arp_entry *arp_table, int table_size);
-
-/**
- * @brief inserts new IP:MAC entry into arp_table, increses arp_table index
- * 
- * @param arp_table 
- * @param arp_table_index 
- * @param ip 
- * @param mac 
+ * @brief Returns a monotonic timestamp in milliseconds. Cheap enough to be
+ * called once per packet (coarse clock, served from the vDSO).
+ *
+ * @return uint64_t
  */
-void update_arp_table(struct arp_entry *arp_table, int *arp_table_index, uint32_t ip, uint8_t *mac);
\ No newline at end of file
+uint64_t now_ms();
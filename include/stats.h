@@ -0,0 +1,179 @@
+#pragma once
+#include "skel.h"
+#include "histogram.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define STATS_MAGIC 0x54415453
+#define STATS_VERSION 7
+/* Largest number of threads with a block in the segment */
+#define STATS_MAX_THREADS 64
+/* One packet (and burst) in 2^STATS_SAMPLE_SHIFT has its stages timed */
+#define STATS_SAMPLE_SHIFT 6
+/* Stage histograms: buckets ~25% wide */
+#define STATS_HIST_SUB_BITS 2
+#define STATS_HIST_BUCKETS HISTOGRAM_BUCKETS(STATS_HIST_SUB_BITS)
+
+/* Why a packet went no further */
+enum stats_drop {
+	STATS_DROP_MALFORMED,		/* truncated or inconsistent headers */
+	STATS_DROP_UNSUPPORTED,		/* neither ARP nor IP */
+	STATS_DROP_CHECKSUM,		/* bad IPv4 header checksum */
+	STATS_DROP_TTL,			/* TTL / hop limit expired, time exceeded sent */
+	STATS_DROP_NO_ROUTE,		/* no route, destination unreachable sent */
+	STATS_DROP_RESERVED,		/* IPv4 destination in 240.0.0.0/4 */
+	STATS_DROP_ARP_QUEUE,		/* next hop unresolved and its queue (or the IPv6 neighbor table) full */
+	STATS_DROP_ARP_TIMEOUT,		/* next hop never answered ARP / NDP */
+	STATS_DROP_LOCAL,		/* addressed to the router, not an echo request or NDP */
+	STATS_DROP_NO_BUFFER,		/* reply not built: packet pool exhausted */
+	STATS_DROP_TX_QUEUE,		/* egress queue (or socket, for send_packet) full */
+	STATS_DROP_TX_ERROR,		/* refused by the kernel: link down, qdisc drop */
+	STATS_DROP_MAX,
+};
+
+enum stats_event {
+	STATS_ARP_REQUEST_IN,
+	STATS_ARP_REPLY_IN,
+	STATS_ARP_REQUEST_OUT,
+	STATS_ARP_REPLY_OUT,
+	STATS_ND_SOLICIT_IN,
+	STATS_ND_ADVERT_IN,
+	STATS_ND_SOLICIT_OUT,
+	STATS_ND_ADVERT_OUT,
+	STATS_ICMP_ECHO_REPLY,
+	STATS_ICMP_ERROR,
+	STATS_ICMP_SUPPRESSED,		/* not built: over the rate limit */
+	STATS_TX_BLOCKED,		/* socket or TX ring full, TX queue held back */
+	STATS_RX_ERROR,			/* recvmmsg interrupted, link down or out of socket memory */
+	STATS_ROUTE_CACHE_HIT,
+	STATS_ROUTE_CACHE_MISS,
+	STATS_EVENT_MAX,
+};
+
+/* Steps of the forwarding path, timed on sampled packets */
+enum stats_stage {
+	STATS_STAGE_PARSE,		/* header checks (the burst is classified up front) */
+	STATS_STAGE_LOOKUP,		/* route cache, then FIB (mostly looked up per burst, up front) */
+	STATS_STAGE_NEIGHBOR,		/* ARP table */
+	STATS_STAGE_REWRITE,		/* TTL, checksum, Ethernet header */
+	STATS_STAGE_TX,			/* tx_enqueue */
+	STATS_STAGE_FLUSH,		/* end of burst TX flush, per burst */
+	STATS_STAGE_MAX,
+};
+
+/*
+ * Counters of one thread, written by it alone with plain stores: no atomic,
+ * no shared cache line. Readers may see a counter lag behind, never a torn
+ * one (aligned 64-bit stores).
+ */
+struct stats_thread {
+	uint64_t rx[MAX_INTERFACES];
+	uint64_t tx[MAX_INTERFACES];
+	/* Frames in the TX queues of the thread, now */
+	uint64_t tx_queued[MAX_INTERFACES];
+	/* Frames dropped on the way out: queue full, kernel refused */
+	uint64_t tx_dropped[MAX_INTERFACES];
+	uint64_t drops[STATS_DROP_MAX];
+	uint64_t events[STATS_EVENT_MAX];
+	uint64_t bursts;
+	/* Packets before the next sampled one */
+	uint64_t sample_countdown;
+	/* TSC cycles spent in each stage, per sampled packet */
+	uint64_t stages[STATS_STAGE_MAX][STATS_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+/*
+ * Shared memory segment (shm_open) an external reader maps read-only, eg.
+ * "router --stats <name>"
+ */
+struct stats_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_threads;
+	uint32_t num_interfaces;
+	/* TSC cycles per second, to turn stage histograms into time */
+	uint64_t tsc_hz;
+	uint32_t sample_shift;
+	char interface_names[MAX_INTERFACES][IFNAMSIZ];
+	struct stats_thread threads[STATS_MAX_THREADS];
+};
+
+/* Block of the calling thread; a scratch block until stats_thread_init */
+extern __thread struct stats_thread *stats;
+
+/**
+ * @brief Creates the counters of num_threads threads, after init
+ *
+ * @param name shm_open name ("/router"), replaced if it exists; NULL keeps
+ * the counters private
+ * @param num_threads
+ * @return struct stats_segment*
+ */
+struct stats_segment *stats_create(const char *name, int num_threads);
+
+/**
+ * @brief Makes the calling thread count into its block of segment
+ *
+ * @param segment
+ * @param id thread number, 0..num_threads - 1
+ */
+void stats_thread_init(struct stats_segment *segment, int id);
+
+/**
+ * @brief Maps the segment name read-only and prints its counters, summed
+ * over the threads, and the stage latency percentiles
+ *
+ * @param name shm_open name
+ */
+void stats_print(const char *name);
+
+/**
+ * @brief Cycle counter: TSC where there is one, ns otherwise. No syscall.
+ *
+ * @return uint64_t
+ */
+static inline uint64_t stats_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Whether the next packet (or burst) has its stages timed
+ *
+ * @return bool
+ */
+static inline bool stats_sample()
+{
+	if (--stats->sample_countdown) {
+		return false;
+	}
+
+	stats->sample_countdown = 1 << STATS_SAMPLE_SHIFT;
+	return true;
+}
+
+/**
+ * @brief Records a stage of a sampled packet, which started at start
+ *
+ * @param stage
+ * @param start stats_now() when the stage started
+ * @return uint64_t stats_now(): the start of the next stage
+ */
+static inline uint64_t stats_stage(enum stats_stage stage, uint64_t start)
+{
+	uint64_t now = stats_now();
+
+	stats->stages[stage][histogram_bucket(now - start, STATS_HIST_SUB_BITS)]++;
+	return now;
+}
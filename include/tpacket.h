@@ -0,0 +1,74 @@
+#pragma once
+#include "skel.h"
+#include <linux/if_packet.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+/* RX ring: TPACKET_RX_BLOCK_NR blocks, retired by the kernel when full or after TPACKET_RX_TIMEOUT_MS */
+#define TPACKET_RX_BLOCK_SIZE (1 << 18)
+#define TPACKET_RX_BLOCK_NR 64
+#define TPACKET_RX_TIMEOUT_MS 1
+/* TX ring: fixed-size frames, each big enough for MAX_LEN bytes plus the header */
+#define TPACKET_TX_FRAME_SIZE 2048
+#define TPACKET_TX_BLOCK_SIZE (1 << 16)
+#define TPACKET_TX_BLOCK_NR 32
+/* Offset of the frame data in a TX slot */
+#define TPACKET_TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+/* PACKET_MMAP rings of one AF_PACKET socket: RX followed by TX in a single mapping */
+struct tpacket_ring {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+
+	/* RX: current block, and the next frame to read in it */
+	uint8_t *rx;
+	int rx_block;
+	struct tpacket3_hdr *rx_frame;
+	uint32_t rx_left;
+
+	/* TX: next slot to fill */
+	uint8_t *tx;
+	int tx_frame_nr;
+	int tx_slot;
+};
+
+/**
+ * @brief Switches fd to TPACKET_V3 and maps an RX and a TX ring on it
+ *
+ * @param fd bound AF_PACKET socket
+ * @return struct tpacket_ring*
+ */
+struct tpacket_ring *tpacket_ring_create(int fd);
+
+/**
+ * @brief Unmaps the rings of ring. Does not close its socket.
+ *
+ * @param ring
+ */
+void tpacket_ring_free(struct tpacket_ring *ring);
+
+/**
+ * @brief Reads up to max frames from the RX ring, without any syscall.
+ * Frames are copied into pkt_pool buffers owned by the caller; ring blocks
+ * go back to the kernel as soon as their last frame is read.
+ *
+ * @param ring
+ * @param m filled with the received frames
+ * @param max
+ * @param interface set as the interface of every frame
+ * @return int number of frames read, 0 if the ring is empty
+ */
+int tpacket_rx(struct tpacket_ring *ring, packet **m, int max, int interface);
+
+/**
+ * @brief Places count frames in the TX ring and kicks the kernel with a
+ * single non-blocking send(). Stops at the first frame that finds no free
+ * slot: the socket polls writable once one is freed.
+ *
+ * @param ring
+ * @param m frames to send; the caller keeps its references
+ * @param count
+ * @return int number of frames placed in the ring, the first ones of m
+ */
+int tpacket_tx(struct tpacket_ring *ring, packet **m, int count);
@@ -0,0 +1,179 @@
+#pragma once
+#include "skel.h"
+
+/* Bits of the address consumed by each trie level */
+#define TBM_STRIDE 4
+/* 32 / TBM_STRIDE levels, plus one that only holds /32 prefixes */
+#define TBM_MAX_DEPTH (32 / TBM_STRIDE + 1)
+/* Longest block: the children of a node */
+#define TBM_MAX_BLOCK (1 << TBM_STRIDE)
+/* Pools: the nodes of every depth (0, the root, stays empty), then their results */
+#define TBM_POOLS (2 * TBM_MAX_DEPTH)
+
+/*
+ * Tree bitmap node. internal has one bit per prefix of relative length
+ * 0..TBM_STRIDE-1 that ends in this node (bit (1 << len) - 1 + value), external
+ * has one bit per child. The results of a node are a block of the result pool
+ * of its depth, its children a block of the node pool of the next depth,
+ * starting at index results / children; the one looked up is at that index
+ * plus the popcount of the bitmap bits below its own.
+ */
+struct tbm_node {
+	uint16_t internal;
+	uint16_t external;
+	uint32_t results;
+	uint32_t children;
+};
+
+/*
+ * Array the blocks of one pool are carved from. It is never written where a
+ * published version can read it: a pool that has to grow in a clone is copied,
+ * and the older versions keep the old array until they are released.
+ */
+struct tbm_pool {
+	void *base;
+	/* Elements handed out, free blocks included */
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t element_size;
+};
+
+/* Free blocks of one length in one pool: a stack of first indexes */
+struct tbm_free_list {
+	uint32_t *blocks;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+/* Block of a pool replaced in a clone, reusable once no reader sees it */
+struct tbm_block {
+	uint32_t first;
+	uint8_t pool;
+	uint8_t length;
+};
+
+struct tree_bitmap {
+	struct tbm_node root;
+	struct tbm_pool pools[TBM_POOLS];
+	int nodes;
+	int prefixes;
+	/* Made by tbm_clone: blocks may be shared with older versions */
+	bool shared;
+	/* Free blocks of pool p and length l at free[p * (TBM_MAX_BLOCK + 1) + l],
+	 * handed over from version to version by tbm_clone */
+	struct tbm_free_list *free;
+	/* Blocks and pool arrays of older versions replaced in this clone */
+	struct tbm_block *retired;
+	int retired_count;
+	int retired_capacity;
+	void **retired_bases;
+	int retired_base_count;
+	int retired_base_capacity;
+};
+
+/**
+ * @brief Creates an empty tree bitmap FIB
+ *
+ * @return struct tree_bitmap*
+ */
+struct tree_bitmap *tbm_create();
+
+/**
+ * @brief Builds a tree bitmap FIB holding every entry of rtable
+ *
+ * @param rtable array of route_table_entries (host byte order)
+ * @param rtable_size number of entries in rtable
+ * @return struct tree_bitmap*
+ */
+struct tree_bitmap *tbm_build(struct route_table_entry *rtable, int rtable_size);
+
+/**
+ * @brief Creates a new version of tbm sharing all of its nodes, for readers
+ * to keep using tbm while the clone is updated. tbm_insert / tbm_delete on
+ * the clone copy the blocks along the path they modify (path copying) and
+ * keep the replaced ones, see tbm_release_retired. From then on, tbm must
+ * not be updated, and is released with free(), not tbm_free().
+ *
+ * @param tbm
+ * @return struct tree_bitmap*
+ */
+struct tree_bitmap *tbm_clone(struct tree_bitmap *tbm);
+
+/**
+ * @brief Whether the clone replaced blocks or pool arrays of older versions
+ *
+ * @param tbm
+ * @return bool
+ */
+static inline bool tbm_has_retired(const struct tree_bitmap *tbm)
+{
+	return tbm->retired_count || tbm->retired_base_count;
+}
+
+/**
+ * @brief Makes the blocks the clone replaced free for reuse, and frees the
+ * pool arrays. Must be called after the clone is published, once no reader
+ * can still be using an older version (e.g. after rcu_synchronize).
+ *
+ * @param tbm
+ */
+void tbm_release_retired(struct tree_bitmap *tbm);
+
+/**
+ * @brief Frees every node of tbm. Does not free the routes it points to.
+ *
+ * @param tbm
+ */
+void tbm_free(struct tree_bitmap *tbm);
+
+/**
+ * @brief Inserts prefix/len, or replaces the route already stored for it.
+ * Touches at most TBM_MAX_DEPTH nodes.
+ *
+ * @param tbm
+ * @param prefix prefix (host byte order)
+ * @param len prefix length, 0..32
+ * @param route route returned by lookups matching this prefix
+ * @return int 1 if the prefix is new, 0 if an existing route was replaced
+ */
+int tbm_insert(struct tree_bitmap *tbm, uint32_t prefix, int len, struct route_table_entry *route);
+
+/**
+ * @brief Removes prefix/len and frees the nodes left empty
+ *
+ * @param tbm
+ * @param prefix prefix (host byte order)
+ * @param len prefix length, 0..32
+ * @return int 0 on success, -1 if the prefix is not in tbm
+ */
+int tbm_delete(struct tree_bitmap *tbm, uint32_t prefix, int len);
+
+/**
+ * @brief Same contract as get_best_route: longest matching route for
+ * dest_ip, or NULL if there is none
+ *
+ * @param tbm
+ * @param dest_ip IP of destination (host byte order)
+ * @return struct route_table_entry*
+ */
+struct route_table_entry *tbm_lookup(struct tree_bitmap *tbm, uint32_t dest_ip);
+
+/**
+ * @brief Looks up n destinations at once, walking all of them down the trie
+ * one level at a time and prefetching the next node of each walk
+ *
+ * @param tbm
+ * @param daddrs IPs of destination (host byte order)
+ * @param n number of destinations
+ * @param out out[i] = best route towards daddrs[i], or NULL
+ */
+void tbm_lookup_bulk(struct tree_bitmap *tbm, const uint32_t *daddrs, int n, struct route_table_entry **out);
+
+/**
+ * @brief Returns the number of bytes allocated by tbm: its pools, blocks not
+ * in use included, and their free lists
+ *
+ * @param tbm
+ * @return size_t
+ */
+size_t tbm_memory(struct tree_bitmap *tbm);
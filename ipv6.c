@@ -0,0 +1,222 @@
+#include "ipv6.h"
+#include "pktpool.h"
+#include "stats.h"
+
+void ipv6_link_local(const uint8_t *mac, struct in6_addr *addr)
+{
+	memset(addr, 0, sizeof(struct in6_addr));
+	addr->s6_addr[0] = 0xfe;
+	addr->s6_addr[1] = 0x80;
+
+	// MAC split around ff:fe, universal/local bit flipped
+	addr->s6_addr[8] = mac[0] ^ 0x02;
+	addr->s6_addr[9] = mac[1];
+	addr->s6_addr[10] = mac[2];
+	addr->s6_addr[11] = 0xff;
+	addr->s6_addr[12] = 0xfe;
+	addr->s6_addr[13] = mac[3];
+	addr->s6_addr[14] = mac[4];
+	addr->s6_addr[15] = mac[5];
+}
+
+static uint32_t sum16(const void *data, uint32_t len)
+{
+	const uint8_t *bytes = data;
+	uint32_t sum = 0;
+
+	for (uint32_t i = 0; i + 1 < len; i += 2) {
+		sum += bytes[i] << 8 | bytes[i + 1];
+	}
+	if (len & 1) {
+		sum += bytes[len - 1] << 8;
+	}
+
+	return sum;
+}
+
+uint16_t icmp6_checksum(const struct ip6_hdr *ip6_hdr, const void *data, uint32_t len)
+{
+	// Pseudo-header: addresses, upper-layer length, next header
+	uint64_t sum = sum16(&ip6_hdr->ip6_src, 2 * sizeof(struct in6_addr));
+	sum += len + IPPROTO_ICMPV6;
+	sum += sum16(data, len);
+
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return htons(~sum);
+}
+
+void icmp6_echo_reply(packet *m, const struct pkt_desc *desc)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + desc->l3_offset);
+	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (m->payload + desc->l4_offset);
+	uint16_t old, new;
+
+	// Back to the sender, from the interface the request came in on
+	memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, ETH_ALEN);
+	memcpy(eth_hdr->ether_shost, get_interface_info(m->interface)->mac, ETH_ALEN);
+
+	// Swapping the addresses leaves the pseudo-header sum as is
+	struct in6_addr saddr = ip6_hdr->ip6_src;
+	ip6_hdr->ip6_src = ip6_hdr->ip6_dst;
+	ip6_hdr->ip6_dst = saddr;
+	ip6_hdr->ip6_hlim = IPV6_HOP_LIMIT;
+
+	// Type is the high byte of the first ICMPv6 word
+	memcpy(&old, icmp6_hdr, sizeof(old));
+	icmp6_hdr->icmp6_type = ICMP6_ECHO_REPLY;
+	memcpy(&new, icmp6_hdr, sizeof(new));
+	icmp6_hdr->icmp6_cksum = csum_update16(icmp6_hdr->icmp6_cksum, old, new);
+}
+
+/* Ethernet + IPv6 headers of a message from interface, ICMPv6 of len bytes */
+static void build_icmp6_headers(packet *m, int interface, const uint8_t *dha, const struct in6_addr *saddr,
+	const struct in6_addr *daddr, uint8_t hop_limit, uint32_t len)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + sizeof(struct ether_header));
+
+	memcpy(eth_hdr->ether_dhost, dha, ETH_ALEN);
+	memcpy(eth_hdr->ether_shost, get_interface_info(interface)->mac, ETH_ALEN);
+	eth_hdr->ether_type = htons(ETHERTYPE_IPV6);
+
+	ip6_hdr->ip6_flow = htonl(6 << 28);
+	ip6_hdr->ip6_plen = htons(len);
+	ip6_hdr->ip6_nxt = IPPROTO_ICMPV6;
+	ip6_hdr->ip6_hlim = hop_limit;
+	ip6_hdr->ip6_src = *saddr;
+	ip6_hdr->ip6_dst = *daddr;
+
+	m->len = sizeof(struct ether_header) + sizeof(struct ip6_hdr) + len;
+}
+
+/* Fills the checksum of the ICMPv6 message built by build_icmp6_headers */
+static void icmp6_finish(packet *m)
+{
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + sizeof(struct ether_header));
+	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (ip6_hdr + 1);
+
+	icmp6_hdr->icmp6_cksum = 0;
+	icmp6_hdr->icmp6_cksum = icmp6_checksum(ip6_hdr, icmp6_hdr, ntohs(ip6_hdr->ip6_plen));
+}
+
+void send_icmp6_error(packet *m, const struct pkt_desc *desc, uint8_t type, uint8_t code)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + desc->l3_offset);
+	struct interface_info *info = get_interface_info(m->interface);
+
+	packet *error = pkt_alloc(pkt_pool);
+	if (!error) {
+		stats->drops[STATS_DROP_NO_BUFFER]++;
+		return;
+	}
+
+	// As much of the invoking packet as fits in the minimum MTU
+	uint32_t quoted = desc->l3_len;
+	if (quoted > IPV6_MIN_MTU - sizeof(struct ip6_hdr) - sizeof(struct icmp6_hdr)) {
+		quoted = IPV6_MIN_MTU - sizeof(struct ip6_hdr) - sizeof(struct icmp6_hdr);
+	}
+
+	// From the global address, unless the source only knows the link
+	const struct in6_addr *saddr = IN6_IS_ADDR_UNSPECIFIED(&info->ip6) || IN6_IS_ADDR_LINKLOCAL(&ip6_hdr->ip6_src)
+		? &info->ip6_ll : &info->ip6;
+	build_icmp6_headers(error, m->interface, eth_hdr->ether_shost, saddr, &ip6_hdr->ip6_src, IPV6_HOP_LIMIT,
+		sizeof(struct icmp6_hdr) + quoted);
+
+	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (error->payload + sizeof(struct ether_header) + sizeof(struct ip6_hdr));
+	icmp6_hdr->icmp6_type = type;
+	icmp6_hdr->icmp6_code = code;
+	icmp6_hdr->icmp6_data32[0] = 0;
+	memcpy(icmp6_hdr + 1, ip6_hdr, quoted);
+	icmp6_finish(error);
+
+	tx_enqueue_control(m->interface, error);
+	pkt_free(error);
+}
+
+/* Link-layer address option: type, length in units of 8 bytes, MAC */
+static void ndp_put_lladdr(uint8_t *option, uint8_t type, const uint8_t *mac)
+{
+	option[0] = type;
+	option[1] = 1;
+	memcpy(option + 2, mac, ETH_ALEN);
+}
+
+void ndp_send_solicit(const struct in6_addr *target, int interface)
+{
+	struct interface_info *info = get_interface_info(interface);
+
+	packet *m = pkt_alloc(pkt_pool);
+	if (!m) {
+		stats->drops[STATS_DROP_NO_BUFFER]++;
+		return;
+	}
+
+	// Solicited-node multicast group of target: ff02::1:ffXX:XXXX, and its MAC
+	struct in6_addr group = { .s6_addr = { 0xff, 0x02, [11] = 0x01, 0xff,
+		target->s6_addr[13], target->s6_addr[14], target->s6_addr[15] } };
+	uint8_t group_mac[ETH_ALEN] = { 0x33, 0x33, 0xff, target->s6_addr[13], target->s6_addr[14], target->s6_addr[15] };
+
+	build_icmp6_headers(m, interface, group_mac, &info->ip6_ll, &group, NDP_HOP_LIMIT,
+		sizeof(struct nd_neighbor_solicit) + 8);
+
+	struct nd_neighbor_solicit *ns = (struct nd_neighbor_solicit *) (m->payload + sizeof(struct ether_header) + sizeof(struct ip6_hdr));
+	ns->nd_ns_type = ND_NEIGHBOR_SOLICIT;
+	ns->nd_ns_code = 0;
+	ns->nd_ns_reserved = 0;
+	ns->nd_ns_target = *target;
+	ndp_put_lladdr((uint8_t *) (ns + 1), ND_OPT_SOURCE_LINKADDR, info->mac);
+	icmp6_finish(m);
+
+	tx_enqueue_control(interface, m);
+	pkt_free(m);
+}
+
+void ndp_send_advert(const struct in6_addr *target, const struct in6_addr *daddr, const uint8_t *dha,
+	int interface, bool solicited)
+{
+	struct interface_info *info = get_interface_info(interface);
+
+	packet *m = pkt_alloc(pkt_pool);
+	if (!m) {
+		stats->drops[STATS_DROP_NO_BUFFER]++;
+		return;
+	}
+
+	build_icmp6_headers(m, interface, dha, target, daddr, NDP_HOP_LIMIT, sizeof(struct nd_neighbor_advert) + 8);
+
+	struct nd_neighbor_advert *na = (struct nd_neighbor_advert *) (m->payload + sizeof(struct ether_header) + sizeof(struct ip6_hdr));
+	na->nd_na_type = ND_NEIGHBOR_ADVERT;
+	na->nd_na_code = 0;
+	na->nd_na_flags_reserved = ND_NA_FLAG_ROUTER | ND_NA_FLAG_OVERRIDE | (solicited ? ND_NA_FLAG_SOLICITED : 0);
+	na->nd_na_target = *target;
+	ndp_put_lladdr((uint8_t *) (na + 1), ND_OPT_TARGET_LINKADDR, info->mac);
+	icmp6_finish(m);
+
+	tx_enqueue_control(interface, m);
+	pkt_free(m);
+}
+
+bool ndp_find_lladdr(const uint8_t *options, int len, uint8_t type, uint8_t *mac)
+{
+	while (len >= 2) {
+		int option_len = options[1] * 8;
+
+		// A zero length would loop forever: the whole message is invalid
+		if (!option_len || option_len > len) {
+			return false;
+		}
+		if (options[0] == type && option_len >= 2 + ETH_ALEN) {
+			memcpy(mac, options + 2, ETH_ALEN);
+			return true;
+		}
+
+		options += option_len;
+		len -= option_len;
+	}
+
+	return false;
+}
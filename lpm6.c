@@ -0,0 +1,124 @@
+#include "lpm6.h"
+
+/* Makes room for the nodes one insertion may create: one per level */
+static void lpm6_reserve(struct lpm6 *lpm)
+{
+	uint32_t needed = lpm->node_count + (128 - LPM6_ROOT_BITS) / LPM6_STRIDE;
+
+	if (needed <= lpm->node_capacity) {
+		return;
+	}
+
+	while (lpm->node_capacity < needed) {
+		lpm->node_capacity = lpm->node_capacity ? 2 * lpm->node_capacity : 64;
+	}
+	DIE(lpm->node_capacity >= LPM6_CHILD / LPM6_NODE_SIZE, "lpm6 - too many nodes");
+	lpm->nodes = realloc(lpm->nodes, (size_t) lpm->node_capacity * LPM6_NODE_SIZE * sizeof(uint32_t));
+	DIE(!lpm->nodes, "lpm6 - realloc");
+}
+
+/* New node whose slots all hold value (what its parent slot held) */
+static uint32_t lpm6_node_create(struct lpm6 *lpm, uint32_t value)
+{
+	uint32_t *slots = &lpm->nodes[(size_t) lpm->node_count * LPM6_NODE_SIZE];
+
+	for (int i = 0; i < LPM6_NODE_SIZE; ++i) {
+		slots[i] = value;
+	}
+
+	return lpm->node_count++;
+}
+
+/* Inserts route value; every route inserted before is as short or shorter */
+static void lpm6_insert(struct lpm6 *lpm, const struct route6_table_entry *route, uint32_t value)
+{
+	const uint8_t *addr = route->prefix.s6_addr;
+	int len = route->prefix_len;
+
+	if (len <= LPM6_ROOT_BITS) {
+		uint32_t first = (addr[0] << 8 | addr[1]) & ~((1u << (LPM6_ROOT_BITS - len)) - 1);
+
+		for (uint32_t i = 0; i < 1u << (LPM6_ROOT_BITS - len); ++i) {
+			lpm->root[first + i] = value;
+		}
+		return;
+	}
+
+	// No realloc below: slot pointers into the nodes stay valid
+	lpm6_reserve(lpm);
+
+	// Walk (creating nodes) down to the level holding the last bits of the prefix
+	uint32_t *slot = &lpm->root[addr[0] << 8 | addr[1]];
+	for (int byte = 2;; ++byte) {
+		if (!(*slot & LPM6_CHILD)) {
+			*slot = LPM6_CHILD | lpm6_node_create(lpm, *slot);
+		}
+
+		uint32_t *node = &lpm->nodes[(size_t) (*slot & ~LPM6_CHILD) * LPM6_NODE_SIZE];
+		len -= byte == 2 ? LPM6_ROOT_BITS : LPM6_STRIDE;
+
+		if (len <= LPM6_STRIDE) {
+			// Routes as short never have children: only routes are overwritten
+			uint32_t first = addr[byte] & ~((1u << (LPM6_STRIDE - len)) - 1);
+
+			for (uint32_t i = 0; i < 1u << (LPM6_STRIDE - len); ++i) {
+				node[first + i] = value;
+			}
+			return;
+		}
+
+		slot = &node[addr[byte]];
+	}
+}
+
+struct lpm6 *lpm6_create(struct route6_table_entry *routes, int size)
+{
+	struct lpm6 *lpm = calloc(1, sizeof(struct lpm6));
+	DIE(!lpm, "lpm6 - calloc");
+
+	lpm->root = calloc(1 << LPM6_ROOT_BITS, sizeof(uint32_t));
+	DIE(!lpm->root, "lpm6 - calloc root");
+
+	// Shorter prefixes first, file order among equal lengths (counting sort)
+	int counts[129 + 1] = { 0 };
+	struct route6_table_entry *sorted = malloc((size + 1) * sizeof(struct route6_table_entry));
+	DIE(!sorted, "lpm6 - malloc");
+
+	for (int i = 0; i < size; ++i) {
+		DIE(routes[i].prefix_len > 128, "lpm6 - prefix length");
+		counts[routes[i].prefix_len + 1]++;
+	}
+	for (int i = 1; i <= 129; ++i) {
+		counts[i] += counts[i - 1];
+	}
+	for (int i = 0; i < size; ++i) {
+		sorted[counts[routes[i].prefix_len]++] = routes[i];
+	}
+	free(routes);
+
+	lpm->routes = sorted;
+	lpm->size = size;
+
+	for (int i = 0; i < size; ++i) {
+		lpm6_insert(lpm, &sorted[i], i + 1);
+	}
+
+	return lpm;
+}
+
+void lpm6_free(struct lpm6 *lpm)
+{
+	if (!lpm) {
+		return;
+	}
+
+	free(lpm->root);
+	free(lpm->nodes);
+	free(lpm->routes);
+	free(lpm);
+}
+
+size_t lpm6_memory(const struct lpm6 *lpm)
+{
+	return ((1 << LPM6_ROOT_BITS) + (size_t) lpm->node_count * LPM6_NODE_SIZE) * sizeof(uint32_t);
+}
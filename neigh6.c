@@ -0,0 +1,63 @@
+#include "neigh6.h"
+
+struct neigh6_table *neigh6_create()
+{
+	struct neigh6_table *table = calloc(1, sizeof(struct neigh6_table));
+	DIE(!table, "neigh6 - calloc");
+
+	pthread_mutex_init(&table->lock, NULL);
+	return table;
+}
+
+static inline uint32_t neigh6_hash(const struct in6_addr *addr)
+{
+	uint64_t high, low;
+
+	memcpy(&high, addr->s6_addr, sizeof(high));
+	memcpy(&low, addr->s6_addr + 8, sizeof(low));
+	return ((high ^ low * 0x9e3779b97f4a7c15ull) * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+/* Slot holding addr, or the empty slot that ends its probe sequence */
+static uint32_t *neigh6_find(struct neigh6_table *table, const struct in6_addr *addr)
+{
+	for (uint32_t i = neigh6_hash(addr);; ++i) {
+		uint32_t *slot = &table->slots[i & (2 * NEIGH6_MAX - 1)];
+		uint32_t index = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+		if (!index || !memcmp(&table->addrs[index - 1], addr, sizeof(struct in6_addr))) {
+			return slot;
+		}
+	}
+}
+
+uint32_t neigh6_lookup(struct neigh6_table *table, const struct in6_addr *addr)
+{
+	uint32_t index = __atomic_load_n(neigh6_find(table, addr), __ATOMIC_ACQUIRE);
+
+	return index ? NEIGH6_KEY_BASE + index - 1 : 0;
+}
+
+uint32_t neigh6_key(struct neigh6_table *table, const struct in6_addr *addr)
+{
+	uint32_t key = neigh6_lookup(table, addr);
+
+	if (key) {
+		return key;
+	}
+
+	pthread_mutex_lock(&table->lock);
+
+	// Another writer may have added it (or filled the slot) meanwhile
+	uint32_t *slot = neigh6_find(table, addr);
+	uint32_t index = *slot;
+	if (!index && table->count < NEIGH6_MAX) {
+		table->addrs[table->count] = *addr;
+		index = ++table->count;
+		// The address is written before a reader can reach it
+		__atomic_store_n(slot, index, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&table->lock);
+	return index ? NEIGH6_KEY_BASE + index - 1 : 0;
+}
@@ -0,0 +1,120 @@
+#include "nexthop.h"
+
+/*
+	Gives every member its share of the buckets, moving as few as possible:
+	buckets of no member (NEXTHOP_NONE) and those over their member's share
+	go to the members under theirs.
+*/
+static void nexthop_group_balance(struct nexthop_group *group)
+{
+	int counts[NEXTHOP_GROUP_MAX] = {0};
+	int quotas[NEXTHOP_GROUP_MAX];
+	int share = NEXTHOP_BUCKETS / group->count;
+	int extra = NEXTHOP_BUCKETS % group->count;
+
+	for (int i = 0; i < NEXTHOP_BUCKETS; ++i) {
+		if (group->buckets[i] != NEXTHOP_NONE) {
+			counts[group->buckets[i]]++;
+		}
+	}
+
+	// The odd buckets stay with members that already hold them
+	for (int i = 0; i < group->count; ++i) {
+		quotas[i] = share;
+		if (extra && counts[i] > share) {
+			quotas[i]++;
+			extra--;
+		}
+	}
+	for (int i = 0; extra; ++i) {
+		if (quotas[i] == share) {
+			quotas[i]++;
+			extra--;
+		}
+	}
+
+	int needy = 0;
+	for (int i = 0; i < NEXTHOP_BUCKETS; ++i) {
+		int owner = group->buckets[i];
+
+		if (owner != NEXTHOP_NONE) {
+			if (counts[owner] <= quotas[owner]) {
+				continue;
+			}
+			counts[owner]--;
+		}
+
+		// Quotas add up to NEXTHOP_BUCKETS: some member is still under its own
+		while (counts[needy] >= quotas[needy]) {
+			needy++;
+		}
+		group->buckets[i] = needy;
+		counts[needy]++;
+	}
+}
+
+struct nexthop_group *nexthop_group_create(const struct nexthop *members, int count)
+{
+	DIE(count < 1 || count > NEXTHOP_GROUP_MAX, "nexthop - group size out of range");
+
+	struct nexthop_group *group = malloc(sizeof(struct nexthop_group));
+	DIE(!group, "nexthop - malloc");
+
+	memcpy(group->members, members, count * sizeof(struct nexthop));
+	group->count = count;
+	memset(group->buckets, NEXTHOP_NONE, sizeof(group->buckets));
+	nexthop_group_balance(group);
+	return group;
+}
+
+struct nexthop_group *nexthop_group_copy(const struct nexthop_group *group)
+{
+	struct nexthop_group *copy = malloc(sizeof(struct nexthop_group));
+	DIE(!copy, "nexthop - malloc");
+
+	memcpy(copy, group, sizeof(struct nexthop_group));
+	return copy;
+}
+
+struct nexthop_group *nexthop_group_add(const struct nexthop_group *group, struct nexthop member)
+{
+	if (group->count == NEXTHOP_GROUP_MAX) {
+		return NULL;
+	}
+
+	struct nexthop_group *copy = nexthop_group_copy(group);
+	copy->members[copy->count++] = member;
+	nexthop_group_balance(copy);
+	return copy;
+}
+
+struct nexthop_group *nexthop_group_remove(const struct nexthop_group *group, int index)
+{
+	struct nexthop_group *copy = nexthop_group_copy(group);
+
+	copy->count--;
+	memmove(&copy->members[index], &copy->members[index + 1], (copy->count - index) * sizeof(struct nexthop));
+
+	// Members after index moved down by one
+	for (int i = 0; i < NEXTHOP_BUCKETS; ++i) {
+		if (copy->buckets[i] == index) {
+			copy->buckets[i] = NEXTHOP_NONE;
+		} else if (copy->buckets[i] > index) {
+			copy->buckets[i]--;
+		}
+	}
+
+	nexthop_group_balance(copy);
+	return copy;
+}
+
+int nexthop_group_find(const struct nexthop_group *group, struct nexthop member)
+{
+	for (int i = 0; i < group->count; ++i) {
+		if (group->members[i].next_hop == member.next_hop && group->members[i].interface == member.interface) {
+			return i;
+		}
+	}
+
+	return -1;
+}
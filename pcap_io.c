@@ -0,0 +1,335 @@
+#include "pcap_io.h"
+#include "pktpool.h"
+#include "ipv6.h"
+
+struct pcap_io *pcap_io;
+
+/* Replay state of the calling thread */
+static __thread struct pcap_io_thread *self;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *path_join(const char *dir, const char *name, const char *suffix)
+{
+	size_t len = strlen(dir) + strlen(name) + strlen(suffix) + 2;
+	char *path = malloc(len);
+	DIE(!path, "pcap_io - malloc path");
+
+	snprintf(path, len, "%s/%s%s", dir, name, suffix);
+	return path;
+}
+
+struct pcap_io *pcap_io_open(const char *in_dir, const char *out_dir, int loops, int threads)
+{
+	DIE(!in_dir, "pcap_io - no input directory");
+	DIE(loops < 1, "pcap_io - number of loops");
+	DIE(threads < 1 || threads > PCAP_IO_MAX_THREADS, "pcap_io - number of threads");
+
+	struct pcap_io *io = calloc(1, sizeof(struct pcap_io));
+	DIE(!io, "pcap_io - calloc");
+
+	io->in_dir = strdup(in_dir);
+	io->out_dir = out_dir ? strdup(out_dir) : NULL;
+	io->loops = loops;
+	io->threads = threads;
+	return io;
+}
+
+static inline uint32_t swap32(uint32_t x, bool swapped)
+{
+	return swapped ? __builtin_bswap32(x) : x;
+}
+
+/* Appends the frames of one capture to io, with their capture timestamps */
+static void pcap_io_load(struct pcap_io *io, const char *path, int interface, size_t *data_capacity, uint32_t *frame_capacity)
+{
+	struct pcap_file_header header;
+	struct pcap_record_header record;
+
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return;
+	}
+
+	DIE(fread(&header, sizeof(header), 1, file) != 1, "pcap_io - truncated header");
+
+	bool swapped = header.magic == __builtin_bswap32(PCAP_MAGIC) || header.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	uint32_t magic = swap32(header.magic, swapped);
+	DIE(magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS, "pcap_io - not a pcap file");
+	DIE(swap32(header.linktype, swapped) != PCAP_LINKTYPE_ETHERNET, "pcap_io - not an Ethernet capture");
+
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		uint32_t len = swap32(record.incl_len, swapped);
+		uint64_t frac = swap32(record.ts_frac, swapped);
+
+		DIE(len > MAX_LEN, "pcap_io - frame longer than MAX_LEN");
+
+		if (io->frame_count == *frame_capacity) {
+			*frame_capacity = *frame_capacity ? 2 * *frame_capacity : 4096;
+			io->frames = realloc(io->frames, *frame_capacity * sizeof(struct pcap_frame));
+			DIE(!io->frames, "pcap_io - realloc frames");
+		}
+		if (io->data_size + len > *data_capacity) {
+			*data_capacity = *data_capacity ? 2 * *data_capacity : 1 << 20;
+			io->data = realloc(io->data, *data_capacity);
+			DIE(!io->data, "pcap_io - realloc data");
+		}
+
+		DIE(fread(io->data + io->data_size, 1, len, file) != len, "pcap_io - truncated frame");
+
+		io->frames[io->frame_count++] = (struct pcap_frame) {
+			.offset = io->data_size,
+			.ts_ns = swap32(record.ts_sec, swapped) * 1000000000ull + (magic == PCAP_MAGIC_NS ? frac : frac * 1000),
+			.len = len,
+			.interface = interface,
+		};
+		io->data_size += len;
+		io->rx[interface]++;
+	}
+
+	fclose(file);
+}
+
+static int pcap_frame_cmp(const void *a, const void *b)
+{
+	const struct pcap_frame *fa = a, *fb = b;
+
+	if (fa->ts_ns != fb->ts_ns) {
+		return fa->ts_ns < fb->ts_ns ? -1 : 1;
+	}
+	// Same timestamp: keep the file order (offsets grow with it)
+	return fa->offset < fb->offset ? -1 : fa->offset > fb->offset;
+}
+
+/* Thread replaying frame: flows stay on one thread, as with PACKET_FANOUT_HASH */
+static int pcap_frame_thread(struct pcap_io *io, const struct pcap_frame *frame)
+{
+	const uint8_t *data = io->data + frame->offset;
+	const struct ether_header *eth_hdr = (const struct ether_header *) data;
+	uint32_t a = 0, b = 0;
+
+	if (io->threads == 1 || frame->len < sizeof(struct ether_header)) {
+		return 0;
+	}
+
+	if (ntohs(eth_hdr->ether_type) == ETHERTYPE_IP && frame->len >= sizeof(struct ether_header) + sizeof(struct iphdr)) {
+		const struct iphdr *ip_hdr = (const struct iphdr *) (data + sizeof(struct ether_header));
+
+		a = ip_hdr->saddr;
+		b = ip_hdr->daddr;
+	} else if (ntohs(eth_hdr->ether_type) == ETHERTYPE_ARP && frame->len >= sizeof(struct ether_header) + sizeof(struct arp_header)) {
+		const struct arp_header *arp_hdr = (const struct arp_header *) (data + sizeof(struct ether_header));
+
+		a = arp_hdr->spa;
+		b = arp_hdr->tpa;
+	}
+
+	// Symmetric: both directions of a flow land on the same thread
+	return (uint32_t) ((uint64_t) ((a ^ b) * 0x9e3779b1u) * io->threads >> 32);
+}
+
+struct interface_info *pcap_io_attach(struct pcap_io *io, int argc, char *argv[])
+{
+	struct interface_info *info = calloc(MAX_INTERFACES, sizeof(struct interface_info));
+	DIE(!info, "pcap_io - calloc interface_info");
+	size_t data_capacity = 0;
+	uint32_t frame_capacity = 0;
+
+	for (int i = 0; i < argc; ++i) {
+		uint8_t mac[ETH_ALEN] = { PCAP_IO_MAC_PREFIX, i + 1 };
+		char *addr = strchr(argv[i], '=');
+		char *addr6 = addr ? strchr(addr, ',') : NULL;
+		char ip[INET_ADDRSTRLEN] = "";
+		struct in_addr in = { 0 };
+
+		// "name=address" or "name=address,ipv6_address"
+		if (addr) {
+			snprintf(ip, sizeof(ip), "%.*s", addr6 ? (int) (addr6 - addr - 1) : (int) strlen(addr + 1), addr + 1);
+		}
+		DIE(addr && inet_pton(AF_INET, ip, &in) != 1, "pcap_io - interface address");
+		DIE(addr6 && inet_pton(AF_INET6, addr6 + 1, &info[i].ip6) != 1, "pcap_io - interface IPv6 address");
+
+		info[i].ip = in.s_addr;
+		memcpy(info[i].mac, mac, ETH_ALEN);
+		ipv6_link_local(mac, &info[i].ip6_ll);
+		info[i].mtu = PCAP_IO_MTU;
+		info[i].ifindex = i + 1;
+
+		char *path = path_join(io->in_dir, interface_names[i], ".pcap");
+		pcap_io_load(io, path, i, &data_capacity, &frame_capacity);
+		free(path);
+
+		if (io->out_dir) {
+			struct pcap_file_header header = {
+				.magic = PCAP_MAGIC,
+				.version_major = 2,
+				.version_minor = 4,
+				.snaplen = MAX_LEN,
+				.linktype = PCAP_LINKTYPE_ETHERNET,
+			};
+
+			path = path_join(io->out_dir, interface_names[i], ".out.pcap");
+			io->out[i] = fopen(path, "wb");
+			DIE(!io->out[i], "pcap_io - fopen output");
+			DIE(fwrite(&header, sizeof(header), 1, io->out[i]) != 1, "pcap_io - fwrite");
+			free(path);
+		}
+	}
+
+	// One timeline: what every interface received, in capture order
+	qsort(io->frames, io->frame_count, sizeof(struct pcap_frame), pcap_frame_cmp);
+	printf("Replaying %u frames x %d from %s\n", io->frame_count, io->loops, io->in_dir);
+
+	return info;
+}
+
+void pcap_io_thread_init(struct pcap_io *io)
+{
+	int id = __atomic_fetch_add(&io->registered, 1, __ATOMIC_RELAXED);
+	DIE(id >= io->threads, "pcap_io - more threads than announced");
+
+	self = aligned_alloc(64, sizeof(struct pcap_io_thread));
+	DIE(!self, "pcap_io - aligned_alloc");
+	memset(self, 0, sizeof(struct pcap_io_thread));
+
+	self->frames = malloc((io->frame_count + 1) * sizeof(uint32_t));
+	DIE(!self->frames, "pcap_io - malloc frames");
+	for (uint32_t i = 0; i < io->frame_count; ++i) {
+		if (pcap_frame_thread(io, &io->frames[i]) == id) {
+			self->frames[self->count++] = i;
+		}
+	}
+
+	io->thread_state[id] = self;
+}
+
+int pcap_io_rx(struct pcap_io *io, packet **m, int max)
+{
+	uint64_t now = now_ns();
+
+	// Back for more: the previous burst went through the router and out
+	if (self->burst) {
+		self->latency[histogram_bucket(now - self->burst_start, PCAP_IO_HIST_SUB_BITS)] += self->burst;
+		self->burst = 0;
+	} else if (!self->start) {
+		self->start = now;
+	}
+
+	int count = 0;
+	while (count < max) {
+		if (self->next == self->count) {
+			if (self->loop + 1 >= io->loops) {
+				break;
+			}
+			self->loop++;
+			self->next = 0;
+			// Empty share: nothing to loop over
+			if (!self->count) {
+				break;
+			}
+		}
+
+		// Every buffer is held: the rest waits for the next burst, as
+		// frames would in the socket buffer
+		packet *buf = pkt_alloc(pkt_pool);
+		if (!buf) {
+			break;
+		}
+
+		const struct pcap_frame *frame = &io->frames[self->frames[self->next++]];
+		memcpy(buf->payload, io->data + frame->offset, frame->len);
+		buf->len = frame->len;
+		buf->interface = frame->interface;
+		m[count++] = buf;
+	}
+
+	if (!count && self->next == self->count && self->loop + 1 >= io->loops) {
+		if (!self->end) {
+			self->end = now;
+		}
+		return -1;
+	}
+
+	self->rx += count;
+	self->burst = count;
+	self->burst_start = now_ns();
+	return count;
+}
+
+void pcap_io_tx(struct pcap_io *io, int interface, packet **m, int count)
+{
+	char record[sizeof(struct pcap_record_header) + MAX_LEN];
+
+	for (int i = 0; i < count; ++i) {
+		self->tx[interface]++;
+		self->tx_bytes[interface] += m[i]->len;
+
+		if (!io->out[interface]) {
+			continue;
+		}
+
+		uint64_t now = now_ns();
+		struct pcap_record_header header = {
+			.ts_sec = now / 1000000000,
+			.ts_frac = now % 1000000000 / 1000,
+			.incl_len = m[i]->len,
+			.orig_len = m[i]->len,
+		};
+
+		// One fwrite per record: records of different threads do not interleave
+		memcpy(record, &header, sizeof(header));
+		memcpy(record + sizeof(header), m[i]->payload, m[i]->len);
+		DIE(fwrite(record, sizeof(header) + m[i]->len, 1, io->out[interface]) != 1, "pcap_io - fwrite");
+	}
+}
+
+void pcap_io_report(struct pcap_io *io)
+{
+	uint64_t latency[PCAP_IO_HIST_BUCKETS] = { 0 };
+	uint64_t tx[MAX_INTERFACES] = { 0 }, tx_bytes[MAX_INTERFACES] = { 0 };
+	uint64_t rx = 0;
+	uint64_t start = UINT64_MAX, end = 0;
+
+	for (int t = 0; t < io->registered; ++t) {
+		struct pcap_io_thread *state = io->thread_state[t];
+
+		rx += state->rx;
+		if (state->start && state->start < start) {
+			start = state->start;
+		}
+		if (state->end > end) {
+			end = state->end;
+		}
+		for (int i = 0; i < PCAP_IO_HIST_BUCKETS; ++i) {
+			latency[i] += state->latency[i];
+		}
+		for (int i = 0; i < num_interfaces; ++i) {
+			tx[i] += state->tx[i];
+			tx_bytes[i] += state->tx_bytes[i];
+		}
+	}
+
+	double seconds = end > start ? (end - start) / 1e9 : 0;
+	printf("Replayed %lu frames on %d threads in %.3f s: %.2f Mpps, %.1f ns/packet\n",
+		rx, io->registered, seconds, seconds ? rx / seconds / 1e6 : 0.0,
+		rx ? seconds * 1e9 / rx : 0.0);
+	printf("Latency (ns, RX burst to TX flush): p50 %lu p90 %lu p99 %lu p99.9 %lu\n",
+		histogram_percentile(latency, PCAP_IO_HIST_SUB_BITS, 0.5), histogram_percentile(latency, PCAP_IO_HIST_SUB_BITS, 0.9),
+		histogram_percentile(latency, PCAP_IO_HIST_SUB_BITS, 0.99), histogram_percentile(latency, PCAP_IO_HIST_SUB_BITS, 0.999));
+
+	for (int i = 0; i < num_interfaces; ++i) {
+		printf("%s: rx %lu frames, tx %lu frames / %lu bytes\n", interface_names[i],
+			io->rx[i] * io->loops, tx[i], tx_bytes[i]);
+
+		if (io->out[i]) {
+			DIE(fclose(io->out[i]), "pcap_io - fclose");
+			io->out[i] = NULL;
+		}
+	}
+}
@@ -0,0 +1,34 @@
+#include "pktpool.h"
+
+__thread struct pkt_pool *pkt_pool;
+
+struct pkt_pool *pkt_pool_create(uint32_t size)
+{
+	struct pkt_pool *pool = calloc(1, sizeof(struct pkt_pool));
+	DIE(!pool, "pkt_pool - calloc");
+
+	pool->bufs = aligned_alloc(64, size * sizeof(struct pkt_buf));
+	DIE(!pool->bufs, "pkt_pool - aligned_alloc");
+
+	// Chain every buffer on the free stack
+	for (uint32_t i = 0; i < size; ++i) {
+		pool->bufs[i].pool = pool;
+		pool->bufs[i].refcnt = 0;
+		pool->bufs[i].next_free = i + 1;
+	}
+
+	pool->size = size;
+	pool->free_head = 0;
+	pool->available = size;
+	return pool;
+}
+
+void pkt_pool_free(struct pkt_pool *pool)
+{
+	if (!pool) {
+		return;
+	}
+
+	free(pool->bufs);
+	free(pool);
+}
@@ -0,0 +1,119 @@
+#include "rcu.h"
+
+/* Objects retired by a thread, freed once every reader reached their epoch */
+struct rcu_deferred {
+	rcu_free_fn fn;
+	void *ptr;
+	uint64_t epoch;
+	struct rcu_deferred *next;
+};
+
+static struct rcu_thread rcu_threads[RCU_MAX_THREADS];
+static int rcu_nthreads;
+static uint64_t rcu_global_epoch = 1;
+
+static __thread int rcu_id = -1;
+static __thread struct rcu_deferred *rcu_pending;
+
+void rcu_register_thread()
+{
+	rcu_id = __atomic_fetch_add(&rcu_nthreads, 1, __ATOMIC_SEQ_CST);
+	DIE(rcu_id >= RCU_MAX_THREADS, "too many RCU threads");
+
+	rcu_thread_online();
+}
+
+/* Starts a new grace period, returns the epoch readers must reach */
+static uint64_t rcu_grace_start()
+{
+	return __atomic_add_fetch(&rcu_global_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Oldest epoch an online reader may still be in */
+static uint64_t rcu_oldest_epoch()
+{
+	int nthreads = __atomic_load_n(&rcu_nthreads, __ATOMIC_ACQUIRE);
+	uint64_t oldest = UINT64_MAX;
+
+	for (int i = 0; i < nthreads; ++i) {
+		uint64_t seen = __atomic_load_n(&rcu_threads[i].epoch, __ATOMIC_ACQUIRE);
+
+		if (seen && seen < oldest) {
+			oldest = seen;
+		}
+	}
+
+	return oldest;
+}
+
+static bool rcu_grace_done(uint64_t epoch)
+{
+	return rcu_oldest_epoch() >= epoch;
+}
+
+static void rcu_reclaim()
+{
+	struct rcu_deferred **it = &rcu_pending;
+	uint64_t oldest = rcu_oldest_epoch();
+
+	while (*it) {
+		struct rcu_deferred *item = *it;
+
+		if (item->epoch > oldest) {
+			it = &item->next;
+			continue;
+		}
+
+		*it = item->next;
+		item->fn(item->ptr);
+		free(item);
+	}
+}
+
+void rcu_quiescent()
+{
+	__atomic_store_n(&rcu_threads[rcu_id].epoch, __atomic_load_n(&rcu_global_epoch, __ATOMIC_SEQ_CST),
+		__ATOMIC_SEQ_CST);
+
+	if (rcu_pending) {
+		rcu_reclaim();
+	}
+}
+
+void rcu_thread_offline()
+{
+	__atomic_store_n(&rcu_threads[rcu_id].epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+void rcu_thread_online()
+{
+	__atomic_store_n(&rcu_threads[rcu_id].epoch, __atomic_load_n(&rcu_global_epoch, __ATOMIC_SEQ_CST),
+		__ATOMIC_SEQ_CST);
+}
+
+void rcu_defer(rcu_free_fn fn, void *ptr)
+{
+	struct rcu_deferred *item = malloc(sizeof(struct rcu_deferred));
+	DIE(!item, "rcu - malloc");
+
+	item->fn = fn;
+	item->ptr = ptr;
+	item->epoch = rcu_grace_start();
+	item->next = rcu_pending;
+	rcu_pending = item;
+
+	// Not registered (eg. a control thread): nobody calls rcu_quiescent for us
+	if (rcu_id < 0) {
+		rcu_synchronize();
+		rcu_reclaim();
+	}
+}
+
+void rcu_synchronize()
+{
+	uint64_t epoch = rcu_grace_start();
+
+	while (!rcu_grace_done(epoch)) {
+		sched_yield();
+	}
+}
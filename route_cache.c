@@ -0,0 +1,66 @@
+#include "route_cache.h"
+
+struct route_cache *route_cache_create(int sets_log2)
+{
+	struct route_cache *cache = calloc(1, sizeof(struct route_cache));
+	DIE(!cache, "route_cache - calloc");
+
+	DIE(sets_log2 < 0 || sets_log2 > 16, "route_cache - sets_log2 out of range");
+	cache->mask = (1u << sets_log2) - 1;
+	cache->sets = aligned_alloc(64, (cache->mask + 1) * sizeof(struct route_cache_set));
+	DIE(!cache->sets, "route_cache - aligned_alloc");
+	memset(cache->sets, 0, (cache->mask + 1) * sizeof(struct route_cache_set));
+
+	// Zeroed entries have generation 0 -> start at 1 so they are invalid
+	cache->generation = 1;
+	return cache;
+}
+
+void route_cache_free(struct route_cache *cache)
+{
+	if (!cache) {
+		return;
+	}
+
+	free(cache->sets);
+	free(cache);
+}
+
+void route_cache_invalidate(struct route_cache *cache)
+{
+	cache->generation++;
+
+	// On wrap-around, old entries could become valid again -> wipe them
+	if (!cache->generation) {
+		memset(cache->sets, 0, (cache->mask + 1) * sizeof(struct route_cache_set));
+		cache->generation = 1;
+	}
+}
+
+void route_cache_insert(struct route_cache *cache, uint32_t dest_ip, struct route_table_entry *route,
+	struct ether_header *eth_hdr)
+{
+	struct route_cache_set *set = route_cache_set(cache, dest_ip);
+	int victim = set->ways[0].used ? 1 : 0;
+
+	// Prefer the way already holding dest_ip, then a stale one, then the LRU one
+	for (int i = 0; i < ROUTE_CACHE_WAYS; ++i) {
+		if (set->ways[i].generation != cache->generation) {
+			victim = i;
+		}
+	}
+	for (int i = 0; i < ROUTE_CACHE_WAYS; ++i) {
+		if (set->ways[i].generation == cache->generation && set->ways[i].dest_ip == dest_ip) {
+			victim = i;
+		}
+	}
+
+	struct route_cache_entry *entry = &set->ways[victim];
+	entry->dest_ip = dest_ip;
+	entry->generation = cache->generation;
+	entry->route = route;
+	memcpy(&entry->eth_hdr, eth_hdr, sizeof(struct ether_header));
+	entry->interface = route->interface;
+	entry->used = 1;
+	set->ways[victim ^ 1].used = 0;
+}
@@ -1,208 +1,964 @@
-#include <queue.h>
 #include "skel.h"
+#include "fib.h"
+#include "route_cache.h"
+#include "arp_table.h"
+#include "arp_pending.h"
+#include "pktpool.h"
+#include "rcu.h"
+#include "rtable.h"
+#include "fib_image.h"
+#include "fib_update.h"
+#include "pcap_io.h"
+#include "stats.h"
+#include "icmp_limit.h"
+#include "classify.h"
+#include "lpm6.h"
+#include "neigh6.h"
+#include "ipv6.h"
+#include "flow_hash.h"
+
+/* ARP backlogs + RX spares + the burst in flight; init adds the TX queues of every interface */
+_Static_assert(PKT_POOL_SIZE > ARP_PENDING_MAX_NEIGHBORS * ARP_PENDING_DEPTH + 2 * MAX_BURST,
+	"packet pool smaller than what the router can hold");
+
+/* Numbers of the IPv6 neighbors, shared by every worker */
+static struct neigh6_table *neighbors6;
+
+/*
+	Broadcasts "who has next_hop" out of interface; IPv6 next hops (keys of
+	neighbors6) get a Neighbor Solicitation instead
+*/
+static void send_arp_request(uint32_t next_hop, int interface)
+{
+	if (neigh6_is_key(next_hop)) {
+		ndp_send_solicit(neigh6_addr(neighbors6, next_hop), interface);
+		stats->events[STATS_ND_SOLICIT_OUT]++;
+		return;
+	}
+
+	struct ether_header eth_hdr;
+	uint8_t broadcast[ETH_ALEN];
+
+	hwaddr_aton(BROADCAST_ADDR, broadcast);
+	memcpy(eth_hdr.ether_shost, get_interface_info(interface)->mac, ETH_ALEN);
+	memcpy(eth_hdr.ether_dhost, broadcast, ETH_ALEN);
+	eth_hdr.ether_type = htons(ETHERTYPE_ARP);
+
+	send_arp(
+		// daddr = IP of next hop
+		htonl(next_hop),
+		// saddr = my IP on the egress interface
+		get_interface_info(interface)->ip,
+		// eth_hdr
+		&eth_hdr,
+		// interface
+		interface,
+		// arp_op
+		htons(ARPOP_REQUEST));
+	stats->events[STATS_ARP_REQUEST_OUT]++;
+}
+
+/* Largest number of forwarding threads (ROUTER_WORKERS) */
+#define MAX_WORKERS 64
+_Static_assert(MAX_WORKERS + 1 <= RCU_MAX_THREADS, "no RCU thread left for the control thread");
+
+/* State shared by every worker */
+struct router_shared {
+	/* RCU-protected: read once per burst, may be replaced by a new FIB */
+	struct fib *fib;
+	/* IPv6 routes (ROUTER_RTABLE6), fixed */
+	struct lpm6 *fib6;
+	struct arp_table *arp_table;
+	bool tpacket;
+	/* Whether forwarded packets have their IP header checksum verified */
+	bool verify_checksum;
+	int num_workers;
+	/* Counters, one block per worker */
+	struct stats_segment *stats;
+	/* io_wakeup_fd() of every worker, -1 until it is up */
+	int wakeup_fds[MAX_WORKERS];
+};
+
+/* State of one worker: only ever touched by its own thread */
+struct router {
+	struct router_shared *shared;
+	/* FIB in use for the current burst */
+	struct fib *fib;
+	struct route_cache *route_cache;
+	struct arp_pending *arp_pending;
+	/* This worker's share of the ICMP rate limits */
+	struct icmp_limit *icmp_limit;
+	/* fib->version and arp_table->version the route cache was filled against */
+	uint64_t fib_version;
+	uint32_t arp_version;
+	int id;
+};
+
+/* Sends the backlog of entry to mac, then drops the queue */
+static void flush_pending(struct router *router, struct arp_pending_entry *entry, uint8_t *mac)
+{
+	for (int i = 0; i < entry->count; ++i) {
+		struct ether_header *hdr = (struct ether_header *) entry->packets[i]->payload;
+
+		memcpy(hdr->ether_shost, get_interface_info(entry->interface)->mac, ETH_ALEN);
+		memcpy(hdr->ether_dhost, mac, ETH_ALEN);
+		tx_enqueue(entry->interface, entry->packets[i]);
+	}
+
+	arp_pending_remove(router->arp_pending, entry);
+}
+
+/* Interrupts the other workers, so they look at the ARP table again */
+static void wake_workers(struct router *router)
+{
+	for (int i = 0; i < router->shared->num_workers; ++i) {
+		int fd = __atomic_load_n(&router->shared->wakeup_fds[i], __ATOMIC_ACQUIRE);
+
+		if (i != router->id && fd >= 0) {
+			io_wakeup(fd);
+		}
+	}
+}
+
+/*
+	The ARP reply for a next hop reaches a single worker (the one its flow
+	hashes to): every worker checks the shared table for the next hops it is
+	waiting on.
+*/
+static void flush_resolved(struct router *router)
+{
+	struct arp_entry entry;
+
+	for (int i = 0; i < router->arp_pending->size; ++i) {
+		struct arp_pending_entry *waiting = &router->arp_pending->entries[i];
+
+		if (arp_table_lookup(router->shared->arp_table, waiting->next_hop, &entry)) {
+			flush_pending(router, waiting, entry.mac);
+			// The last entry was moved into i
+			i--;
+		}
+	}
+}
+
+/* A neighbor (IPv4 address, or IPv6 key) answered: learn it, send what waits for it */
+static void neighbor_resolved(struct router *router, uint32_t ip, uint8_t *mac, uint64_t now)
+{
+	// Learn (or refresh) the sender's IP:MAC
+	// Cached Ethernet headers are stale only if the MAC moved
+	enum arp_update update = arp_table_update(router->shared->arp_table, ip, mac, now);
+	if (update == ARP_CHANGED) {
+		route_cache_invalidate(router->route_cache);
+	}
+
+	// Other workers may have packets waiting for this neighbor
+	if (update != ARP_FULL) {
+		wake_workers(router);
+	}
+
+	// Flush the whole backlog waiting for this neighbor
+	struct arp_pending_entry *waiting = arp_pending_find(router->arp_pending, ip);
+	if (waiting) {
+		flush_pending(router, waiting, mac);
+	}
+}
+
+/* Holds m until next_hop is resolved; only the first packet triggers a request */
+static void hold_packet(struct router *router, uint32_t next_hop, int interface, packet *m, uint64_t now)
+{
+	enum arp_pending_status status = arp_pending_enqueue(router->arp_pending, next_hop, interface, m, now);
+
+	if (status == ARP_PENDING_RESOLVE) {
+		send_arp_request(next_hop, interface);
+	} else if (status == ARP_PENDING_DROPPED) {
+		stats->drops[STATS_DROP_ARP_QUEUE]++;
+	}
+}
+
+static void handle_arp(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct arp_header *arp_hdr = (struct arp_header *) (m->payload + desc->l3_offset);
+
+	// Get machine data (cached, no syscall)
+	struct interface_info *machine = get_interface_info(m->interface);
+
+	// ARP request -> send an ARP reply
+	if (ntohs(arp_hdr->op) == ARPOP_REQUEST) {
+		stats->events[STATS_ARP_REQUEST_IN]++;
+
+		/*
+			Update Ethernet addresses:
+				* Destination eth addr = hardware address of sender
+				* Source eth addr = hardware address of target (me)
+		*/
+		memcpy(eth_hdr->ether_dhost, arp_hdr->sha, ETH_ALEN);
+		memcpy(eth_hdr->ether_shost, machine->mac, ETH_ALEN);
+
+		send_arp(
+			// daddr = IP of host who requested
+			arp_hdr->spa,
+			// saddr = my IP
+			machine->ip,
+			// eth_hdr
+			eth_hdr,
+			// interface
+			m->interface,
+			// arp_op
+			htons(ARPOP_REPLY)
+		);
+		stats->events[STATS_ARP_REPLY_OUT]++;
+		return;
+	}
+
+	// ARP reply
+	stats->events[STATS_ARP_REPLY_IN]++;
+
+	// 240.0.0.0/4 numbers the IPv6 neighbors: no IPv4 host may claim it
+	if (neigh6_is_key(ntohl(arp_hdr->spa))) {
+		stats->drops[STATS_DROP_MALFORMED]++;
+		return;
+	}
+
+	neighbor_resolved(router, ntohl(arp_hdr->spa), arp_hdr->sha, now);
+}
+
+/* Answers an echo request addressed to the router, drops anything else */
+static void handle_local(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now)
+{
+	struct iphdr *ip_hdr = (struct iphdr *) (m->payload + desc->l3_offset);
+	struct icmphdr *icmp_hdr = (struct icmphdr *) (m->payload + desc->l4_offset);
+
+	if (desc->l4_proto != IPPROTO_ICMP || desc->fragment
+		|| desc->l3_len < desc->l4_offset - desc->l3_offset + sizeof(struct icmphdr)
+		|| icmp_hdr->type != ICMP_ECHO) {
+		stats->drops[STATS_DROP_LOCAL]++;
+		return;
+	}
+
+	// Echo request -> reply, unless over the rate limit
+	if (!icmp_limit_allow(router->icmp_limit, ntohl(ip_hdr->saddr), now)) {
+		return;
+	}
+
+	// Turn the request around in its own buffer: the payload goes back as
+	// is, nothing is copied
+	if (!icmp_echo_reply(m)) {
+		return;
+	}
+	tx_enqueue_control(m->interface, m);
+	stats->events[STATS_ICMP_ECHO_REPLY]++;
+}
+
+/* Sends the ICMP error type / code about m back to its source */
+static void send_error(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now,
+	u_int8_t type, u_int8_t code)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct iphdr *ip_hdr = (struct iphdr *) (m->payload + desc->l3_offset);
+	struct icmphdr *icmp_hdr = (struct icmphdr *) (m->payload + desc->l4_offset);
+	uint32_t saddr = ntohl(ip_hdr->saddr);
+	uint32_t daddr = ntohl(ip_hdr->daddr);
+
+	// Never about (RFC 1812 4.3.2.7) a fragment but the first, an ICMP error,
+	// a link-layer or IP broadcast / multicast, nor to a source that is not
+	// one host (0/8, loopback, multicast, 240/4 and broadcast)
+	if ((ip_hdr->frag_off & htons(IP_OFFMASK)) || (eth_hdr->ether_dhost[0] & 1)
+		|| IN_MULTICAST(daddr) || daddr == INADDR_BROADCAST
+		|| !(saddr >> 24) || saddr >> 24 == IN_LOOPBACKNET || IN_MULTICAST(saddr) || saddr >= 0xf0000000
+		|| (desc->l4_proto == IPPROTO_ICMP && (desc->l3_len < desc->l4_offset - desc->l3_offset + sizeof(struct icmphdr)
+			|| icmp_hdr->type == ICMP_DEST_UNREACH || icmp_hdr->type == ICMP_SOURCE_QUENCH
+			|| icmp_hdr->type == ICMP_REDIRECT || icmp_hdr->type == ICMP_TIME_EXCEEDED
+			|| icmp_hdr->type == ICMP_PARAMETERPROB))) {
+		return;
+	}
+
+	// A traceroute flood or a routing loop must not starve forwarding
+	if (!icmp_limit_allow(router->icmp_limit, saddr, now)) {
+		return;
+	}
+
+	send_icmp_error(
+		// daddr
+		ip_hdr->saddr,
+		// saddr
+		get_interface_info(m->interface)->ip,
+		// sha
+		eth_hdr->ether_dhost,
+		// dha
+		eth_hdr->ether_shost,
+		// type
+		type,
+		// code
+		code,
+		// interface
+		m->interface
+	);
+	stats->events[STATS_ICMP_ERROR]++;
+}
+
+/*
+ * Any IPv4 protocol: everything read from the headers comes from desc.
+ * route points to the best route towards the destination if the burst
+ * lookup resolved it, NULL if it is left to this packet.
+ */
+static void handle_ipv4(struct router *router, packet *m, const struct pkt_desc *desc,
+	struct route_table_entry **route, uint64_t now, bool sampled, uint64_t t)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct iphdr *ip_hdr = (struct iphdr *) (m->payload + desc->l3_offset);
+
+	// If packet is destined for me
+	if (ip_hdr->daddr == get_interface_info(m->interface)->ip) {
+		handle_local(router, m, desc, now);
+		return;
+	}
+
+	// 240.0.0.0/4 is reserved, and keys the IPv6 neighbors: as a next hop,
+	// it would resolve to one of them
+	if (neigh6_is_key(ntohl(ip_hdr->daddr))) {
+		stats->drops[STATS_DROP_RESERVED]++;
+		return;
+	}
+
+	if (ip_hdr->ttl <= 1) {
+		stats->drops[STATS_DROP_TTL]++;
+		send_error(router, m, desc, now, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL);
+		return;
+	}
+
+	// Failed checksum -> continue (skipped when the NIC already checks it)
+	if (router->shared->verify_checksum && ip_fast_csum(ip_hdr, ip_hdr->ihl)) {
+		stats->drops[STATS_DROP_CHECKSUM]++;
+		return;
+	}
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_PARSE, t);
+	}
+
+	// rtable is kept in host byte order
+	uint32_t dest_ip = ntohl(ip_hdr->daddr);
+
+	// Hot destination -> route and Ethernet header in one cache line
+	struct route_cache_entry *cached = route_cache_lookup(router->route_cache, dest_ip);
+	if (cached) {
+		stats->events[STATS_ROUTE_CACHE_HIT]++;
+		if (sampled) {
+			t = stats_stage(STATS_STAGE_LOOKUP, t);
+		}
+
+		// Update TTL, patch the checksum incrementally
+		ip_decrease_ttl(ip_hdr);
+		memcpy(eth_hdr, &cached->eth_hdr, sizeof(struct ether_header));
+		if (sampled) {
+			t = stats_stage(STATS_STAGE_REWRITE, t);
+		}
+
+		tx_enqueue(cached->interface, m);
+		if (sampled) {
+			stats_stage(STATS_STAGE_TX, t);
+		}
+		return;
+	}
+	stats->events[STATS_ROUTE_CACHE_MISS]++;
+
+	// Found by the burst lookup, unless its cache entry was evicted since
+	struct route_table_entry *best_route = route ? *route : fib_lookup(router->fib, dest_ip);
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_LOOKUP, t);
+	}
+
+	// No route available found --> destination unreachable
+	if (!best_route) {
+		stats->drops[STATS_DROP_NO_ROUTE]++;
+		send_error(router, m, desc, now, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
+		return;
+	}
+
+	// Equal-cost paths: the flow picks one, so its packets stay in order
+	uint32_t next_hop = best_route->next_hop;
+	int interface = best_route->interface;
+	if (best_route->group) {
+		const struct nexthop *path = nexthop_select(best_route->group, flow_hash_ipv4(m, desc));
+
+		next_hop = path->next_hop;
+		interface = path->interface;
+	}
+
+	// Find matching ARP entry for the next hop (or the destination itself
+	// on directly connected routes)
+	if (!next_hop) {
+		next_hop = dest_ip;
+	}
+	struct arp_entry entry;
+	bool resolved = arp_table_lookup(router->shared->arp_table, next_hop, &entry);
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_NEIGHBOR, t);
+	}
+
+	// Update TTL, patch the checksum incrementally
+	ip_decrease_ttl(ip_hdr);
+
+	// No ARP entry found
+	if (!resolved) {
+		hold_packet(router, next_hop, interface, m, now);
+		return;
+	}
+
+	// Update Ethernet addresses
+	memcpy(eth_hdr->ether_shost, get_interface_info(interface)->mac, ETH_ALEN);
+	memcpy(eth_hdr->ether_dhost, entry.mac, sizeof(entry.mac));
+	// The cache is per destination, multipath routes are per flow
+	if (!best_route->group) {
+		route_cache_insert(router->route_cache, dest_ip, best_route, eth_hdr);
+	}
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_REWRITE, t);
+	}
+
+	// Forward the packet to the egress interface
+	tx_enqueue(interface, m);
+	if (sampled) {
+		stats_stage(STATS_STAGE_TX, t);
+	}
+}
+
+/* Sends the ICMPv6 error type / code about m back to its source */
+static void send_error6(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now,
+	uint8_t type, uint8_t code)
+{
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + desc->l3_offset);
+	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (m->payload + desc->l4_offset);
+
+	// Never about an ICMPv6 error (RFC 4443 2.4), nor to an unspecified source
+	if (IN6_IS_ADDR_UNSPECIFIED(&ip6_hdr->ip6_src) || IN6_IS_ADDR_MULTICAST(&ip6_hdr->ip6_src)
+		|| (desc->l4_proto == IPPROTO_ICMPV6 && (desc->l3_len < sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr)
+			|| !(icmp6_hdr->icmp6_type & ICMP6_INFOMSG_MASK)))) {
+		return;
+	}
+
+	if (!icmp_limit_allow6(router->icmp_limit, &ip6_hdr->ip6_src, now)) {
+		return;
+	}
+
+	send_icmp6_error(m, desc, type, code);
+	stats->events[STATS_ICMP_ERROR]++;
+}
+
+/* Neighbor Solicitation for one of our addresses -> Neighbor Advertisement */
+static void handle_ndp_solicit(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + desc->l3_offset);
+	struct nd_neighbor_solicit *ns = (struct nd_neighbor_solicit *) (m->payload + desc->l4_offset);
+	int options_len = desc->l3_len - sizeof(struct ip6_hdr) - sizeof(struct nd_neighbor_solicit);
+	uint8_t mac[ETH_ALEN];
+
+	stats->events[STATS_ND_SOLICIT_IN]++;
+
+	// Address resolution for another host of the link
+	if (!ipv6_is_mine(get_interface_info(m->interface), &ns->nd_ns_target)) {
+		return;
+	}
+
+	// Duplicate address detection: the answer goes to every node
+	if (IN6_IS_ADDR_UNSPECIFIED(&ip6_hdr->ip6_src)) {
+		struct in6_addr all_nodes = { .s6_addr = { 0xff, 0x02, [15] = 0x01 } };
+		uint8_t all_nodes_mac[ETH_ALEN] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 };
+
+		ndp_send_advert(&ns->nd_ns_target, &all_nodes, all_nodes_mac, m->interface, false);
+		stats->events[STATS_ND_ADVERT_OUT]++;
+		return;
+	}
+
+	bool has_lladdr = ndp_find_lladdr((uint8_t *) (ns + 1), options_len, ND_OPT_SOURCE_LINKADDR, mac);
+	if (!has_lladdr) {
+		memcpy(mac, eth_hdr->ether_shost, ETH_ALEN);
+	}
+
+	// Refresh the solicitor if it is already a neighbor of ours; unknown
+	// ones are numbered when something is routed to them
+	uint32_t key = neigh6_lookup(neighbors6, &ip6_hdr->ip6_src);
+	if (key && has_lladdr) {
+		neighbor_resolved(router, key, mac, now);
+	}
+
+	ndp_send_advert(&ns->nd_ns_target, &ip6_hdr->ip6_src, mac, m->interface, true);
+	stats->events[STATS_ND_ADVERT_OUT]++;
+}
+
+/* Neighbor Advertisement -> learn the target, send what waits for it */
+static void handle_ndp_advert(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now)
+{
+	struct nd_neighbor_advert *na = (struct nd_neighbor_advert *) (m->payload + desc->l4_offset);
+	int options_len = desc->l3_len - sizeof(struct ip6_hdr) - sizeof(struct nd_neighbor_advert);
+	uint8_t mac[ETH_ALEN];
+
+	stats->events[STATS_ND_ADVERT_IN]++;
+
+	// Only neighbors we solicited: unsolicited adverts cannot fill neighbors6
+	uint32_t key = neigh6_lookup(neighbors6, &na->nd_na_target);
+	if (!key || !ndp_find_lladdr((uint8_t *) (na + 1), options_len, ND_OPT_TARGET_LINKADDR, mac)) {
+		return;
+	}
+
+	neighbor_resolved(router, key, mac, now);
+}
+
+/* NDP, and echo requests addressed to the router; drops anything else */
+static void handle_local6(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now)
+{
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + desc->l3_offset);
+	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (m->payload + desc->l4_offset);
+	uint32_t icmp_len = desc->l3_len - sizeof(struct ip6_hdr);
+
+	if (desc->l4_proto != IPPROTO_ICMPV6 || icmp_len < sizeof(struct icmp6_hdr)) {
+		stats->drops[STATS_DROP_LOCAL]++;
+		return;
+	}
+
+	switch (icmp6_hdr->icmp6_type) {
+	case ICMP6_ECHO_REQUEST:
+		// To one of our addresses, not to a group
+		if (IN6_IS_ADDR_MULTICAST(&ip6_hdr->ip6_dst)) {
+			break;
+		}
+
+		if (!icmp_limit_allow6(router->icmp_limit, &ip6_hdr->ip6_src, now)) {
+			return;
+		}
+
+		// Turned around in its own buffer, like IPv4 echo requests
+		icmp6_echo_reply(m, desc);
+		tx_enqueue_control(m->interface, m);
+		stats->events[STATS_ICMP_ECHO_REPLY]++;
+		return;
+
+	case ND_NEIGHBOR_SOLICIT:
+	case ND_NEIGHBOR_ADVERT:
+		// RFC 4861 7.1.1: sent on the link itself, whole and intact
+		if (ip6_hdr->ip6_hlim != NDP_HOP_LIMIT || icmp6_hdr->icmp6_code
+			|| icmp_len < sizeof(struct nd_neighbor_solicit)
+			|| icmp6_checksum(ip6_hdr, icmp6_hdr, icmp_len)) {
+			stats->drops[STATS_DROP_MALFORMED]++;
+			return;
+		}
+
+		if (icmp6_hdr->icmp6_type == ND_NEIGHBOR_SOLICIT) {
+			handle_ndp_solicit(router, m, desc, now);
+		} else {
+			handle_ndp_advert(router, m, desc, now);
+		}
+		return;
+	}
+
+	stats->drops[STATS_DROP_LOCAL]++;
+}
+
+/* IPv6 counterpart of handle_ipv4: no header checksum, no route cache */
+static void handle_ipv6(struct router *router, packet *m, const struct pkt_desc *desc, uint64_t now,
+	bool sampled, uint64_t t)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) (m->payload + desc->l3_offset);
+
+	// Destined for me, or for a group of the link (NDP)
+	if (IN6_IS_ADDR_MULTICAST(&ip6_hdr->ip6_dst)
+		|| ipv6_is_mine(get_interface_info(m->interface), &ip6_hdr->ip6_dst)) {
+		handle_local6(router, m, desc, now);
+		return;
+	}
+
+	// Link-local addresses never leave their link
+	if (IN6_IS_ADDR_LINKLOCAL(&ip6_hdr->ip6_src) || IN6_IS_ADDR_LINKLOCAL(&ip6_hdr->ip6_dst)) {
+		stats->drops[STATS_DROP_NO_ROUTE]++;
+		return;
+	}
+
+	if (ip6_hdr->ip6_hlim <= 1) {
+		stats->drops[STATS_DROP_TTL]++;
+		send_error6(router, m, desc, now, ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT);
+		return;
+	}
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_PARSE, t);
+	}
+
+	struct route6_table_entry *best_route = lpm6_lookup(router->shared->fib6, &ip6_hdr->ip6_dst);
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_LOOKUP, t);
+	}
+
+	if (!best_route) {
+		stats->drops[STATS_DROP_NO_ROUTE]++;
+		send_error6(router, m, desc, now, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE);
+		return;
+	}
+
+	// The next hop (or the destination itself on directly connected
+	// routes), by its key in the ARP table
+	const struct in6_addr *next_hop = IN6_IS_ADDR_UNSPECIFIED(&best_route->next_hop)
+		? &ip6_hdr->ip6_dst : &best_route->next_hop;
+	uint32_t key = neigh6_key(neighbors6, next_hop);
+	if (!key) {
+		stats->drops[STATS_DROP_ARP_QUEUE]++;
+		return;
+	}
+
+	struct arp_entry entry;
+	bool resolved = arp_table_lookup(router->shared->arp_table, key, &entry);
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_NEIGHBOR, t);
+	}
+
+	// No header checksum to patch
+	ip6_hdr->ip6_hlim--;
+
+	if (!resolved) {
+		hold_packet(router, key, best_route->interface, m, now);
+		return;
+	}
+
+	memcpy(eth_hdr->ether_shost, get_interface_info(best_route->interface)->mac, ETH_ALEN);
+	memcpy(eth_hdr->ether_dhost, entry.mac, sizeof(entry.mac));
+	if (sampled) {
+		t = stats_stage(STATS_STAGE_REWRITE, t);
+	}
+
+	tx_enqueue(best_route->interface, m);
+	if (sampled) {
+		stats_stage(STATS_STAGE_TX, t);
+	}
+}
+
+/*
+ * Classifies the burst, then finds the routes of the IPv4 packets to be
+ * forwarded with one fib_lookup_bulk call, so the lookups overlap. Packets
+ * whose destination is in the route cache are left out: the cache has them.
+ * routes[i] points into found for the packets looked up, is NULL otherwise.
+ */
+static void route_burst(struct router *router, packet **burst, int count, struct pkt_desc *descs,
+	struct route_table_entry **found, struct route_table_entry ***routes)
+{
+	uint32_t daddrs[MAX_BURST];
+	int n = 0;
+
+	for (int i = 0; i < count; ++i) {
+		routes[i] = NULL;
+		if (pkt_classify(burst[i], &descs[i]) != PKT_IPV4) {
+			continue;
+		}
+
+		// Neither for the router, nor reserved, nor expired: forwarded
+		struct iphdr *ip_hdr = (struct iphdr *) (burst[i]->payload + descs[i].l3_offset);
+		if (ip_hdr->ttl <= 1 || ip_hdr->daddr == get_interface_info(burst[i]->interface)->ip) {
+			continue;
+		}
+
+		uint32_t dest_ip = ntohl(ip_hdr->daddr);
+		if (neigh6_is_key(dest_ip) || route_cache_contains(router->route_cache, dest_ip)) {
+			continue;
+		}
+
+		routes[i] = &found[n];
+		daddrs[n++] = dest_ip;
+	}
+
+	if (n) {
+		fib_lookup_bulk(router->fib, daddrs, n, found);
+	}
+}
+
+static void handle_packet(struct router *router, packet *m, const struct pkt_desc *desc,
+	struct route_table_entry **route, uint64_t now)
+{
+	// One packet in 2^STATS_SAMPLE_SHIFT has its stages timed
+	bool sampled = stats_sample();
+	uint64_t t = sampled ? stats_now() : 0;
+
+	stats->rx[m->interface]++;
+
+	// Every header was validated once by route_burst; later stages only read desc
+	switch (desc->class) {
+	case PKT_IPV4:
+		handle_ipv4(router, m, desc, route, now, sampled, t);
+		break;
+	case PKT_IPV6:
+		handle_ipv6(router, m, desc, now, sampled, t);
+		break;
+	case PKT_ARP:
+		handle_arp(router, m, desc, now);
+		break;
+	case PKT_UNSUPPORTED:
+		stats->drops[STATS_DROP_UNSUPPORTED]++;
+		break;
+	case PKT_MALFORMED:
+		stats->drops[STATS_DROP_MALFORMED]++;
+		break;
+	}
+}
+
+static void *worker_loop(void *arg)
+{
+	struct router *router = arg;
+	packet *burst[MAX_BURST];
+	struct pkt_desc descs[MAX_BURST];
+	struct route_table_entry *found[MAX_BURST];
+	struct route_table_entry **routes[MAX_BURST];
+
+	// Each worker has its own sockets, in the fanout groups of the interfaces
+	if (router->id) {
+		io_thread_init();
+		if (router->shared->tpacket) {
+			use_tpacket_rings();
+		}
+		io_join_fanout();
+	}
+
+	__atomic_store_n(&router->shared->wakeup_fds[router->id], io_wakeup_fd(), __ATOMIC_RELEASE);
+	rcu_register_thread();
+	stats_thread_init(router->shared->stats, router->id);
+
+	while (1) {
+		// Receive a burst of packets; blocked workers do not hold up RCU
+		rcu_thread_offline();
+		int count = get_packets(burst, MAX_BURST);
+		// Replay over: the worker is done, and stays offline
+		if (count < 0) {
+			break;
+		}
+		rcu_thread_online();
+		stats->bursts++;
+
+		// A new FIB has new routes: cached entries point into the old one
+		struct fib *fib = rcu_dereference(router->shared->fib);
+		if (fib != router->fib || fib->version != router->fib_version) {
+			route_cache_invalidate(router->route_cache);
+			router->fib = fib;
+			router->fib_version = fib->version;
+		}
+
+		// Another worker changed or removed a neighbor: cached headers may be stale
+		uint32_t arp_version = __atomic_load_n(&router->shared->arp_table->version, __ATOMIC_ACQUIRE);
+		if (arp_version != router->arp_version) {
+			route_cache_invalidate(router->route_cache);
+			router->arp_version = arp_version;
+		}
+
+		// Age a few ARP entries per burst; removed MACs may be cached
+		uint64_t now = now_ms();
+		if (arp_table_age(router->shared->arp_table, now)) {
+			route_cache_invalidate(router->route_cache);
+		}
+		// Send the backlogs resolved by other workers, then retransmit
+		// (with backoff) or give up on pending ARP requests
+		if (router->arp_pending->size) {
+			flush_resolved(router);
+		}
+		arp_pending_tick(router->arp_pending, now, send_arp_request);
+
+		route_burst(router, burst, count, descs, found, routes);
+		for (int i = 0; i < count; ++i) {
+			handle_packet(router, burst[i], &descs[i], routes[i], now);
+			// Queues (TX, ARP) hold their own references
+			pkt_free(burst[i]);
+		}
+
+		// Serve the TX queues filled during the burst (timed on one
+		// burst in 2^STATS_SAMPLE_SHIFT)
+		bool sampled = !(stats->bursts & ((1 << STATS_SAMPLE_SHIFT) - 1));
+		uint64_t start = sampled ? stats_now() : 0;
+		tx_burst_end();
+		if (sampled) {
+			stats_stage(STATS_STAGE_FLUSH, start);
+		}
+
+		// Done with the FIB and ARP slots read during the burst
+		rcu_quiescent();
+	}
+
+	return NULL;
+}
+
+/* Pins the calling thread to the id-th CPU the process may run on */
+static void pin_thread(int id)
+{
+	cpu_set_t allowed, set;
+
+	DIE(sched_getaffinity(0, sizeof(allowed), &allowed), "sched_getaffinity");
+	int nth = id % CPU_COUNT(&allowed);
+
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && !nth--) {
+			CPU_SET(cpu, &set);
+			break;
+		}
+	}
+
+	DIE(pthread_setaffinity_np(pthread_self(), sizeof(set), &set), "pthread_setaffinity_np");
+}
+
+static void *worker_start(void *arg)
+{
+	struct router *router = arg;
+
+	pin_thread(router->id);
+	return worker_loop(router);
+}
 
 int main(int argc, char *argv[]) {
-	packet m;
-	int rc;
+	struct router_shared shared = {0};
+	struct router workers[MAX_WORKERS];
+	pthread_t threads[MAX_WORKERS];
+
+	// Counters of a running router: router --stats <ROUTER_STATS name>
+	if (argc == 3 && !strcmp(argv[1], "--stats")) {
+		stats_print(argv[2]);
+		return 0;
+	}
+
+	// Offline step: router --compile-fib rtable.txt image.fib
+	if (argc == 4 && !strcmp(argv[1], "--compile-fib")) {
+		int rtable_size;
+		struct route_table_entry *rtable = rtable_load(argv[2], 1, &rtable_size);
+
+		rtable_sort(rtable, rtable_size);
+		fib_image_write(argv[3], rtable, rtable_size);
+		printf("FIB image: %d routes -> %s\n", rtable_size, argv[3]);
+		rtable_free(rtable, rtable_size);
+		return 0;
+	}
+
+	// ROUTER_WORKERS: forwarding threads, one per core, fed by PACKET_FANOUT
+	int num_workers = getenv("ROUTER_WORKERS") ? atoi(getenv("ROUTER_WORKERS")) : 1;
+	DIE(num_workers < 1 || num_workers > MAX_WORKERS, "number of workers");
+
+	// ROUTER_IO=pcap: offline, interfaces are "name=address[,ipv6]" and receive
+	// ROUTER_PCAP_IN/<name>.pcap, ROUTER_PCAP_LOOPS times; what is sent
+	// is counted, and recorded in ROUTER_PCAP_OUT/<name>.out.pcap if set
+	if (getenv("ROUTER_IO") && !strcmp(getenv("ROUTER_IO"), "pcap")) {
+		pcap_io = pcap_io_open(getenv("ROUTER_PCAP_IN"), getenv("ROUTER_PCAP_OUT"),
+			getenv("ROUTER_PCAP_LOOPS") ? atoi(getenv("ROUTER_PCAP_LOOPS")) : 1, num_workers);
+	}
 
 	init(argc - 2, argv + 2);
 
-	// Create ARP Request queue
-	queue arp_queue = queue_create();
-	// Declare dynamic ARP table
-	struct arp_entry *arp_table = calloc(MAX_ARP_TABLE_SIZE, sizeof(struct arp_entry));
-	int arp_table_index = 0;
+	// Burst size, TX hold time (us) and per-interface RX quota are tunable per deployment
+	burst_io_config(
+		getenv("ROUTER_BURST") ? atoi(getenv("ROUTER_BURST")) : MAX_BURST,
+		getenv("ROUTER_TX_FLUSH_US") ? atoi(getenv("ROUTER_TX_FLUSH_US")) : 0,
+		getenv("ROUTER_RX_QUOTA") ? atoi(getenv("ROUTER_RX_QUOTA")) : MAX_BURST / 4);
+
+	// ROUTER_IO=mmap: PACKET_MMAP rings instead of recvmmsg / sendmmsg
+	if (getenv("ROUTER_IO") && !strcmp(getenv("ROUTER_IO"), "mmap")) {
+		shared.tpacket = true;
+		use_tpacket_rings();
+	}
 
-	// Parse routing table
-	struct route_table_entry *rtable = calloc(MAX_RTABLE_SIZE, sizeof(struct route_table_entry));
-	int rtable_size = read_rtable(rtable, argv[1]);
+	// ROUTER_VERIFY_CSUM=0: trust the checksum validation done by the NIC
+	shared.verify_checksum = !getenv("ROUTER_VERIFY_CSUM") || atoi(getenv("ROUTER_VERIFY_CSUM"));
 
-	// Sort routing table --> prepping binary search for get_best_route
-	qsort(rtable, rtable_size, sizeof(struct route_table_entry), route_entry_cmp);
+	shared.num_workers = num_workers;
+	for (int i = 0; i < num_workers; ++i) {
+		shared.wakeup_fds[i] = -1;
+	}
 
-	// Get eth_hdr
-	struct ether_header *eth_hdr = (struct ether_header *) m.payload;
+	// ROUTER_STATS=<shm name>: counters readable by "router --stats <name>"
+	// while forwarding; kept private otherwise
+	shared.stats = stats_create(getenv("ROUTER_STATS"), num_workers);
 
-	while (1) {
-		// Receive package
-		rc = get_packet(&m);
-		DIE(rc < 0, "get_message");
-
-		// Determine type of packet
-		bool arp_packet = false;
-		struct arp_header *arp_hdr = parse_arp(m.payload);
-
-		if (arp_hdr) {
-			arp_packet = true;
-		}
-
-		// Get machine data
-		uint32_t machine_addr = inet_addr(get_interface_ip(m.interface));
-		uint8_t machine_mac;
-		memset(&machine_mac, 0, sizeof(machine_mac));
-		get_interface_mac(m.interface, &machine_mac);
-
-		// ARP Packet
-		if (arp_packet) {
-			// ARP request -> send an ARP reply
-			if (ntohs(arp_hdr->op) == ARPOP_REQUEST) {
-				//TODO: create your own new ethhdr
-				
-				/*	
-					Update Ethernet addresses:
-						* Destination eth addr = hardware address of sender
-						* Source eth addr = hardware address of target (me)
-				*/
-				memcpy(eth_hdr->ether_dhost, arp_hdr->sha, ETH_ALEN);
-				get_interface_mac(m.interface, eth_hdr->ether_shost);
-
-				send_arp(
-					// daddr = IP of host who requested
-					arp_hdr->spa,
-					// saddr = my IP
-					machine_addr,
-					// eth_hdr
-					eth_hdr,
-					// interface
-					m.interface,
-					// arp_op
-					htons(ARPOP_REPLY)
-				);
-			// ARP reply
-			} else {
-				update_arp_table(arp_table, &arp_table_index, machine_addr, machine_mac);
-
-				if (queue_empty(arp_queue)) {
-					continue;
-				} else {
-					// If queue != empty: forward the first packet in the queue
-					packet *to_send = (packet *) queue_deq(arp_queue);
-					send_packet(m.interface, to_send);
-				}
-			}
-		// ICMP Packet
-		} else {
-			struct icmphdr *icmp_hdr = parse_icmp(m.payload);
-			struct iphdr *ip_hdr = (struct iphdr *)icmp_hdr;
-
-			// If packet is destined for me
-			if (ip_hdr->daddr == machine_addr) {
-				// If ICMP_ECHO : send_icmp
-				if (ntohs(icmp_hdr->type) == ICMP_ECHO) {
-					send_icmp(
-						// daddr = IP of host who requested
-						ip_hdr->saddr,
-						// saddr
-						ip_hdr->daddr,
-						// sha
-						eth_hdr->ether_dhost,
-						// dha
-						eth_hdr->ether_shost,
-						// type
-						htons(ICMP_ECHOREPLY),
-						// code
-						htons(ICMP_ECHOREPLY),
-						// interface
-						m.interface,
-						// id
-						icmp_hdr->un.echo.id,
-						// seq
-						icmp_hdr->un.echo.sequence
-					);
-					continue;
-				// Else: drop package
-				} else {
-					continue;
-				}
-			}
-
-			if (ip_hdr->ttl <= 1) {
-				// Send TLE ICMP error
-				send_icmp_error(
-					// daddr
-					ip_hdr->saddr,
-					// saddr
-					ip_hdr->daddr,
-					// sha
-					eth_hdr->ether_dhost,
-					// dha
-					eth_hdr->ether_shost,
-					// type
-					htons(ICMP_TIME_EXCEEDED),
-					// code
-					htons(ICMP_TIME_EXCEEDED),
-					// interface
-					m.interface
-				);
-
-				// Proceed to next package
-				continue;
-			}
-
-			// Failed checksum -> continue
-			if (ip_checksum(ip_hdr, sizeof(struct iphdr))) {
-				continue;
-			}
-
-			// Update TTL and recalculate the checksum
-			ip_hdr->ttl--;
-			ip_hdr->check = 0;
-			ip_hdr->check = ip_checksum(ip_hdr, sizeof(struct iphdr));
-
-			struct route_table_entry *best_route = get_best_route(ip_hdr->daddr, rtable, rtable_size);
-
-			if (!best_route) {
-				// No route available found --> destination unreachable
-				send_icmp_error(
-					// daddr
-					ip_hdr->saddr,
-					// saddr
-					ip_hdr->daddr,
-					// sha
-					eth_hdr->ether_dhost,
-					// dha
-					eth_hdr->ether_shost,
-					// type
-					htons(ICMP_DEST_UNREACH),
-					// code
-					htons(ICMP_DEST_UNREACH),
-					// interface
-					m.interface
-				);
-
-				continue;
-			} else {
-				// Find matching ARP entry
-				struct arp_entry *entry = get_arp_entry(ip_hdr->daddr, arp_table, arp_table_index);
-				
-				// No ARP entry found
-				if (!entry) {
-					//Enqueue packet
-					queue_enq(arp_queue, &m);
-
-					// Send ARP Request in order to get MAC of target
-					send_arp(
-						//daddr = broadcast address
-						inet_addr(BROADCAST_ADDR),
-						// saddr = my IP
-						machine_addr,
-						// eth_hdr
-						eth_hdr,
-						// interface
-						m.interface,
-						// arp_op
-						htons(ARPOP_REQUEST));
-				} else {
-					// Update Ethernet addresses	
-					get_interface_mac(best_route->interface, eth_hdr->ether_shost);
-					memcpy(eth_hdr->ether_dhost, entry->mac, sizeof(entry->mac));
-				}
-
-				// Forward the packet to best_route->interface
-				send_packet(best_route->interface, &m);
-			}
+	// Declare dynamic ARP table, shared by the workers
+	shared.arp_table = arp_table_create();
+
+	// The engine is picked per deployment through ROUTER_FIB: "dir24_8"
+	// (default), "tbm" or "bsearch"
+	enum fib_engine engine = fib_engine_from_name(getenv("ROUTER_FIB"));
+	int rtable_size;
+
+	if (fib_image_probe(argv[1])) {
+		// Compiled FIB image: mapped and used in place, nothing to parse
+		shared.fib = fib_image_map(argv[1], engine);
+		rtable_size = shared.fib->rtable_size;
+	} else {
+		// Parse routing table, ROUTER_LOAD_THREADS threads (default 1) by chunk
+		struct route_table_entry *rtable = rtable_load(argv[1],
+			getenv("ROUTER_LOAD_THREADS") ? atoi(getenv("ROUTER_LOAD_THREADS")) : 1, &rtable_size);
+
+		// Sort routing table --> prepping binary search for get_best_route
+		rtable_sort(rtable, rtable_size);
+
+		// Routes repeating a prefix are equal-cost paths: one group each
+		int groups = rtable_group(rtable, rtable_size);
+		if (groups) {
+			printf("ECMP: %d multipath prefixes\n", groups);
 		}
+
+		// Build the FIB on top of the sorted rtable
+		shared.fib = fib_create(engine, rtable, rtable_size);
+		shared.fib->owns_rtable = true;
+	}
+	printf("FIB engine: %s, %zu bytes, %.1f bytes/prefix\n", fib_engine_name(shared.fib->engine),
+		fib_memory(shared.fib), rtable_size ? (double) fib_memory(shared.fib) / rtable_size : 0.0);
+
+	// ROUTER_RTABLE6=<file>: IPv6 routes, fixed for the router's lifetime;
+	// without it IPv6 is only answered locally (NDP, echo)
+	int rtable6_size = 0;
+	struct route6_table_entry *rtable6 = getenv("ROUTER_RTABLE6")
+		? rtable6_load(getenv("ROUTER_RTABLE6"), &rtable6_size) : NULL;
+	shared.fib6 = lpm6_create(rtable6, rtable6_size);
+	neighbors6 = neigh6_create();
+	printf("IPv6 FIB: %d routes, %zu bytes\n", rtable6_size, lpm6_memory(shared.fib6));
+
+	// ROUTER_CONTROL=<socket path>: accept route updates while forwarding
+	if (getenv("ROUTER_CONTROL")) {
+		fib_updater_start(&shared.fib, engine, getenv("ROUTER_CONTROL"));
+	}
+
+	// ICMP errors and echo replies: ROUTER_ICMP_RATE per second overall
+	// (bursts of ROUTER_ICMP_BURST), ROUTER_ICMP_SRC_RATE per second
+	// (bursts of ROUTER_ICMP_SRC_BURST) per ROUTER_ICMP_SRC_PREFIX source
+	// prefix; a rate of 0 lifts the limit
+	struct icmp_limit_config icmp_global = {
+		.rate = getenv("ROUTER_ICMP_RATE") ? atoi(getenv("ROUTER_ICMP_RATE")) : 1000,
+		.burst = getenv("ROUTER_ICMP_BURST") ? atoi(getenv("ROUTER_ICMP_BURST")) : 50,
+	};
+	struct icmp_limit_config icmp_source = {
+		.rate = getenv("ROUTER_ICMP_SRC_RATE") ? atoi(getenv("ROUTER_ICMP_SRC_RATE")) : 100,
+		.burst = getenv("ROUTER_ICMP_SRC_BURST") ? atoi(getenv("ROUTER_ICMP_SRC_BURST")) : 10,
+	};
+	int icmp_source_prefix = getenv("ROUTER_ICMP_SRC_PREFIX") ? atoi(getenv("ROUTER_ICMP_SRC_PREFIX")) : 24;
+
+	for (int i = 0; i < num_workers; ++i) {
+		workers[i] = (struct router) {
+			.shared = &shared,
+			// Per-destination route + next-hop cache in front of the FIB and ARP table
+			.route_cache = route_cache_create(ROUTE_CACHE_SETS_LOG2),
+			// Packets waiting for ARP resolution, one queue per next hop
+			.arp_pending = arp_pending_create(),
+			.icmp_limit = icmp_limit_create(icmp_global, icmp_source, icmp_source_prefix, num_workers),
+			.id = i,
+		};
+	}
+
+	if (num_workers > 1) {
+		io_join_fanout();
+	}
+
+	// Worker 0 is the main thread
+	for (int i = 1; i < num_workers; ++i) {
+		DIE(pthread_create(&threads[i], NULL, worker_start, &workers[i]), "pthread_create");
+	}
+
+	if (num_workers > 1) {
+		pin_thread(0);
+	}
+	worker_loop(&workers[0]);
+
+	// Only a replay comes to an end
+	for (int i = 1; i < num_workers; ++i) {
+		pthread_join(threads[i], NULL);
 	}
+	pcap_io_report(pcap_io);
 
 	return 0;
 }
@@ -0,0 +1,434 @@
+#include "rtable.h"
+#include "neigh6.h"
+
+/* Lines [start, end) of the file, parsed by one thread */
+struct rtable_chunk {
+	const char *start;
+	const char *end;
+	struct route_table_entry *routes;
+	int size;
+	int capacity;
+	/* Stopped on a line that does not parse */
+	bool malformed;
+	pthread_t thread;
+};
+
+static inline const char *skip_blanks(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+
+	return p;
+}
+
+/* Parses the dotted quad at *p into addr (host byte order), moving *p past it */
+static inline bool parse_ipv4(const char **p, const char *end, uint32_t *addr)
+{
+	const char *s = *p;
+	uint32_t result = 0;
+
+	for (int octet = 0; octet < 4; ++octet) {
+		uint32_t value = 0;
+		const char *first = s;
+
+		// At most 3 digits: one more means a malformed octet
+		while (s < end && s - first < 4 && (unsigned) (*s - '0') < 10) {
+			value = value * 10 + (*s - '0');
+			s++;
+		}
+
+		if (s == first || s - first > 3 || value > 255) {
+			return false;
+		}
+		result = result << 8 | value;
+
+		if (octet < 3) {
+			if (s == end || *s != '.') {
+				return false;
+			}
+			s++;
+		}
+	}
+
+	*p = s;
+	*addr = result;
+	return true;
+}
+
+static inline bool parse_int(const char **p, const char *end, int *out)
+{
+	const char *s = *p;
+	int value = 0;
+
+	while (s < end && (unsigned) (*s - '0') < 10) {
+		// Too long for an int: malformed, not wrapped around
+		if (value > (INT_MAX - (*s - '0')) / 10) {
+			return false;
+		}
+		value = value * 10 + (*s - '0');
+		s++;
+	}
+
+	if (s == *p) {
+		return false;
+	}
+
+	*p = s;
+	*out = value;
+	return true;
+}
+
+const char *rtable_route_error(const struct route_table_entry *route)
+{
+	if (!rtable_mask_valid(route->mask)) {
+		return "bad mask";
+	}
+	if (route->interface < 0 || (num_interfaces && route->interface >= num_interfaces)) {
+		return "bad interface";
+	}
+	// Reserved, and where the IPv6 neighbors are keyed in the ARP table
+	if (neigh6_is_key(route->next_hop)) {
+		return "bad next hop";
+	}
+
+	return NULL;
+}
+
+bool rtable_parse_route(const char **line, const char *end, struct route_table_entry *route, const char **error)
+{
+	*error = NULL;
+
+	const char *p = skip_blanks(*line, end);
+	uint32_t prefix, next_hop, mask;
+	int interface;
+
+	if (!parse_ipv4(&p, end, &prefix)) {
+		return false;
+	}
+	p = skip_blanks(p, end);
+	if (!parse_ipv4(&p, end, &next_hop)) {
+		return false;
+	}
+	p = skip_blanks(p, end);
+	if (!parse_ipv4(&p, end, &mask)) {
+		return false;
+	}
+	p = skip_blanks(p, end);
+	if (!parse_int(&p, end, &interface)) {
+		return false;
+	}
+
+	// Trailing blanks, CRLF
+	p = skip_blanks(p, end);
+	if (p < end && *p == '\r') {
+		p++;
+	}
+	if (p < end && *p != '\n') {
+		return false;
+	}
+
+	// Host bits cleared: the routes of a prefix sort (and group) together
+	*route = (struct route_table_entry) {
+		.prefix = prefix & mask,
+		.next_hop = next_hop,
+		.mask = mask,
+		.interface = interface,
+	};
+	*error = rtable_route_error(route);
+	if (*error) {
+		return false;
+	}
+
+	*line = p < end ? p + 1 : end;
+	return true;
+}
+
+static void *rtable_parse_chunk(void *arg)
+{
+	struct rtable_chunk *chunk = arg;
+	const char *p = chunk->start;
+	const char *end = chunk->end;
+
+	while (p < end) {
+		p = skip_blanks(p, end);
+
+		// Empty line
+		if (p == end || *p == '\n' || *p == '\r') {
+			p++;
+			continue;
+		}
+
+		if (chunk->size == chunk->capacity) {
+			chunk->capacity = chunk->capacity ? 2 * chunk->capacity : RTABLE_INITIAL_CAPACITY;
+			chunk->routes = realloc(chunk->routes, chunk->capacity * sizeof(struct route_table_entry));
+			DIE(!chunk->routes, "rtable - realloc");
+		}
+
+		const char *error;
+		if (!rtable_parse_route(&p, end, &chunk->routes[chunk->size], &error)) {
+			chunk->malformed = true;
+			break;
+		}
+		chunk->size++;
+	}
+
+	return NULL;
+}
+
+struct route_table_entry *rtable_load(const char *file_name, int threads, int *size)
+{
+	struct route_table_entry *rtable = rtable_try_load(file_name, threads, size);
+
+	DIE(!rtable, "rtable parsing - malformed route file");
+	return rtable;
+}
+
+struct route_table_entry *rtable_try_load(const char *file_name, int threads, int *size)
+{
+	struct rtable_chunk chunks[RTABLE_MAX_LOAD_THREADS];
+	struct stat st;
+
+	DIE(threads < 1 || threads > RTABLE_MAX_LOAD_THREADS, "rtable - number of threads");
+
+	int fd = open(file_name, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	DIE(fstat(fd, &st) == -1, "rtable - fstat");
+
+	size_t len = st.st_size;
+	const char *data = NULL;
+	if (len) {
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		DIE(data == MAP_FAILED, "rtable - mmap");
+		madvise((void *) data, len, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	// Split on line boundaries: every chunk starts right after a newline
+	const char *end = data + len;
+	memset(chunks, 0, sizeof(chunks));
+	for (int i = 0; i < threads; ++i) {
+		const char *start = data + len / threads * i;
+
+		// Move to the beginning of the next line, unless already at one
+		if (i && start > data && start[-1] != '\n') {
+			const char *newline = memchr(start, '\n', end - start);
+			start = newline ? newline + 1 : end;
+		}
+		// Previous chunk went past this one (long line): leave it empty
+		if (i && start < chunks[i - 1].start) {
+			start = chunks[i - 1].start;
+		}
+
+		chunks[i].start = start;
+	}
+	for (int i = 0; i + 1 < threads; ++i) {
+		chunks[i].end = chunks[i + 1].start;
+	}
+	chunks[threads - 1].end = end;
+
+	for (int i = 1; i < threads; ++i) {
+		DIE(pthread_create(&chunks[i].thread, NULL, rtable_parse_chunk, &chunks[i]), "rtable - pthread_create");
+	}
+	rtable_parse_chunk(&chunks[0]);
+
+	int total = chunks[0].size;
+	bool malformed = chunks[0].malformed;
+	for (int i = 1; i < threads; ++i) {
+		pthread_join(chunks[i].thread, NULL);
+		total += chunks[i].size;
+		malformed |= chunks[i].malformed;
+	}
+
+	if (len) {
+		munmap((void *) data, len);
+	}
+
+	if (malformed) {
+		for (int i = 0; i < threads; ++i) {
+			free(chunks[i].routes);
+		}
+		return NULL;
+	}
+
+	// Stitch the chunks back together, in file order
+	struct route_table_entry *rtable = malloc((total + 1) * sizeof(struct route_table_entry));
+	DIE(!rtable, "rtable - malloc");
+
+	int offset = 0;
+	for (int i = 0; i < threads; ++i) {
+		if (chunks[i].size) {
+			memcpy(&rtable[offset], chunks[i].routes, chunks[i].size * sizeof(struct route_table_entry));
+		}
+		offset += chunks[i].size;
+		free(chunks[i].routes);
+	}
+
+	*size = total;
+	return rtable;
+}
+
+static inline uint64_t rtable_key(const struct route_table_entry *route)
+{
+	return (uint64_t) route->prefix << 32 | route->mask;
+}
+
+void rtable_sort(struct route_table_entry *rtable, int rtable_size)
+{
+	if (rtable_size < 2) {
+		return;
+	}
+
+	// Histograms of the four 16-bit digits of (prefix, mask), in one pass
+	uint32_t (*counts)[1 << 16] = calloc(4, sizeof(*counts));
+	DIE(!counts, "rtable - calloc counts");
+
+	for (int i = 0; i < rtable_size; ++i) {
+		uint64_t key = rtable_key(&rtable[i]);
+
+		for (int digit = 0; digit < 4; ++digit) {
+			counts[digit][(key >> (16 * digit)) & 0xffff]++;
+		}
+	}
+
+	struct route_table_entry *tmp = malloc(rtable_size * sizeof(struct route_table_entry));
+	DIE(!tmp, "rtable - malloc tmp");
+
+	struct route_table_entry *src = rtable, *dst = tmp;
+
+	// Least significant digit first; each pass is stable
+	for (int digit = 0; digit < 4; ++digit) {
+		uint32_t *count = counts[digit];
+		int shift = 16 * digit;
+
+		// Every route has the same digit (eg. masks): nothing to do
+		if (count[(rtable_key(&src[0]) >> shift) & 0xffff] == (uint32_t) rtable_size) {
+			continue;
+		}
+
+		uint32_t offset = 0;
+		for (int i = 0; i < 1 << 16; ++i) {
+			uint32_t n = count[i];
+
+			count[i] = offset;
+			offset += n;
+		}
+
+		for (int i = 0; i < rtable_size; ++i) {
+			dst[count[(rtable_key(&src[i]) >> shift) & 0xffff]++] = src[i];
+		}
+
+		struct route_table_entry *swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != rtable) {
+		memcpy(rtable, src, rtable_size * sizeof(struct route_table_entry));
+	}
+
+	free(tmp);
+	free(counts);
+}
+
+int rtable_group(struct route_table_entry *rtable, int rtable_size)
+{
+	int groups = 0;
+
+	for (int start = 0, end; start < rtable_size; start = end) {
+		uint32_t prefix = rtable[start].prefix & rtable[start].mask;
+		struct nexthop members[NEXTHOP_GROUP_MAX];
+		int count = 0;
+
+		// Sorted: the routes of a prefix are next to each other, in file order
+		for (end = start; end < rtable_size && (rtable[end].prefix & rtable[end].mask) == prefix
+				&& rtable[end].mask == rtable[start].mask; ++end) {
+			struct nexthop member = { rtable[end].next_hop, rtable[end].interface };
+			bool known = false;
+
+			for (int i = 0; i < count; ++i) {
+				known |= members[i].next_hop == member.next_hop && members[i].interface == member.interface;
+			}
+			if (!known && count < NEXTHOP_GROUP_MAX) {
+				members[count++] = member;
+			}
+		}
+
+		if (count < 2) {
+			continue;
+		}
+
+		struct nexthop_group *group = nexthop_group_create(members, count);
+		for (int i = start; i < end; ++i) {
+			rtable[i].group = group;
+		}
+		groups++;
+	}
+
+	return groups;
+}
+
+void rtable_free(struct route_table_entry *rtable, int rtable_size)
+{
+	if (!rtable) {
+		return;
+	}
+
+	// The routes of a group are next to each other
+	for (int i = 0; i < rtable_size; ++i) {
+		if (rtable[i].group && (!i || rtable[i - 1].group != rtable[i].group)) {
+			free(rtable[i].group);
+		}
+	}
+
+	free(rtable);
+}
+
+struct route6_table_entry *rtable6_load(const char *file_name, int *size)
+{
+	struct route6_table_entry *routes = NULL;
+	int capacity = 0;
+	char line[256];
+
+	FILE *file = fopen(file_name, "r");
+	DIE(!file, "rtable6 - fopen");
+
+	*size = 0;
+	while (fgets(line, sizeof(line), file)) {
+		char prefix[INET6_ADDRSTRLEN], next_hop[INET6_ADDRSTRLEN], extra;
+		int prefix_len, interface;
+
+		// Empty line
+		if (sscanf(line, " %c", &extra) != 1) {
+			continue;
+		}
+
+		if (*size == capacity) {
+			capacity = capacity ? 2 * capacity : RTABLE_INITIAL_CAPACITY;
+			routes = realloc(routes, capacity * sizeof(struct route6_table_entry));
+			DIE(!routes, "rtable6 - realloc");
+		}
+
+		struct route6_table_entry *route = &routes[*size];
+		DIE(sscanf(line, "%45s %45s %d %d %c", prefix, next_hop, &prefix_len, &interface, &extra) != 4
+			|| inet_pton(AF_INET6, prefix, &route->prefix) != 1
+			|| inet_pton(AF_INET6, next_hop, &route->next_hop) != 1
+			|| prefix_len < 0 || prefix_len > 128 || interface < 0 || interface >= num_interfaces,
+			"rtable6 parsing - malformed route file");
+		route->prefix_len = prefix_len;
+		route->interface = interface;
+
+		// Keep the prefix bits only
+		for (int i = 0; i < 16; ++i) {
+			int bits = prefix_len - 8 * i;
+
+			route->prefix.s6_addr[i] &= bits >= 8 ? 0xff : bits > 0 ? 0xff << (8 - bits) : 0;
+		}
+		(*size)++;
+	}
+
+	fclose(file);
+	return routes;
+}
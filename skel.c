@@ -1,6 +1,27 @@
 #include "skel.h"
-
-int interfaces[ROUTER_NUM_INTERFACES];
+#include "pktpool.h"
+#include "tpacket.h"
+#include "rcu.h"
+#include "rtable.h"
+#include "pcap_io.h"
+#include "stats.h"
+#include "ipv6.h"
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+__thread int interfaces[MAX_INTERFACES];
+char interface_names[MAX_INTERFACES][IFNAMSIZ];
+int num_interfaces;
+
+/* Every interface socket of the thread is registered here, with the interface as data */
+static __thread int epoll_fd;
+/* eventfd other threads write to interrupt get_packets, registered as interface MAX_INTERFACES */
+static __thread int wakeup_fd;
+/* Address / link change notifications, registered as interface MAX_INTERFACES + 1 by init */
+static int netlink_fd = -1;
+static void interface_info_changed();
+
+struct interface_info *interface_info;
 
 int get_sock(const char *if_name)
 {
@@ -23,15 +44,16 @@ int get_sock(const char *if_name)
 	return s;
 }
 
-packet* socket_receive_message(int sockfd, packet *m)
-{        
-	/* 
-	 * Note that "buffer" should be at least the MTU size of the 
-	 * interface, eg 1500 bytes 
-	 * */
-	m->len = read(sockfd, m->payload, MAX_LEN);
-	DIE(m->len == -1, "read");
-	return m;
+/* Whether sending a frame failed for a reason of its own: link down, dropped by the qdisc, too big */
+static bool tx_frame_error(int err)
+{
+	return err == ENOBUFS || err == ENETDOWN || err == ENXIO || err == EMSGSIZE || err == ENOMEM;
+}
+
+/* Whether a receive failed for a passing reason: a signal, the link going down, socket memory pressure */
+static bool rx_transient_error(int err)
+{
+	return err == EINTR || err == ENETDOWN || err == ENOBUFS;
 }
 
 int send_packet(int sockfd, packet *m)
@@ -41,57 +63,716 @@ int send_packet(int sockfd, packet *m)
 	 * interface, eg 1500 bytes 
 	 * */
 	int ret;
-	ret = write(interfaces[sockfd], m->payload, m->len);
-	DIE(ret == -1, "write");
+
+	if (pcap_io) {
+		stats->tx[sockfd]++;
+		pcap_io_tx(pcap_io, sockfd, &m, 1);
+		return m->len;
+	}
+
+	// m may not be a pool buffer, so it cannot wait in the TX queue
+	ret = send(interfaces[sockfd], m->payload, m->len, MSG_DONTWAIT);
+	if (ret == -1) {
+		DIE(errno != EAGAIN && errno != EWOULDBLOCK && !tx_frame_error(errno), "send");
+		stats->drops[tx_frame_error(errno) ? STATS_DROP_TX_ERROR : STATS_DROP_TX_QUEUE]++;
+		stats->tx_dropped[sockfd]++;
+		return -1;
+	}
+
+	stats->tx[sockfd]++;
 	return ret;
 }
 
 int get_packet(packet *m) {
-	int res;
-	fd_set set;
+	packet *buf;
+	int count;
+
+	while (!(count = get_packets(&buf, 1))) {
+	}
+	if (count < 0) {
+		return -1;
+	}
 
-	FD_ZERO(&set);
-	while (1) {
-		for (int i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
-			FD_SET(interfaces[i], &set);
+	m->len = buf->len;
+	m->interface = buf->interface;
+	memcpy(m->payload, buf->payload, buf->len);
+	pkt_free(buf);
+	return 0;
+}
+
+/*
+ * Burst I/O: frames are received with one recvmmsg per ready interface and
+ * sent from per-interface TX queues, with one non-blocking sendmmsg per
+ * batch. Every thread has its own sockets, so all of this state is
+ * thread-local; only the configuration is shared.
+ */
+
+/* Bytes an interface may send per deficit round robin turn: a full batch of small frames */
+#define TX_QUANTUM 16384
+/* Bytes tx_burst_end sends at most: a backlog drains over several bursts, between reads */
+#define TX_FLUSH_BUDGET (4 * MAX_BURST * 1514)
+
+_Static_assert(!(TX_QUEUE_DEPTH & (TX_QUEUE_DEPTH - 1)), "TX queue depth not a power of 2");
+_Static_assert(TX_CONTROL_DEPTH <= TX_QUEUE_DEPTH, "TX control queue deeper than its ring");
+_Static_assert(TX_QUANTUM >= MAX_LEN, "TX quantum smaller than a frame");
+
+/* Frames of one class waiting for an interface, oldest first */
+struct tx_ring {
+	packet *pkts[TX_QUEUE_DEPTH];
+	uint32_t head;
+	uint32_t count;
+};
+
+/*
+ * Egress queue of an interface. Frames the router built go out before any
+ * forwarded one (strict priority: they are rate-limited, and few); the
+ * interfaces are served by deficit round robin, so a port with a backlog
+ * gets its share of each flush and no more.
+ */
+struct tx_queue {
+	struct tx_ring classes[TX_CLASS_MAX];
+	/* Bytes left of the turns the interface was given */
+	int32_t deficit;
+	/* now_us() when the oldest frame of the queue was queued */
+	uint64_t oldest;
+	/* In tx_pending */
+	bool listed;
+	/* Socket full: skipped until epoll reports it writable */
+	bool blocked;
+};
+
+static const uint32_t tx_depth[TX_CLASS_MAX] = {
+	[TX_CLASS_CONTROL] = TX_CONTROL_DEPTH,
+	[TX_CLASS_DATA] = TX_QUEUE_DEPTH,
+};
+
+/* One per interface, created by io_thread_init */
+static __thread struct tx_queue *tx_queues;
+/* Interfaces whose TX queue may hold frames: only these are served */
+static __thread int tx_pending[MAX_INTERFACES];
+static __thread int tx_pending_count;
+/* Index in tx_pending of the interface whose turn is next */
+static __thread int tx_turn;
+/* PACKET_MMAP rings, when the TPACKET backend is in use */
+static __thread struct tpacket_ring *rings[MAX_INTERFACES];
+static int burst_size = MAX_BURST;
+static int tx_flush_us;
+/*
+ * Interfaces known to be readable, served round-robin: each turn reads at
+ * most rx_quota frames, then the interface goes to the back of the queue
+ * if it may have more.
+ */
+static __thread int rx_ready[MAX_INTERFACES];
+static __thread int rx_ready_head;
+static __thread int rx_ready_count;
+static __thread bool rx_queued[MAX_INTERFACES];
+static int rx_quota = MAX_BURST;
+/* Pool buffers handed to recvmmsg and not filled yet */
+static __thread packet *rx_spare[MAX_BURST];
+static __thread int rx_spare_count;
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void burst_io_config(int burst, int flush_us, int quota)
+{
+	DIE(burst < 1 || burst > MAX_BURST, "burst size out of range");
+	DIE(flush_us < 0, "negative TX flush timeout");
+	DIE(quota < 1, "RX quota out of range");
+
+	burst_size = burst;
+	tx_flush_us = flush_us;
+	rx_quota = quota;
+}
+
+void use_tpacket_rings()
+{
+	for (int i = 0; i < num_interfaces; ++i) {
+		rings[i] = tpacket_ring_create(interfaces[i]);
+	}
+}
+
+static inline uint32_t tx_queue_count(const struct tx_queue *queue)
+{
+	return queue->classes[TX_CLASS_CONTROL].count + queue->classes[TX_CLASS_DATA].count;
+}
+
+static inline packet *tx_ring_at(const struct tx_ring *ring, uint32_t i)
+{
+	return ring->pkts[(ring->head + i) & (TX_QUEUE_DEPTH - 1)];
+}
+
+/* Frame the queue sends next */
+static inline packet *tx_queue_head(const struct tx_queue *queue)
+{
+	const struct tx_ring *ring = &queue->classes[TX_CLASS_CONTROL];
+
+	return tx_ring_at(ring->count ? ring : &queue->classes[TX_CLASS_DATA], 0);
+}
+
+/* Releases the count frames at the head of the queue, control first */
+static void tx_queue_pop(struct tx_queue *queue, uint32_t count)
+{
+	for (int c = 0; c < TX_CLASS_MAX && count; ++c) {
+		struct tx_ring *ring = &queue->classes[c];
+		uint32_t n = count < ring->count ? count : ring->count;
+
+		for (uint32_t i = 0; i < n; ++i) {
+			pkt_free(tx_ring_at(ring, i));
 		}
+		ring->head = (ring->head + n) & (TX_QUEUE_DEPTH - 1);
+		ring->count -= n;
+		count -= n;
+	}
+}
+
+/* Socket of interface full: wait for it to be writable again */
+static void tx_block(int interface)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLOUT,
+		.data.u32 = interface,
+	};
+
+	tx_queues[interface].blocked = true;
+	stats->events[STATS_TX_BLOCKED]++;
+	DIE(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, interfaces[interface], &event) == -1, "epoll_ctl");
+}
 
-		res = select(interfaces[ROUTER_NUM_INTERFACES - 1] + 1, &set, NULL, NULL, NULL);
-		DIE(res == -1, "select");
+static void tx_unblock(int interface)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u32 = interface,
+	};
+
+	tx_queues[interface].blocked = false;
+	DIE(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, interfaces[interface], &event) == -1, "epoll_ctl");
+}
 
-		for (int i = 0; i < ROUTER_NUM_INTERFACES; ++i) {
-			if (FD_ISSET(interfaces[i], &set)) {
-				socket_receive_message(interfaces[i], m);
-				m->interface = i;
-				return 0;
+/*
+ * Sends one batch from the head of the queue of interface: at most burst
+ * size frames, and budget bytes unless the first frame alone is bigger.
+ * Returns the bytes taken off the queue, sent or dropped; a full socket
+ * (or TX ring) blocks the interface, leaving the rest queued.
+ */
+static int32_t tx_send(int interface, int32_t budget)
+{
+	struct tx_queue *queue = &tx_queues[interface];
+	packet *pkts[MAX_BURST];
+	struct mmsghdr msgs[MAX_BURST];
+	struct iovec iovs[MAX_BURST];
+	int32_t bytes = 0;
+	int count = 0, taken = 0, sent = 0;
+	bool full = false;
+
+	// Control before data: a frame that does not fit holds back the ones behind it
+	for (int c = 0; c < TX_CLASS_MAX && !full; ++c) {
+		struct tx_ring *ring = &queue->classes[c];
+
+		for (uint32_t i = 0; i < ring->count; ++i) {
+			packet *m = tx_ring_at(ring, i);
+
+			if (count == burst_size || (count && bytes + m->len > budget)) {
+				full = true;
+				break;
 			}
+			bytes += m->len;
+			pkts[count++] = m;
 		}
 	}
-	return -1;
+
+	if (pcap_io) {
+		// Offline: counted and recorded, nothing is sent
+		pcap_io_tx(pcap_io, interface, pkts, count);
+		taken = sent = count;
+	} else if (rings[interface]) {
+		// TX ring: copy into the ring slots, one send() kicks the whole batch;
+		// a full ring keeps the rest queued, like a full socket
+		taken = sent = tpacket_tx(rings[interface], pkts, count);
+		if (taken < count) {
+			tx_block(interface);
+		}
+	} else {
+		for (int i = 0; i < count; ++i) {
+			iovs[i].iov_base = pkts[i]->payload;
+			iovs[i].iov_len = pkts[i]->len;
+			memset(&msgs[i], 0, sizeof(struct mmsghdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		// sendmmsg may stop early, or fail on one frame: carry on after it
+		while (taken < count) {
+			int ret = sendmmsg(interfaces[interface], msgs + taken, count - taken, MSG_DONTWAIT);
+
+			if (ret > 0) {
+				taken += ret;
+				sent += ret;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				tx_block(interface);
+				break;
+			} else if (errno != EINTR) {
+				DIE(!tx_frame_error(errno), "sendmmsg");
+				stats->drops[STATS_DROP_TX_ERROR]++;
+				taken++;
+			}
+		}
+	}
+
+	bytes = 0;
+	for (int i = 0; i < taken; ++i) {
+		bytes += pkts[i]->len;
+	}
+	tx_queue_pop(queue, taken);
+
+	stats->tx[interface] += sent;
+	stats->tx_queued[interface] -= taken;
+	stats->tx_dropped[interface] += taken - sent;
+	return bytes;
 }
 
-char *get_interface_ip(int interface)
+void tx_flush(int interface)
 {
-	struct ifreq ifr;
-	if (interface == 0)
-		sprintf(ifr.ifr_name, "rr-0-1");
-	else {
-		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	struct tx_queue *queue = &tx_queues[interface];
+
+	while (tx_queue_count(queue) && !queue->blocked) {
+		tx_send(interface, INT32_MAX);
+	}
+}
+
+/* Whether the queue should be sent now: with a hold time, only once it is worth a syscall */
+static bool tx_due(const struct tx_queue *queue, uint64_t now, bool all)
+{
+	if (!tx_queue_count(queue) || queue->blocked) {
+		return false;
 	}
-	ioctl(interfaces[interface], SIOCGIFADDR, &ifr);
-	return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
+
+	return all || !tx_flush_us || queue->classes[TX_CLASS_CONTROL].count
+		|| tx_queue_count(queue) >= (uint32_t) burst_size || now - queue->oldest >= (uint64_t) tx_flush_us;
+}
+
+/*
+ * Deficit round robin over the pending interfaces: each turn gives one of
+ * them TX_QUANTUM more bytes, which it sends while its head frame fits.
+ * Stops once no interface is due, or budget bytes were sent; the next call
+ * starts with the interface whose turn was next.
+ */
+static void tx_schedule(uint64_t now, bool all, int64_t budget)
+{
+	int idle = 0;
+
+	while (budget > 0 && idle < tx_pending_count) {
+		if (tx_turn >= tx_pending_count) {
+			tx_turn = 0;
+		}
+
+		int interface = tx_pending[tx_turn++];
+		struct tx_queue *queue = &tx_queues[interface];
+
+		if (!tx_due(queue, now, all)) {
+			idle++;
+			continue;
+		}
+		idle = 0;
+
+		queue->deficit += TX_QUANTUM;
+		while (tx_queue_count(queue) && !queue->blocked && tx_queue_head(queue)->len <= queue->deficit) {
+			int32_t bytes = tx_send(interface, queue->deficit);
+
+			queue->deficit -= bytes;
+			budget -= bytes;
+		}
+
+		// An empty queue does not save up for later
+		if (!tx_queue_count(queue)) {
+			queue->deficit = 0;
+		}
+	}
+
+	// Forget the empty queues, keep the turn where it was
+	int kept = 0;
+
+	for (int i = 0; i < tx_pending_count; ++i) {
+		struct tx_queue *queue = &tx_queues[tx_pending[i]];
+
+		if (tx_queue_count(queue)) {
+			tx_pending[kept++] = tx_pending[i];
+		} else {
+			queue->listed = false;
+			if (i < tx_turn) {
+				tx_turn--;
+			}
+		}
+	}
+
+	tx_pending_count = kept;
+}
+
+void tx_flush_all()
+{
+	tx_schedule(0, true, INT64_MAX);
+}
+
+static void tx_enqueue_class(int interface, packet *m, enum tx_class class)
+{
+	struct tx_queue *queue = &tx_queues[interface];
+	struct tx_ring *ring = &queue->classes[class];
+
+	// Tail drop: a port that cannot keep up holds no more buffers than its queue
+	if (ring->count == tx_depth[class]) {
+		stats->drops[STATS_DROP_TX_QUEUE]++;
+		stats->tx_dropped[interface]++;
+		return;
+	}
+
+	if (!queue->listed) {
+		tx_pending[tx_pending_count++] = interface;
+		queue->listed = true;
+	}
+
+	if (!tx_queue_count(queue) && tx_flush_us) {
+		queue->oldest = now_us();
+	}
+
+	pkt_ref(m);
+	ring->pkts[(ring->head + ring->count++) & (TX_QUEUE_DEPTH - 1)] = m;
+	stats->tx_queued[interface]++;
+
+	if (tx_queue_count(queue) == (uint32_t) burst_size && !queue->blocked) {
+		tx_flush(interface);
+	}
+}
+
+void tx_enqueue(int interface, packet *m)
+{
+	tx_enqueue_class(interface, m, TX_CLASS_DATA);
+}
+
+void tx_enqueue_control(int interface, packet *m)
+{
+	tx_enqueue_class(interface, m, TX_CLASS_CONTROL);
+}
+
+void tx_burst_end()
+{
+	// No hold time: every queue is due, no need for the clock
+	tx_schedule(tx_flush_us ? now_us() : 0, false, TX_FLUSH_BUDGET);
+}
+
+/* Time until a TX queue must be served, in us; -1 if none has to (empty or blocked) */
+static int64_t tx_next_deadline()
+{
+	int64_t deadline = -1;
+	uint64_t now = tx_flush_us ? now_us() : 0;
+
+	for (int i = 0; i < tx_pending_count; ++i) {
+		struct tx_queue *queue = &tx_queues[tx_pending[i]];
+
+		if (!tx_queue_count(queue) || queue->blocked) {
+			continue;
+		}
+
+		int64_t left = tx_due(queue, now, false) ? 0 : (int64_t) (queue->oldest + tx_flush_us) - (int64_t) now;
+		if (left < 0) {
+			left = 0;
+		}
+		if (deadline < 0 || left < deadline) {
+			deadline = left;
+		}
+	}
+
+	return deadline;
+}
+
+static int rx_interface(int interface, packet **m, int max)
+{
+	struct mmsghdr msgs[MAX_BURST];
+	struct iovec iovs[MAX_BURST];
+
+	// RX ring: frames are read from the mapped blocks, no syscall
+	if (rings[interface]) {
+		return tpacket_rx(rings[interface], m, max, interface);
+	}
+
+	// Top up the spare buffers recvmmsg fills
+	while (rx_spare_count < max) {
+		packet *buf = pkt_alloc(pkt_pool);
+		if (!buf) {
+			break;
+		}
+		rx_spare[rx_spare_count++] = buf;
+	}
+	if (max > rx_spare_count) {
+		max = rx_spare_count;
+	}
+
+	for (int i = 0; i < max; ++i) {
+		packet *buf = rx_spare[rx_spare_count - 1 - i];
+
+		iovs[i].iov_base = buf->payload;
+		iovs[i].iov_len = MAX_LEN;
+		memset(&msgs[i], 0, sizeof(struct mmsghdr));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int ret = recvmmsg(interfaces[interface], msgs, max, MSG_DONTWAIT, NULL);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	if (ret == -1 && rx_transient_error(errno)) {
+		// Nothing read this time, the other interfaces keep going
+		stats->events[STATS_RX_ERROR]++;
+		return 0;
+	}
+	DIE(ret == -1, "recvmmsg");
+
+	for (int i = 0; i < ret; ++i) {
+		packet *buf = rx_spare[--rx_spare_count];
+
+		buf->len = msgs[i].msg_len;
+		buf->interface = interface;
+		m[i] = buf;
+	}
+
+	return ret;
+}
+
+static void rx_ready_push(int interface)
+{
+	rx_ready[(rx_ready_head + rx_ready_count++) % MAX_INTERFACES] = interface;
+	rx_queued[interface] = true;
+}
+
+static int rx_ready_pop()
+{
+	int interface = rx_ready[rx_ready_head];
+
+	rx_ready_head = (rx_ready_head + 1) % MAX_INTERFACES;
+	rx_ready_count--;
+	return interface;
+}
+
+int get_packets(packet **m, int max)
+{
+	struct epoll_event events[MAX_INTERFACES + 2];
+	int count = 0;
+	bool woken = false;
+	bool unblocked = false;
+
+	if (max > burst_size) {
+		max = burst_size;
+	}
+
+	// Offline replay: the next frames are always there, nothing to wait for
+	if (pcap_io) {
+		count = pcap_io_rx(pcap_io, m, max);
+		if (count < 0) {
+			tx_flush_all();
+		}
+		return count;
+	}
+
+	while (!count && !woken) {
+		// Block only when no interface is known to be readable, and no
+		// longer than the TX frames being held may wait; blocked TX
+		// queues wake it up when their socket drains
+		int timeout = -1;
+		int64_t deadline = tx_next_deadline();
+
+		if (rx_ready_count) {
+			timeout = 0;
+		} else if (deadline >= 0) {
+			timeout = (deadline + 999) / 1000;
+		}
+
+		int res = epoll_wait(epoll_fd, events, MAX_INTERFACES + 2, timeout);
+		DIE(res == -1 && errno != EINTR, "epoll_wait");
+
+		// O(ready): only the interfaces epoll reported are looked at
+		for (int i = 0; i < res; ++i) {
+			if (events[i].data.u32 == MAX_INTERFACES) {
+				uint64_t wakeups;
+
+				DIE(read(wakeup_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN, "read wakeup");
+				woken = true;
+				continue;
+			}
+
+			if (events[i].data.u32 == MAX_INTERFACES + 1) {
+				interface_info_changed();
+				continue;
+			}
+
+			// Writable again: the queue is served below
+			if (events[i].events & EPOLLOUT) {
+				tx_unblock(events[i].data.u32);
+				unblocked = true;
+			}
+
+			if (events[i].events & ~EPOLLOUT && !rx_queued[events[i].data.u32]) {
+				rx_ready_push(events[i].data.u32);
+			}
+		}
+
+		if (deadline >= 0 || unblocked) {
+			tx_burst_end();
+			unblocked = false;
+		}
+
+		while (rx_ready_count && count < max) {
+			int interface = rx_ready_pop();
+			int quota = max - count < rx_quota ? max - count : rx_quota;
+			int received = rx_interface(interface, m + count, quota);
+
+			count += received;
+
+			// Used up its quota -> may have more, back of the queue
+			if (received == quota) {
+				rx_ready_push(interface);
+			} else {
+				rx_queued[interface] = false;
+			}
+		}
+	}
+
+	return count;
+}
+
+char *get_interface_ip(int interface)
+{
+	struct in_addr addr = { .s_addr = get_interface_info(interface)->ip };
+	return inet_ntoa(addr);
 }
 
 void get_interface_mac(int interface, uint8_t *mac)
+{
+	memcpy(mac, get_interface_info(interface)->mac, ETH_ALEN);
+}
+
+/* Global and link-local IPv6 addresses of interface, from /proc/net/if_inet6 */
+static void interface_query_ipv6(struct interface_info *info)
+{
+	char hex[33], name[IFNAMSIZ + 1];
+	unsigned int ifindex, prefix_len, scope, flags;
+	bool link_local = false;
+
+	// IPv6 disabled: the link-local address still works on the wire
+	FILE *file = fopen("/proc/net/if_inet6", "r");
+	while (file && fscanf(file, "%32s %x %x %x %x %16s", hex, &ifindex, &prefix_len, &scope, &flags, name) == 6) {
+		struct in6_addr addr;
+
+		if ((int) ifindex != info->ifindex) {
+			continue;
+		}
+		for (int i = 0; i < 16; ++i) {
+			addr.s6_addr[i] = hex2byte(hex + 2 * i);
+		}
+
+		if (IN6_IS_ADDR_LINKLOCAL(&addr)) {
+			info->ip6_ll = addr;
+			link_local = true;
+		} else if (IN6_IS_ADDR_UNSPECIFIED(&info->ip6) && !IN6_IS_ADDR_LOOPBACK(&addr)) {
+			info->ip6 = addr;
+		}
+	}
+	if (file) {
+		fclose(file);
+	}
+
+	if (!link_local) {
+		ipv6_link_local(info->mac, &info->ip6_ll);
+	}
+}
+
+/* Reads the metadata of interface from the kernel */
+static void interface_query(int interface, struct interface_info *info)
 {
 	struct ifreq ifr;
-	if (interface == 0)
-		sprintf(ifr.ifr_name, "rr-0-1");
-	else {
-		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+
+	memset(info, 0, sizeof(struct interface_info));
+
+	// An interface without an address keeps ip = 0
+	memcpy(ifr.ifr_name, interface_names[interface], IFNAMSIZ);
+	if (!ioctl(interfaces[interface], SIOCGIFADDR, &ifr)) {
+		info->ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+	}
+
+	memcpy(ifr.ifr_name, interface_names[interface], IFNAMSIZ);
+	DIE(ioctl(interfaces[interface], SIOCGIFHWADDR, &ifr), "ioctl SIOCGIFHWADDR");
+	memcpy(info->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	memcpy(ifr.ifr_name, interface_names[interface], IFNAMSIZ);
+	DIE(ioctl(interfaces[interface], SIOCGIFMTU, &ifr), "ioctl SIOCGIFMTU");
+	info->mtu = ifr.ifr_mtu;
+
+	memcpy(ifr.ifr_name, interface_names[interface], IFNAMSIZ);
+	DIE(ioctl(interfaces[interface], SIOCGIFINDEX, &ifr), "ioctl SIOCGIFINDEX");
+	info->ifindex = ifr.ifr_ifindex;
+
+	interface_query_ipv6(info);
+}
+
+/* Queries every interface again and publishes the new table */
+static void interface_info_refresh()
+{
+	struct interface_info *info = calloc(MAX_INTERFACES, sizeof(struct interface_info));
+	DIE(!info, "interface_info - calloc");
+
+	for (int i = 0; i < num_interfaces; ++i) {
+		interface_query(i, &info[i]);
+	}
+
+	struct interface_info *old = interface_info;
+	rcu_assign_pointer(interface_info, info);
+	if (old) {
+		rcu_defer(free, old);
+	}
+}
+
+/* Whether ifindex is one of the router's interfaces */
+static bool interface_known(int ifindex)
+{
+	for (int i = 0; i < num_interfaces; ++i) {
+		if (interface_info[i].ifindex == ifindex) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Drains the netlink notifications, refreshes the table if one is about us */
+static void interface_info_changed()
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	bool changed = false;
+	int len;
+
+	while ((len = recv(netlink_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (struct nlmsghdr *nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (unsigned) len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR) {
+				struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+				changed |= interface_known(ifa->ifa_index);
+			} else if (nh->nlmsg_type == RTM_NEWLINK) {
+				struct ifinfomsg *ifi = NLMSG_DATA(nh);
+				changed |= interface_known(ifi->ifi_index);
+			}
+		}
+	}
+	// Overrun: notifications were lost, assume the worst
+	DIE(len == -1 && errno != EAGAIN && errno != ENOBUFS, "recv netlink");
+	changed |= len == -1 && errno == ENOBUFS;
+
+	if (changed) {
+		interface_info_refresh();
 	}
-	ioctl(interfaces[interface], SIOCGIFHWADDR, &ifr);
-	memcpy(mac, ifr.ifr_addr.sa_data, 6);
 }
 
 static int hex2num(char c)
@@ -141,9 +822,106 @@ int hwaddr_aton(const char *txt, uint8_t *addr)
 
 void init(int argc, char *argv[])
 {
+	DIE(argc < 1 || argc > MAX_INTERFACES, "number of interfaces");
+	num_interfaces = argc;
+
 	for (int i = 0; i < argc; ++i) {
 		printf("Setting up interface: %s\n", argv[i]);
-		interfaces[i] = get_sock(argv[i]);
+		// Replayed interfaces come as "name=address"
+		snprintf(interface_names[i], IFNAMSIZ, "%.*s", (int) strcspn(argv[i], "="), argv[i]);
+	}
+
+	// Offline replay: the interfaces only exist in the captures
+	if (pcap_io) {
+		interface_info = pcap_io_attach(pcap_io, argc, argv);
+		io_thread_init();
+		return;
+	}
+
+	io_thread_init();
+
+	// Subscribe before the first query, so no change can slip in between
+	netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE);
+	DIE(netlink_fd == -1, "socket netlink");
+
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+	};
+	DIE(bind(netlink_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1, "bind netlink");
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u32 = MAX_INTERFACES + 1,
+	};
+	DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, netlink_fd, &event) == -1, "epoll_ctl");
+
+	interface_info_refresh();
+}
+
+void io_thread_init()
+{
+	// Room for full TX queues on every interface on top of the base pool:
+	// however backed up the ports, RX still gets buffers
+	pkt_pool = pkt_pool_create(PKT_POOL_SIZE + num_interfaces * (TX_QUEUE_DEPTH + TX_CONTROL_DEPTH));
+	tx_queues = calloc(num_interfaces, sizeof(struct tx_queue));
+	DIE(!tx_queues, "tx_queues - calloc");
+
+	wakeup_fd = eventfd(0, EFD_NONBLOCK);
+	DIE(wakeup_fd == -1, "eventfd");
+
+	// Offline replay: no socket, get_packets never blocks
+	if (pcap_io) {
+		pcap_io_thread_init(pcap_io);
+		return;
+	}
+
+	epoll_fd = epoll_create1(0);
+	DIE(epoll_fd == -1, "epoll_create1");
+
+	for (int i = 0; i < num_interfaces; ++i) {
+		interfaces[i] = get_sock(interface_names[i]);
+
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.u32 = i,
+		};
+		DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, interfaces[i], &event) == -1, "epoll_ctl");
+	}
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.u32 = MAX_INTERFACES,
+	};
+	DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) == -1, "epoll_ctl");
+}
+
+int io_wakeup_fd()
+{
+	return wakeup_fd;
+}
+
+void io_wakeup(int fd)
+{
+	uint64_t one = 1;
+
+	DIE(write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN, "write wakeup");
+}
+
+void io_join_fanout()
+{
+	// Replayed frames are already split by flow between the threads
+	if (pcap_io) {
+		return;
+	}
+
+	for (int i = 0; i < num_interfaces; ++i) {
+		// One group per interface, the same in every thread of the process
+		int id = (getpid() * MAX_INTERFACES + i) & 0xffff;
+		int arg = id | (PACKET_FANOUT_HASH << 16);
+
+		DIE(setsockopt(interfaces[i], SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1,
+			"setsockopt PACKET_FANOUT");
 	}
 }
 
@@ -225,111 +1003,141 @@ void build_ethhdr(struct ether_header *eth_hdr, uint8_t *sha, uint8_t *dha, unsi
 	eth_hdr->ether_type = type;
 }
 
+/* Fills the IPv4 header of an ICMP message sent by the router */
+static void build_icmp_iphdr(struct iphdr *ip_hdr, uint32_t daddr, uint32_t saddr)
+{
+	/* No options */
+	ip_hdr->version = 4;
+	ip_hdr->ihl = 5;
+	ip_hdr->tos = 0;
+	ip_hdr->protocol = IPPROTO_ICMP;
+	ip_hdr->tot_len = htons(sizeof(struct iphdr) + sizeof(struct icmphdr));
+	ip_hdr->id = htons(1);
+	ip_hdr->frag_off = 0;
+	ip_hdr->ttl = 64;
+	ip_hdr->check = 0;
+	ip_hdr->daddr = daddr;
+	ip_hdr->saddr = saddr;
+	ip_hdr->check = ip_checksum(ip_hdr, sizeof(struct iphdr));
+}
+
 void send_icmp(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int8_t type, u_int8_t code, int interface, int id, int seq)
 {
+	// Build the reply straight into a pool buffer
+	packet *packet = pkt_alloc(pkt_pool);
+	if (!packet) {
+		stats->drops[STATS_DROP_NO_BUFFER]++;
+		return;
+	}
 
-	struct ether_header eth_hdr;
-	struct iphdr ip_hdr;
-	struct icmphdr icmp_hdr = {
-		.type = type,
-		.code = code,
-		.checksum = 0,
-		.un.echo = {
-			.id = id,
-			.sequence = seq,
-		}
-	};
-	packet packet;
-	void *payload;
+	struct ether_header *eth_hdr = (struct ether_header *) packet->payload;
+	struct iphdr *ip_hdr = (struct iphdr *) (packet->payload + sizeof(struct ether_header));
+	struct icmphdr *icmp_hdr = (struct icmphdr *) (packet->payload + sizeof(struct ether_header) + sizeof(struct iphdr));
 
-	build_ethhdr(&eth_hdr, sha, dha, htons(ETHERTYPE_IP));
-	/* No options */
-	ip_hdr.version = 4;
-	ip_hdr.ihl = 5;
-	ip_hdr.tos = 0;
-	ip_hdr.protocol = IPPROTO_ICMP;
-	ip_hdr.tot_len = htons(sizeof(struct iphdr) + sizeof(struct icmphdr));
-	ip_hdr.id = htons(1);
-	ip_hdr.frag_off = 0;
-	ip_hdr.ttl = 64;
-	ip_hdr.check = 0;
-	ip_hdr.daddr = daddr;
-	ip_hdr.saddr = saddr;
-	ip_hdr.check = ip_checksum(&ip_hdr, sizeof(struct iphdr));
-	
-	icmp_hdr.checksum = icmp_checksum((uint16_t *)&icmp_hdr, sizeof(struct icmphdr));
-
-	payload = packet.payload;
-	memcpy(payload, &eth_hdr, sizeof(struct ether_header));
-	payload += sizeof(struct ether_header);
-	memcpy(payload, &ip_hdr, sizeof(struct iphdr));
-	payload += sizeof(struct iphdr);
-	memcpy(payload, &icmp_hdr, sizeof(struct icmphdr));
-	packet.len = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr);
-
-	send_packet(interface, &packet);
+	build_ethhdr(eth_hdr, sha, dha, htons(ETHERTYPE_IP));
+	build_icmp_iphdr(ip_hdr, daddr, saddr);
+
+	icmp_hdr->type = type;
+	icmp_hdr->code = code;
+	icmp_hdr->checksum = 0;
+	icmp_hdr->un.echo.id = id;
+	icmp_hdr->un.echo.sequence = seq;
+	icmp_hdr->checksum = icmp_checksum((uint16_t *)icmp_hdr, sizeof(struct icmphdr));
+
+	packet->len = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr);
+
+	tx_enqueue_control(interface, packet);
+	pkt_free(packet);
 }
 
 void send_icmp_error(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int8_t type, u_int8_t code, int interface)
 {
+	// Build the error straight into a pool buffer
+	packet *packet = pkt_alloc(pkt_pool);
+	if (!packet) {
+		stats->drops[STATS_DROP_NO_BUFFER]++;
+		return;
+	}
+
+	struct ether_header *eth_hdr = (struct ether_header *) packet->payload;
+	struct iphdr *ip_hdr = (struct iphdr *) (packet->payload + sizeof(struct ether_header));
+	struct icmphdr *icmp_hdr = (struct icmphdr *) (packet->payload + sizeof(struct ether_header) + sizeof(struct iphdr));
+
+	build_ethhdr(eth_hdr, sha, dha, htons(ETHERTYPE_IP));
+	build_icmp_iphdr(ip_hdr, daddr, saddr);
+
+	memset(icmp_hdr, 0, sizeof(struct icmphdr));
+	icmp_hdr->type = type;
+	icmp_hdr->code = code;
+	icmp_hdr->checksum = icmp_checksum((uint16_t *)icmp_hdr, sizeof(struct icmphdr));
+
+	packet->len = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr);
+
+	tx_enqueue_control(interface, packet);
+	pkt_free(packet);
+}
+
+bool icmp_echo_reply(packet *m)
+{
+	struct ether_header *eth_hdr = (struct ether_header *) m->payload;
+	struct iphdr *ip_hdr = (struct iphdr *) (m->payload + sizeof(struct ether_header));
+	uint16_t old, new;
 
-	struct ether_header eth_hdr;
-	struct iphdr ip_hdr;
-	struct icmphdr icmp_hdr = {
-		.type = type,
-		.code = code,
-		.checksum = 0,
-	};
-	packet packet;
-	void *payload;
+	if ((size_t) m->len < sizeof(struct ether_header) + sizeof(struct iphdr) || ip_hdr->ihl < 5
+		|| (size_t) m->len < sizeof(struct ether_header) + ip_hdr->ihl * 4 + sizeof(struct icmphdr)) {
+		return false;
+	}
 
-	build_ethhdr(&eth_hdr, sha, dha, htons(ETHERTYPE_IP));
-	/* No options */
-	ip_hdr.version = 4;
-	ip_hdr.ihl = 5;
-	ip_hdr.tos = 0;
-	ip_hdr.protocol = IPPROTO_ICMP;
-	ip_hdr.tot_len = htons(sizeof(struct iphdr) + sizeof(struct icmphdr));
-	ip_hdr.id = htons(1);
-	ip_hdr.frag_off = 0;
-	ip_hdr.ttl = 64;
-	ip_hdr.check = 0;
-	ip_hdr.daddr = daddr;
-	ip_hdr.saddr = saddr;
-	ip_hdr.check = ip_checksum(&ip_hdr, sizeof(struct iphdr));
-	
-	icmp_hdr.checksum = icmp_checksum((uint16_t *)&icmp_hdr, sizeof(struct icmphdr));
-
-	payload = packet.payload;
-	memcpy(payload, &eth_hdr, sizeof(struct ether_header));
-	payload += sizeof(struct ether_header);
-	memcpy(payload, &ip_hdr, sizeof(struct iphdr));
-	payload += sizeof(struct iphdr);
-	memcpy(payload, &icmp_hdr, sizeof(struct icmphdr));
-	packet.len = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr);
-
-	send_packet(interface, &packet);
+	struct icmphdr *icmp_hdr = (struct icmphdr *) ((uint8_t *) ip_hdr + ip_hdr->ihl * 4);
+
+	// Back to the sender, from the interface the request came in on
+	memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, ETH_ALEN);
+	memcpy(eth_hdr->ether_shost, get_interface_info(m->interface)->mac, ETH_ALEN);
+
+	// Swapping the addresses leaves the IP checksum as is, the TTL does not
+	uint32_t saddr = ip_hdr->saddr;
+	ip_hdr->saddr = ip_hdr->daddr;
+	ip_hdr->daddr = saddr;
+
+	memcpy(&old, &ip_hdr->ttl, sizeof(old));
+	ip_hdr->ttl = 64;
+	memcpy(&new, &ip_hdr->ttl, sizeof(new));
+	ip_hdr->check = csum_update16(ip_hdr->check, old, new);
+
+	// Type is the high byte of the first ICMP word
+	memcpy(&old, icmp_hdr, sizeof(old));
+	icmp_hdr->type = ICMP_ECHOREPLY;
+	memcpy(&new, icmp_hdr, sizeof(new));
+	icmp_hdr->checksum = csum_update16(icmp_hdr->checksum, old, new);
+
+	return true;
 }
 
 void send_arp(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int interface, uint16_t arp_op)
 {
-	struct arp_header arp_hdr;
-	packet packet;
-
-	arp_hdr.htype = htons(ARPHRD_ETHER);
-	arp_hdr.ptype = htons(2048);
-	arp_hdr.op = arp_op;
-	arp_hdr.hlen = 6;
-	arp_hdr.plen = 4;
-	memcpy(arp_hdr.sha, eth_hdr->ether_shost, 6);
-	memcpy(arp_hdr.tha, eth_hdr->ether_dhost, 6);
-	arp_hdr.spa = saddr;
-	arp_hdr.tpa = daddr;
-	memset(packet.payload, 0, 1600);
-	memcpy(packet.payload, eth_hdr, sizeof(struct ethhdr));
-	memcpy(packet.payload + sizeof(struct ethhdr), &arp_hdr, sizeof(struct arp_header));
-	packet.len = sizeof(struct arp_header) + sizeof(struct ethhdr);
-	send_packet(interface, &packet);
+	packet *packet = pkt_alloc(pkt_pool);
+	if (!packet) {
+		stats->drops[STATS_DROP_NO_BUFFER]++;
+		return;
+	}
+
+	struct arp_header *arp_hdr = (struct arp_header *) (packet->payload + sizeof(struct ethhdr));
+
+	memcpy(packet->payload, eth_hdr, sizeof(struct ethhdr));
+	arp_hdr->htype = htons(ARPHRD_ETHER);
+	arp_hdr->ptype = htons(2048);
+	arp_hdr->op = arp_op;
+	arp_hdr->hlen = 6;
+	arp_hdr->plen = 4;
+	memcpy(arp_hdr->sha, eth_hdr->ether_shost, 6);
+	memcpy(arp_hdr->tha, eth_hdr->ether_dhost, 6);
+	arp_hdr->spa = saddr;
+	arp_hdr->tpa = daddr;
+	// Only the headers are sent: no need to clear the rest of the buffer
+	packet->len = sizeof(struct arp_header) + sizeof(struct ethhdr);
+
+	tx_enqueue_control(interface, packet);
+	pkt_free(packet);
 }
 
 struct arp_header* parse_arp(void *buffer)
@@ -368,109 +1176,104 @@ struct icmphdr * parse_icmp(void *buffer)
 }
 
 int read_rtable(struct route_table_entry *rtable, char *file_name) {
-	char buf[MAX_LEN];
-	char *token;
-
-	int i = 0;
-	int status = 1;
-
-	// Open rtable file
-	FILE *f = fopen(file_name, "r");
-
-	// Parse each line of rtable
-	while (fgets(buf, sizeof(buf), f)) {
-		// Prefix
-		token = strtok(buf, DELIM);
-		DIE((status = inet_pton(AF_INET, token, &rtable[i].prefix)) != 1, "rtable parsing - convert prefix");
-		// Convert to host endianness
-		rtable[i].prefix = ntohl(rtable[i].prefix);
+	int size;
+	struct route_table_entry *routes = rtable_load(file_name, 1, &size);
 
-		// Next_hop
-		token = strtok(NULL, DELIM);
-		DIE((status = inet_pton(AF_INET, token, &rtable[i].next_hop)) != 1, "rtable parsing - convert next_hop");
-		// Convert to host endianness
-		rtable[i].next_hop = ntohl(rtable[i].next_hop);
-		
-		// Mask
-		token = strtok(NULL, DELIM);
-		DIE((status = inet_pton(AF_INET, token, &rtable[i].mask)) != 1, "rtable parsing - convert mask");
-		// Convert to host endianness
-		rtable[i].mask = ntohl(rtable[i].mask);
+	// Fixed-size array: rtable_load itself has no limit
+	DIE(size > MAX_RTABLE_SIZE, "rtable parsing - too many routes");
+	memcpy(rtable, routes, size * sizeof(struct route_table_entry));
+	free(routes);
 
-		// Interface
-		token = strtok(NULL, DELIM);
-		rtable[i].interface = atoi(token);
-
-		// Proceed to next entry
-		i++;
-	}
-
-	// Close rtable file
-	fclose(f);
-
-	return i;
+	return size;
 }
 
 int route_entry_cmp(const void* a, const void* b) {
-	struct route_table_entry e1 = *(struct route_table_entry *) a;
-	struct route_table_entry e2 = *(struct route_table_entry *) b;
+	const struct route_table_entry *e1 = a;
+	const struct route_table_entry *e2 = b;
 
 	// Ascending prefix
-	if ((e1.prefix > e2.prefix) 
-		// Ascending mask: if prefix = equal, we want to pick the maximum mask
-		|| (e1.prefix == e2.prefix && e1.mask > e2.mask)) {
-		return 1;
+	if (e1->prefix != e2->prefix) {
+		return e1->prefix < e2->prefix ? -1 : 1;
+	}
+
+	// Ascending mask: if prefix = equal, we want to pick the maximum mask
+	if (e1->mask != e2->mask) {
+		return e1->mask < e2->mask ? -1 : 1;
 	}
 
 	return 0;
 }
 
+/* Whether route sorts before (prefix, mask), or is it */
+static inline bool route_not_after(const struct route_table_entry *route, uint32_t prefix, uint32_t mask) {
+	return route->prefix < prefix || (route->prefix == prefix && route->mask <= mask);
+}
+
 struct route_table_entry *get_best_route(uint32_t dest_ip, struct route_table_entry *rtable, int rtable_size) {
-	struct route_table_entry *best_route = NULL;
-	uint32_t effective_addr;
-
-	int lwr_bound = 0;
-	int upr_bound = rtable_size;
-	int mid;
-
-	while (lwr_bound <= upr_bound) {
-		mid = (lwr_bound + upr_bound) / 2;
-		effective_addr = rtable[mid].mask & dest_ip;
-
-		if (effective_addr < rtable[mid].prefix) {
-			// Restrain right interval
-			upr_bound = mid - 1;
-			// Update best_route
-			best_route = &rtable[mid];
-		}
-		else if (effective_addr == rtable[mid].prefix) {
-			// Target found
-			return &rtable[mid];
+	// Biggest (prefix, mask) we are looking for: dest_ip itself, at first
+	uint32_t key_prefix = dest_ip;
+	uint32_t key_mask = 0xffffffff;
+	int last = rtable_size - 1;
+
+	while (last >= 0) {
+		int lwr_bound = 0;
+		int upr_bound = last;
+		int mid;
+
+		// Searching again: the route is usually close, gallop down to it
+		if (key_mask != 0xffffffff) {
+			int step = 1;
+
+			mid = upr_bound;
+			while (mid > 0 && !route_not_after(&rtable[mid], key_prefix, key_mask)) {
+				upr_bound = mid - 1;
+				mid -= step;
+				step *= 2;
+			}
+			lwr_bound = mid > 0 ? mid : 0;
 		}
-		else {
-			// Restrain left interval
-			lwr_bound = mid + 1;
+
+		// Find the "biggest" route smaller or equal to the key
+		last = -1;
+		while (lwr_bound <= upr_bound) {
+			mid = (lwr_bound + upr_bound) / 2;
+
+			if (route_not_after(&rtable[mid], key_prefix, key_mask)) {
+				// Candidate found, look for a bigger one
+				last = mid;
+				lwr_bound = mid + 1;
+			}
+			else {
+				// Restrain right interval
+				upr_bound = mid - 1;
+			}
 		}
-	}
 
-	return best_route;
-}
+		if (last < 0) {
+			return NULL;
+		}
 
-struct arp_entry *get_arp_entry(uint32_t dest_ip, struct arp_entry *arp_table, int table_size) {
-	for (int i = 0; i < table_size; ++i) {
-		if (arp_table[i].ip == dest_ip) {
-			return &arp_table[i];
+		// Nothing after it covers dest_ip, and it is longer than what does
+		// before it: if it covers dest_ip, it is the best route
+		if ((dest_ip & rtable[last].mask) == rtable[last].prefix) {
+			return &rtable[last];
 		}
+
+		// Routes covering dest_ip cover its prefix too: they are no longer
+		// than the bits the two share, and sorted before it
+		uint32_t diff = dest_ip ^ rtable[last].prefix;
+		int common = diff ? __builtin_clz(diff) : 32;
+		key_mask = common ? 0xffffffff << (32 - common) : 0;
+		key_prefix = dest_ip & key_mask;
+		last--;
 	}
 
 	return NULL;
 }
 
-void update_arp_table(struct arp_entry *arp_table, int *arp_table_index, uint32_t ip, uint8_t *mac) {
-	struct arp_entry *new_entry = calloc(1, sizeof(struct arp_entry));
+uint64_t now_ms() {
+	struct timespec ts;
 
-	new_entry->ip = ip;
-	memcpy(new_entry->mac, mac, sizeof(new_entry->mac));
-
-	arp_table[(*arp_table_index)++] = *new_entry;
-}
\ No newline at end of file
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
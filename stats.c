@@ -0,0 +1,183 @@
+#include "stats.h"
+
+/* Counts of the threads without a block of their own (never read) */
+static struct stats_thread stats_scratch;
+__thread struct stats_thread *stats = &stats_scratch;
+
+static const char *stats_drop_names[] = {
+	[STATS_DROP_MALFORMED] = "malformed",
+	[STATS_DROP_UNSUPPORTED] = "unsupported",
+	[STATS_DROP_CHECKSUM] = "bad checksum",
+	[STATS_DROP_TTL] = "TTL expired",
+	[STATS_DROP_NO_ROUTE] = "no route",
+	[STATS_DROP_RESERVED] = "reserved dest",
+	[STATS_DROP_ARP_QUEUE] = "ARP queue full",
+	[STATS_DROP_ARP_TIMEOUT] = "ARP timeout",
+	[STATS_DROP_LOCAL] = "local, not echo",
+	[STATS_DROP_NO_BUFFER] = "no buffer",
+	[STATS_DROP_TX_QUEUE] = "TX queue full",
+	[STATS_DROP_TX_ERROR] = "TX error",
+};
+
+static const char *stats_event_names[] = {
+	[STATS_ARP_REQUEST_IN] = "ARP requests in",
+	[STATS_ARP_REPLY_IN] = "ARP replies in",
+	[STATS_ARP_REQUEST_OUT] = "ARP requests out",
+	[STATS_ARP_REPLY_OUT] = "ARP replies out",
+	[STATS_ND_SOLICIT_IN] = "NDP solicits in",
+	[STATS_ND_ADVERT_IN] = "NDP adverts in",
+	[STATS_ND_SOLICIT_OUT] = "NDP solicits out",
+	[STATS_ND_ADVERT_OUT] = "NDP adverts out",
+	[STATS_ICMP_ECHO_REPLY] = "ICMP echo replies",
+	[STATS_ICMP_ERROR] = "ICMP errors",
+	[STATS_ICMP_SUPPRESSED] = "ICMP rate limited",
+	[STATS_TX_BLOCKED] = "TX blocked",
+	[STATS_RX_ERROR] = "RX errors",
+	[STATS_ROUTE_CACHE_HIT] = "route cache hits",
+	[STATS_ROUTE_CACHE_MISS] = "route cache misses",
+};
+
+static const char *stats_stage_names[] = {
+	[STATS_STAGE_PARSE] = "parse",
+	[STATS_STAGE_LOOKUP] = "lookup",
+	[STATS_STAGE_NEIGHBOR] = "neighbor",
+	[STATS_STAGE_REWRITE] = "rewrite",
+	[STATS_STAGE_TX] = "tx",
+	[STATS_STAGE_FLUSH] = "flush",
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* stats_now() ticks per second, measured over 10 ms */
+static uint64_t stats_calibrate()
+{
+	uint64_t start_ns = now_ns(), start = stats_now();
+	struct timespec delay = { .tv_nsec = 10000000 };
+
+	nanosleep(&delay, NULL);
+	return (stats_now() - start) * 1000000000 / (now_ns() - start_ns);
+}
+
+struct stats_segment *stats_create(const char *name, int num_threads)
+{
+	struct stats_segment *segment;
+
+	DIE(num_threads < 1 || num_threads > STATS_MAX_THREADS, "stats - number of threads");
+
+	if (name) {
+		int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		DIE(fd == -1, "stats - shm_open");
+		DIE(ftruncate(fd, sizeof(struct stats_segment)) == -1, "stats - ftruncate");
+
+		segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		DIE(segment == MAP_FAILED, "stats - mmap");
+		close(fd);
+	} else {
+		segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		DIE(segment == MAP_FAILED, "stats - mmap");
+	}
+
+	segment->version = STATS_VERSION;
+	segment->num_threads = num_threads;
+	segment->num_interfaces = num_interfaces;
+	segment->tsc_hz = stats_calibrate();
+	segment->sample_shift = STATS_SAMPLE_SHIFT;
+	memcpy(segment->interface_names, interface_names, sizeof(segment->interface_names));
+
+	// Last: a reader seeing the magic sees the rest
+	__atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	return segment;
+}
+
+void stats_thread_init(struct stats_segment *segment, int id)
+{
+	DIE(id < 0 || (uint32_t) id >= segment->num_threads, "stats - thread id");
+
+	stats = &segment->threads[id];
+	stats->sample_countdown = 1;
+}
+
+void stats_print(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	DIE(fd == -1, "stats - shm_open");
+
+	struct stats_segment *segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+	DIE(segment == MAP_FAILED, "stats - mmap");
+	close(fd);
+
+	DIE(__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+		|| segment->version != STATS_VERSION, "stats - not a router stats segment");
+
+	// Sum the blocks of every thread
+	struct stats_thread *total = calloc(1, sizeof(struct stats_thread));
+	DIE(!total, "stats - calloc");
+
+	for (uint32_t t = 0; t < segment->num_threads; ++t) {
+		const struct stats_thread *thread = &segment->threads[t];
+
+		for (int i = 0; i < MAX_INTERFACES; ++i) {
+			total->rx[i] += thread->rx[i];
+			total->tx[i] += thread->tx[i];
+			total->tx_queued[i] += thread->tx_queued[i];
+			total->tx_dropped[i] += thread->tx_dropped[i];
+		}
+		for (int i = 0; i < STATS_DROP_MAX; ++i) {
+			total->drops[i] += thread->drops[i];
+		}
+		for (int i = 0; i < STATS_EVENT_MAX; ++i) {
+			total->events[i] += thread->events[i];
+		}
+		total->bursts += thread->bursts;
+		for (int s = 0; s < STATS_STAGE_MAX; ++s) {
+			for (int i = 0; i < STATS_HIST_BUCKETS; ++i) {
+				total->stages[s][i] += thread->stages[s][i];
+			}
+		}
+	}
+
+	printf("%u threads, %lu bursts\n", segment->num_threads, total->bursts);
+	for (uint32_t i = 0; i < segment->num_interfaces; ++i) {
+		printf("  %-16s rx %12lu  tx %12lu  queued %5lu  tx dropped %12lu\n", segment->interface_names[i],
+			total->rx[i], total->tx[i], total->tx_queued[i], total->tx_dropped[i]);
+	}
+
+	printf("drops:\n");
+	for (int i = 0; i < STATS_DROP_MAX; ++i) {
+		printf("  %-20s %12lu\n", stats_drop_names[i], total->drops[i]);
+	}
+
+	printf("events:\n");
+	for (int i = 0; i < STATS_EVENT_MAX; ++i) {
+		printf("  %-20s %12lu\n", stats_event_names[i], total->events[i]);
+	}
+
+	// Cycles -> ns
+	double ns = 1e9 / segment->tsc_hz;
+	char title[64];
+	snprintf(title, sizeof(title), "stages (ns, 1 packet in %u):", 1u << segment->sample_shift);
+	printf("%-32s %8s %8s %8s %8s %9s\n", title, "p50", "p90", "p99", "p99.9", "samples");
+	for (int s = 0; s < STATS_STAGE_MAX; ++s) {
+		const uint64_t *hist = total->stages[s];
+		uint64_t samples = 0;
+
+		for (int i = 0; i < STATS_HIST_BUCKETS; ++i) {
+			samples += hist[i];
+		}
+
+		printf("  %-30s %8.0f %8.0f %8.0f %8.0f %9lu\n", stats_stage_names[s],
+			histogram_percentile(hist, STATS_HIST_SUB_BITS, 0.5) * ns,
+			histogram_percentile(hist, STATS_HIST_SUB_BITS, 0.9) * ns,
+			histogram_percentile(hist, STATS_HIST_SUB_BITS, 0.99) * ns,
+			histogram_percentile(hist, STATS_HIST_SUB_BITS, 0.999) * ns, samples);
+	}
+
+	free(total);
+	munmap(segment, sizeof(struct stats_segment));
+}
@@ -0,0 +1,144 @@
+#include "tpacket.h"
+#include "pktpool.h"
+
+struct tpacket_ring *tpacket_ring_create(int fd)
+{
+	int version = TPACKET_V3;
+	int res;
+
+	struct tpacket_ring *ring = calloc(1, sizeof(struct tpacket_ring));
+	DIE(!ring, "tpacket - calloc");
+	ring->fd = fd;
+
+	res = setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+	DIE(res == -1, "setsockopt PACKET_VERSION");
+
+	// RX: variable-size frames packed in blocks
+	struct tpacket_req3 rx_req;
+	memset(&rx_req, 0, sizeof(rx_req));
+	rx_req.tp_block_size = TPACKET_RX_BLOCK_SIZE;
+	rx_req.tp_block_nr = TPACKET_RX_BLOCK_NR;
+	rx_req.tp_frame_size = TPACKET_TX_FRAME_SIZE;
+	rx_req.tp_frame_nr = TPACKET_RX_BLOCK_SIZE / TPACKET_TX_FRAME_SIZE * TPACKET_RX_BLOCK_NR;
+	rx_req.tp_retire_blk_tov = TPACKET_RX_TIMEOUT_MS;
+	res = setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req));
+	DIE(res == -1, "setsockopt PACKET_RX_RING");
+
+	// TX: fixed-size slots
+	struct tpacket_req3 tx_req;
+	memset(&tx_req, 0, sizeof(tx_req));
+	tx_req.tp_block_size = TPACKET_TX_BLOCK_SIZE;
+	tx_req.tp_block_nr = TPACKET_TX_BLOCK_NR;
+	tx_req.tp_frame_size = TPACKET_TX_FRAME_SIZE;
+	tx_req.tp_frame_nr = TPACKET_TX_BLOCK_SIZE / TPACKET_TX_FRAME_SIZE * TPACKET_TX_BLOCK_NR;
+	res = setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req));
+	DIE(res == -1, "setsockopt PACKET_TX_RING");
+
+	// Both rings live in one mapping, RX first
+	size_t rx_size = (size_t) TPACKET_RX_BLOCK_SIZE * TPACKET_RX_BLOCK_NR;
+	size_t tx_size = (size_t) TPACKET_TX_BLOCK_SIZE * TPACKET_TX_BLOCK_NR;
+	ring->map_size = rx_size + tx_size;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	DIE(ring->map == MAP_FAILED, "mmap PACKET_MMAP rings");
+
+	ring->rx = ring->map;
+	ring->tx = ring->map + rx_size;
+	ring->tx_frame_nr = tx_req.tp_frame_nr;
+
+	return ring;
+}
+
+void tpacket_ring_free(struct tpacket_ring *ring)
+{
+	if (!ring) {
+		return;
+	}
+
+	munmap(ring->map, ring->map_size);
+	free(ring);
+}
+
+static inline struct tpacket_block_desc *tpacket_rx_block(struct tpacket_ring *ring)
+{
+	return (struct tpacket_block_desc *) (ring->rx + (size_t) ring->rx_block * TPACKET_RX_BLOCK_SIZE);
+}
+
+int tpacket_rx(struct tpacket_ring *ring, packet **m, int max, int interface)
+{
+	int count = 0;
+
+	while (count < max) {
+		struct tpacket_block_desc *block = tpacket_rx_block(ring);
+
+		// Start on the current block once the kernel has retired it
+		if (!ring->rx_frame) {
+			if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+				break;
+			}
+
+			ring->rx_frame = (struct tpacket3_hdr *) ((uint8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+			ring->rx_left = block->hdr.bh1.num_pkts;
+		}
+
+		if (ring->rx_left) {
+			packet *buf = pkt_alloc(pkt_pool);
+			if (!buf) {
+				break;
+			}
+
+			uint32_t len = ring->rx_frame->tp_snaplen < MAX_LEN ? ring->rx_frame->tp_snaplen : MAX_LEN;
+			memcpy(buf->payload, (uint8_t *) ring->rx_frame + ring->rx_frame->tp_mac, len);
+			buf->len = len;
+			buf->interface = interface;
+			m[count++] = buf;
+
+			ring->rx_frame = (struct tpacket3_hdr *) ((uint8_t *) ring->rx_frame + ring->rx_frame->tp_next_offset);
+			ring->rx_left--;
+		}
+
+		// Block fully read -> hand it back to the kernel
+		if (!ring->rx_left) {
+			__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+			ring->rx_block = (ring->rx_block + 1) % TPACKET_RX_BLOCK_NR;
+			ring->rx_frame = NULL;
+		}
+	}
+
+	return count;
+}
+
+int tpacket_tx(struct tpacket_ring *ring, packet **m, int count)
+{
+	int queued = 0;
+
+	for (int i = 0; i < count; ++i) {
+		struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) (ring->tx + (size_t) ring->tx_slot * TPACKET_TX_FRAME_SIZE);
+
+		// Ring full: kick the kernel without waiting for it, the frames that
+		// still do not fit stay with the caller
+		if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+			send(ring->fd, NULL, 0, MSG_DONTWAIT);
+
+			if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+				break;
+			}
+		}
+
+		memcpy((uint8_t *) hdr + TPACKET_TX_DATA_OFFSET, m[i]->payload, m[i]->len);
+		hdr->tp_len = m[i]->len;
+		hdr->tp_snaplen = m[i]->len;
+		hdr->tp_next_offset = 0;
+		__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+		ring->tx_slot = (ring->tx_slot + 1) % ring->tx_frame_nr;
+		queued++;
+	}
+
+	// One syscall for the whole batch
+	if (queued) {
+		int res = send(ring->fd, NULL, 0, MSG_DONTWAIT);
+		DIE(res == -1 && errno != EAGAIN && errno != ENOBUFS, "send TX ring");
+	}
+
+	return queued;
+}
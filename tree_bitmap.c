@@ -0,0 +1,469 @@
+#include "tree_bitmap.h"
+
+/*
+ * For every 4-bit chunk, the internal bitmap positions of the prefixes of
+ * length 0..3 that match it. Position grows with prefix length, so the
+ * highest set bit of (internal & mask) is the longest match in the node.
+ */
+static const uint16_t tbm_match_mask[1 << TBM_STRIDE] = {
+#define TBM_MATCH(c) ((1u << 0) | (1u << (1 + ((c) >> 3))) | (1u << (3 + ((c) >> 2))) | (1u << (7 + ((c) >> 1))))
+	TBM_MATCH(0), TBM_MATCH(1), TBM_MATCH(2), TBM_MATCH(3),
+	TBM_MATCH(4), TBM_MATCH(5), TBM_MATCH(6), TBM_MATCH(7),
+	TBM_MATCH(8), TBM_MATCH(9), TBM_MATCH(10), TBM_MATCH(11),
+	TBM_MATCH(12), TBM_MATCH(13), TBM_MATCH(14), TBM_MATCH(15),
+#undef TBM_MATCH
+};
+
+static inline int tbm_rank(uint16_t bitmap, int bit)
+{
+	return __builtin_popcount(bitmap & ((1u << bit) - 1));
+}
+
+static inline uint32_t tbm_chunk(uint32_t addr, int depth)
+{
+	int shift = 32 - (depth + 1) * TBM_STRIDE;
+
+	return shift >= 0 ? (addr >> shift) & ((1u << TBM_STRIDE) - 1) : 0;
+}
+
+/* First pool arrays: grown by doubling */
+#define TBM_POOL_MIN_CAPACITY 64
+
+static inline int tbm_node_pool(int depth)
+{
+	return depth;
+}
+
+static inline int tbm_result_pool(int depth)
+{
+	return TBM_MAX_DEPTH + depth;
+}
+
+static inline struct tbm_node *tbm_nodes(struct tree_bitmap *tbm, int depth)
+{
+	return tbm->pools[tbm_node_pool(depth)].base;
+}
+
+static inline struct route_table_entry **tbm_results(struct tree_bitmap *tbm, int depth)
+{
+	return tbm->pools[tbm_result_pool(depth)].base;
+}
+
+struct tree_bitmap *tbm_create()
+{
+	struct tree_bitmap *tbm = calloc(1, sizeof(struct tree_bitmap));
+	DIE(!tbm, "tbm - calloc");
+
+	for (int depth = 0; depth < TBM_MAX_DEPTH; ++depth) {
+		tbm->pools[tbm_node_pool(depth)].element_size = sizeof(struct tbm_node);
+		tbm->pools[tbm_result_pool(depth)].element_size = sizeof(struct route_table_entry *);
+	}
+
+	tbm->free = calloc(TBM_POOLS * (TBM_MAX_BLOCK + 1), sizeof(struct tbm_free_list));
+	DIE(!tbm->free, "tbm - calloc free lists");
+
+	tbm->nodes = 1;
+	return tbm;
+}
+
+struct tree_bitmap *tbm_build(struct route_table_entry *rtable, int rtable_size)
+{
+	struct tree_bitmap *tbm = tbm_create();
+
+	for (int i = 0; i < rtable_size; ++i) {
+		tbm_insert(tbm, rtable[i].prefix, __builtin_popcount(rtable[i].mask), &rtable[i]);
+	}
+
+	return tbm;
+}
+
+struct tree_bitmap *tbm_clone(struct tree_bitmap *tbm)
+{
+	struct tree_bitmap *clone = malloc(sizeof(struct tree_bitmap));
+	DIE(!clone, "tbm - malloc");
+
+	*clone = *tbm;
+	clone->shared = true;
+	clone->retired = NULL;
+	clone->retired_count = 0;
+	clone->retired_capacity = 0;
+	clone->retired_bases = NULL;
+	clone->retired_base_count = 0;
+	clone->retired_base_capacity = 0;
+	return clone;
+}
+
+static void tbm_free_block(struct tree_bitmap *tbm, int pool, uint32_t first, int length)
+{
+	struct tbm_free_list *list = &tbm->free[pool * (TBM_MAX_BLOCK + 1) + length];
+
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 16;
+		list->blocks = realloc(list->blocks, list->capacity * sizeof(uint32_t));
+		DIE(!list->blocks, "tbm - realloc free list");
+	}
+
+	list->blocks[list->count++] = first;
+}
+
+void tbm_release_retired(struct tree_bitmap *tbm)
+{
+	for (int i = 0; i < tbm->retired_count; ++i) {
+		tbm_free_block(tbm, tbm->retired[i].pool, tbm->retired[i].first, tbm->retired[i].length);
+	}
+	for (int i = 0; i < tbm->retired_base_count; ++i) {
+		free(tbm->retired_bases[i]);
+	}
+
+	free(tbm->retired);
+	tbm->retired = NULL;
+	tbm->retired_count = 0;
+	tbm->retired_capacity = 0;
+	free(tbm->retired_bases);
+	tbm->retired_bases = NULL;
+	tbm->retired_base_count = 0;
+	tbm->retired_base_capacity = 0;
+}
+
+void tbm_free(struct tree_bitmap *tbm)
+{
+	if (!tbm) {
+		return;
+	}
+
+	for (int pool = 0; pool < TBM_POOLS; ++pool) {
+		free(tbm->pools[pool].base);
+	}
+	for (int i = 0; i < TBM_POOLS * (TBM_MAX_BLOCK + 1); ++i) {
+		free(tbm->free[i].blocks);
+	}
+	for (int i = 0; i < tbm->retired_base_count; ++i) {
+		free(tbm->retired_bases[i]);
+	}
+
+	free(tbm->free);
+	free(tbm->retired);
+	free(tbm->retired_bases);
+	free(tbm);
+}
+
+/*
+	Blocks (the children or the results of a node) are resized through these
+	helpers. In a clone, a block may still be read by older versions: it is
+	never modified in place but copied, and the original is kept on the
+	retired list until the clone is published.
+*/
+static void tbm_retire(struct tree_bitmap *tbm, int pool, uint32_t first, int length)
+{
+	if (!tbm->shared) {
+		tbm_free_block(tbm, pool, first, length);
+		return;
+	}
+
+	if (tbm->retired_count == tbm->retired_capacity) {
+		tbm->retired_capacity = tbm->retired_capacity ? 2 * tbm->retired_capacity : 64;
+		tbm->retired = realloc(tbm->retired, tbm->retired_capacity * sizeof(struct tbm_block));
+		DIE(!tbm->retired, "tbm - realloc retired");
+	}
+
+	tbm->retired[tbm->retired_count++] = (struct tbm_block) { first, pool, length };
+}
+
+/* Makes room for length more elements at the end of pool */
+static void tbm_pool_grow(struct tree_bitmap *tbm, struct tbm_pool *pool, uint32_t length)
+{
+	uint32_t capacity = pool->capacity ? 2 * pool->capacity : TBM_POOL_MIN_CAPACITY;
+	while (capacity < pool->size + length) {
+		capacity *= 2;
+	}
+
+	if (!tbm->shared) {
+		pool->base = realloc(pool->base, (size_t) capacity * pool->element_size);
+		DIE(!pool->base, "tbm - realloc pool");
+	} else {
+		// Older versions keep reading the old array
+		void *base = malloc((size_t) capacity * pool->element_size);
+		DIE(!base, "tbm - malloc pool");
+
+		memcpy(base, pool->base, (size_t) pool->size * pool->element_size);
+		if (pool->base) {
+			if (tbm->retired_base_count == tbm->retired_base_capacity) {
+				tbm->retired_base_capacity = tbm->retired_base_capacity ? 2 * tbm->retired_base_capacity : 16;
+				tbm->retired_bases = realloc(tbm->retired_bases, tbm->retired_base_capacity * sizeof(void *));
+				DIE(!tbm->retired_bases, "tbm - realloc retired pools");
+			}
+			tbm->retired_bases[tbm->retired_base_count++] = pool->base;
+		}
+		pool->base = base;
+	}
+
+	pool->capacity = capacity;
+}
+
+/* First index of a new block of length elements of pool */
+static uint32_t tbm_alloc(struct tree_bitmap *tbm, int pool, int length)
+{
+	struct tbm_free_list *list = &tbm->free[pool * (TBM_MAX_BLOCK + 1) + length];
+	struct tbm_pool *p = &tbm->pools[pool];
+
+	if (list->count) {
+		return list->blocks[--list->count];
+	}
+
+	if (p->size + length > p->capacity) {
+		tbm_pool_grow(tbm, p, length);
+	}
+
+	uint32_t first = p->size;
+	p->size += length;
+	return first;
+}
+
+static inline uint8_t *tbm_element(struct tree_bitmap *tbm, int pool, uint32_t index)
+{
+	return (uint8_t *) tbm->pools[pool].base + (size_t) index * tbm->pools[pool].element_size;
+}
+
+/* Block of count elements of pool, with a hole opened at idx */
+static uint32_t tbm_block_insert(struct tree_bitmap *tbm, int pool, uint32_t first, int count, int idx)
+{
+	size_t size = tbm->pools[pool].element_size;
+	uint32_t copy = tbm_alloc(tbm, pool, count + 1);
+
+	// The pool may have moved: addresses are taken after the allocation
+	memcpy(tbm_element(tbm, pool, copy), tbm_element(tbm, pool, first), idx * size);
+	memcpy(tbm_element(tbm, pool, copy + idx + 1), tbm_element(tbm, pool, first + idx), (count - idx) * size);
+	if (count) {
+		tbm_retire(tbm, pool, first, count);
+	}
+
+	return copy;
+}
+
+/* Block of count elements of pool, without element idx */
+static uint32_t tbm_block_remove(struct tree_bitmap *tbm, int pool, uint32_t first, int count, int idx)
+{
+	size_t size = tbm->pools[pool].element_size;
+	uint32_t copy = 0;
+
+	if (count > 1) {
+		copy = tbm_alloc(tbm, pool, count - 1);
+
+		memcpy(tbm_element(tbm, pool, copy), tbm_element(tbm, pool, first), idx * size);
+		memcpy(tbm_element(tbm, pool, copy + idx), tbm_element(tbm, pool, first + idx + 1),
+			(count - idx - 1) * size);
+	}
+	tbm_retire(tbm, pool, first, count);
+
+	return copy;
+}
+
+/* Block of count elements of pool, made safe to write into */
+static uint32_t tbm_block_own(struct tree_bitmap *tbm, int pool, uint32_t first, int count)
+{
+	if (!tbm->shared || !count) {
+		return first;
+	}
+
+	uint32_t copy = tbm_alloc(tbm, pool, count);
+
+	memcpy(tbm_element(tbm, pool, copy), tbm_element(tbm, pool, first), count * tbm->pools[pool].element_size);
+	tbm_retire(tbm, pool, first, count);
+	return copy;
+}
+
+/* node is at depth: its children are in the node pool of depth + 1, which node is not part of */
+static struct tbm_node *tbm_add_child(struct tree_bitmap *tbm, struct tbm_node *node, int depth, uint32_t chunk)
+{
+	int pool = tbm_node_pool(depth + 1);
+	int idx = tbm_rank(node->external, chunk);
+	int count = __builtin_popcount(node->external);
+
+	// The child is about to be modified
+	if (node->external & (1u << chunk)) {
+		node->children = tbm_block_own(tbm, pool, node->children, count);
+		return &tbm_nodes(tbm, depth + 1)[node->children + idx];
+	}
+
+	node->children = tbm_block_insert(tbm, pool, node->children, count, idx);
+	node->external |= 1u << chunk;
+	tbm->nodes++;
+
+	struct tbm_node *child = &tbm_nodes(tbm, depth + 1)[node->children + idx];
+	memset(child, 0, sizeof(struct tbm_node));
+	return child;
+}
+
+static void tbm_remove_child(struct tree_bitmap *tbm, struct tbm_node *node, int depth, uint32_t chunk)
+{
+	int idx = tbm_rank(node->external, chunk);
+	int count = __builtin_popcount(node->external);
+
+	node->children = tbm_block_remove(tbm, tbm_node_pool(depth + 1), node->children, count, idx);
+	node->external &= ~(1u << chunk);
+	tbm->nodes--;
+}
+
+/* Position of prefix/len in the internal bitmap of the node it ends in */
+static inline int tbm_internal_pos(uint32_t prefix, int len)
+{
+	int rel = len % TBM_STRIDE;
+	uint32_t value = rel ? (prefix >> (32 - len)) & ((1u << rel) - 1) : 0;
+
+	return (1 << rel) - 1 + value;
+}
+
+int tbm_insert(struct tree_bitmap *tbm, uint32_t prefix, int len, struct route_table_entry *route)
+{
+	struct tbm_node *node = &tbm->root;
+	int depth;
+
+	for (depth = 0; depth < len / TBM_STRIDE; ++depth) {
+		node = tbm_add_child(tbm, node, depth, tbm_chunk(prefix, depth));
+	}
+
+	int pool = tbm_result_pool(depth);
+	int pos = tbm_internal_pos(prefix, len);
+	int idx = tbm_rank(node->internal, pos);
+
+	int count = __builtin_popcount(node->internal);
+
+	// Prefix already present -> replace its route
+	if (node->internal & (1u << pos)) {
+		node->results = tbm_block_own(tbm, pool, node->results, count);
+		tbm_results(tbm, depth)[node->results + idx] = route;
+		return 0;
+	}
+
+	node->results = tbm_block_insert(tbm, pool, node->results, count, idx);
+	tbm_results(tbm, depth)[node->results + idx] = route;
+	node->internal |= 1u << pos;
+	tbm->prefixes++;
+
+	return 1;
+}
+
+int tbm_delete(struct tree_bitmap *tbm, uint32_t prefix, int len)
+{
+	struct tbm_node *path[TBM_MAX_DEPTH];
+	struct tbm_node *node = &tbm->root;
+	int depth;
+
+	// Walk down, remembering the path for pruning
+	for (depth = 0; depth < len / TBM_STRIDE; ++depth) {
+		uint32_t chunk = tbm_chunk(prefix, depth);
+
+		if (!(node->external & (1u << chunk))) {
+			return -1;
+		}
+
+		path[depth] = node;
+		node->children = tbm_block_own(tbm, tbm_node_pool(depth + 1), node->children,
+			__builtin_popcount(node->external));
+		node = &tbm_nodes(tbm, depth + 1)[node->children + tbm_rank(node->external, chunk)];
+	}
+
+	int pos = tbm_internal_pos(prefix, len);
+	if (!(node->internal & (1u << pos))) {
+		return -1;
+	}
+
+	int idx = tbm_rank(node->internal, pos);
+	int count = __builtin_popcount(node->internal);
+
+	node->results = tbm_block_remove(tbm, tbm_result_pool(depth), node->results, count, idx);
+	node->internal &= ~(1u << pos);
+	tbm->prefixes--;
+
+	// Prune the nodes left without prefixes or children, bottom-up
+	while (depth > 0 && !node->internal && !node->external) {
+		depth--;
+		node = path[depth];
+		tbm_remove_child(tbm, node, depth, tbm_chunk(prefix, depth));
+	}
+
+	return 0;
+}
+
+/*
+	One lookup step: records the longest prefix of node (at depth) matching
+	dest_ip and returns the child to continue with, or NULL when the walk is
+	over. The child is one indexed load into the node pool of the next depth.
+*/
+static inline struct tbm_node *tbm_step(struct tree_bitmap *tbm, struct tbm_node *node, uint32_t dest_ip,
+	int depth, struct route_table_entry **best_route)
+{
+	uint32_t chunk = tbm_chunk(dest_ip, depth);
+	uint32_t match = node->internal & tbm_match_mask[chunk];
+
+	// Longest prefix ending in this node
+	if (match) {
+		int pos = 31 - __builtin_clz(match);
+		*best_route = tbm_results(tbm, depth)[node->results + tbm_rank(node->internal, pos)];
+	}
+
+	if (!(node->external & (1u << chunk))) {
+		return NULL;
+	}
+
+	return &tbm_nodes(tbm, depth + 1)[node->children + tbm_rank(node->external, chunk)];
+}
+
+struct route_table_entry *tbm_lookup(struct tree_bitmap *tbm, uint32_t dest_ip)
+{
+	struct route_table_entry *best_route = NULL;
+	struct tbm_node *node = &tbm->root;
+
+	for (int depth = 0; node; ++depth) {
+		node = tbm_step(tbm, node, dest_ip, depth, &best_route);
+	}
+
+	return best_route;
+}
+
+void tbm_lookup_bulk(struct tree_bitmap *tbm, const uint32_t *daddrs, int n, struct route_table_entry **out)
+{
+	struct tbm_node *nodes[MAX_BURST];
+
+	for (int i = 0; i < n; i += MAX_BURST) {
+		int burst = n - i < MAX_BURST ? n - i : MAX_BURST;
+
+		for (int j = 0; j < burst; ++j) {
+			nodes[j] = &tbm->root;
+			out[i + j] = NULL;
+		}
+
+		// Advance every walk by one level per pass, prefetching the next node
+		// so it is in cache by the time the next pass reaches it
+		int active = burst;
+		for (int depth = 0; active; ++depth) {
+			active = 0;
+
+			for (int j = 0; j < burst; ++j) {
+				if (!nodes[j]) {
+					continue;
+				}
+
+				nodes[j] = tbm_step(tbm, nodes[j], daddrs[i + j], depth, &out[i + j]);
+				if (nodes[j]) {
+					__builtin_prefetch(nodes[j]);
+					active++;
+				}
+			}
+		}
+	}
+}
+
+size_t tbm_memory(struct tree_bitmap *tbm)
+{
+	size_t bytes = sizeof(struct tree_bitmap);
+
+	for (int pool = 0; pool < TBM_POOLS; ++pool) {
+		bytes += (size_t) tbm->pools[pool].capacity * tbm->pools[pool].element_size;
+	}
+	for (int i = 0; i < TBM_POOLS * (TBM_MAX_BLOCK + 1); ++i) {
+		bytes += (size_t) tbm->free[i].capacity * sizeof(uint32_t);
+	}
+
+	return bytes;
+}